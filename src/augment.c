@@ -0,0 +1,123 @@
+#include <string.h>
+#include "augment.h"
+
+AugmentConfig
+augment_cifar_config ( void )
+{
+  return (AugmentConfig) {
+    .width     = 32,
+    .height    = 32,
+    .channels  = 3,
+    .pad       = 4,
+    .flip      = true,
+    .normalize = true,
+    .mean      = { 0.4914, 0.4822, 0.4465 },
+    .std       = { 0.2470, 0.2435, 0.2616 }
+  };
+}
+
+/* one output row: the source row shifted by dx (zeros outside it), optionally
+   mirrored */
+static void
+augment_row ( const double *restrict src, double *restrict dst, const size_t width,
+              const long dx, const bool flip )
+{
+  const long w = (long) width;
+
+  /* destination columns that land inside the source */
+  long x0 = dx < 0 ? -dx : 0;
+  long x1 = dx > 0 ? w - dx : w;
+
+  if ( !flip ) {
+    for ( long x = 0; x < x0; ++x )
+      dst[x] = 0.0;
+    memcpy( dst + x0, src + x0 + dx, sizeof(double) * ( x1 - x0 ) );
+    for ( long x = x1; x < w; ++x )
+      dst[x] = 0.0;
+    return;
+  }
+
+  /* flipped: dst[x] = cropped[w - 1 - x] */
+  for ( long x = 0; x < w - x1; ++x )
+    dst[x] = 0.0;
+  for ( long x = w - x1; x < w - x0; ++x )
+    dst[x] = src[ w - 1 - x + dx ];
+  for ( long x = w - x0; x < w; ++x )
+    dst[x] = 0.0;
+}
+
+void
+augment_image ( const AugmentConfig *config, const double *src, double *dst,
+                uint64_t random_bits )
+{
+  const size_t width = config->width, height = config->height;
+  const size_t plane = width * height;
+  const long pad = (long) config->pad;
+
+  long dx = 0, dy = 0;
+  if ( pad > 0 ) {
+    dx = (long) ( random_bits % ( 2 * pad + 1 ) ) - pad;
+    random_bits /= 2 * pad + 1;
+    dy = (long) ( random_bits % ( 2 * pad + 1 ) ) - pad;
+    random_bits /= 2 * pad + 1;
+  }
+  const bool flip = config->flip && ( random_bits & 1 );
+
+  for ( size_t c = 0; c < config->channels; ++c ) {
+    const double *src_plane = src + c * plane;
+    double *restrict dst_plane = dst + c * plane;
+
+    for ( size_t y = 0; y < height; ++y ) {
+      long sy = (long) y + dy;
+      double *dst_row = dst_plane + y * width;
+
+      if ( sy < 0 || sy >= (long) height )
+        memset( dst_row, 0, sizeof(double) * width );
+      else
+        augment_row( src_plane + sy * width, dst_row, width, dx, flip );
+    }
+
+    if ( config->normalize ) {
+      const double mean = config->mean[c], inv_std = 1.0 / config->std[c];
+      for ( size_t i = 0; i < plane; ++i )
+        dst_plane[i] = ( dst_plane[i] - mean ) * inv_std;
+    }
+  }
+}
+
+void
+augment_fold_normalization ( const AugmentConfig *config, double *weights, double *biases,
+                             const size_t rows, const bool unfold )
+{
+  if ( !config->normalize )
+    return;
+
+  const size_t plane = config->width * config->height;
+  const size_t cols = plane * config->channels;
+
+  /* w . (x - m) / s + b  ==  (w / s) . x + (b - sum(w m / s)) */
+  for ( size_t r = 0; r < rows; ++r ) {
+    double *w = weights + r * cols;
+    double shift = 0.0;
+
+    for ( size_t c = 0; c < config->channels; ++c ) {
+      const double mean = config->mean[c], std = config->std[c];
+      double *w_plane = w + c * plane;
+
+      if ( unfold ) {
+        /* raw weights w' = w / s back to w, bias b' = b - sum(w' m) */
+        for ( size_t i = 0; i < plane; ++i ) {
+          shift += w_plane[i] * mean;
+          w_plane[i] *= std;
+        }
+      } else {
+        for ( size_t i = 0; i < plane; ++i ) {
+          w_plane[i] /= std;
+          shift += w_plane[i] * mean;
+        }
+      }
+    }
+
+    biases[r] += unfold ? shift : -shift;
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef AUGMENT_HEADER
+#define AUGMENT_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AUGMENT_MAX_CHANNELS 4
+
+/* on-the-fly augmentation of planar images (channel, row, column), run by
+   the sampler's loader threads while staging each mini-batch */
+typedef struct {
+  size_t width, height, channels;
+
+  size_t pad;       /* random crop from the image zero-padded by this much */
+  bool   flip;      /* random horizontal flip */
+  bool   normalize; /* (x - mean) / std per channel */
+  double mean[ AUGMENT_MAX_CHANNELS ], std[ AUGMENT_MAX_CHANNELS ];
+} AugmentConfig;
+
+/* pad 4 + flip + normalization with the CIFAR-10 training set statistics */
+AugmentConfig augment_cifar_config ( void );
+
+/* writes one augmented copy of src to dst. the crop offset and flip are
+   drawn from random_bits, so the same bits always give the same image */
+void augment_image ( const AugmentConfig *config, const double *src, double *dst,
+                     uint64_t random_bits );
+
+/* a linear layer trained on normalized inputs, rewritten so it takes the raw
+   inputs instead (or back again with unfold), so inference never has to
+   normalize. weights are rows x (channels * height * width) */
+void augment_fold_normalization ( const AugmentConfig *config, double *weights, double *biases,
+                                  const size_t rows, const bool unfold );
+
+#endif
@@ -0,0 +1,290 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "regression.h"
+#include "rls.h"
+#include "sparse.h"
+#include "tensor.h"
+#include "util.h"
+
+/* runs enough repetitions to fill ~0.25s, returns the best GB/s */
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MAX_REPS    16
+
+typedef enum { BENCH_MEMCPY, BENCH_TRANSPOSE, BENCH_TRANSPOSE_INPLACE } BenchKind;
+
+static double
+bench_run ( BenchKind kind, Tensor2D *src, Tensor2D *dst )
+{
+  const size_t bytes = sizeof(double) * src->rows * src->cols;
+  double best = 0, start = now_seconds();
+
+  for ( size_t rep = 0; rep < BENCH_MAX_REPS; ++rep ) {
+    double t0 = now_seconds();
+    switch ( kind ) {
+    case BENCH_MEMCPY:
+      memcpy( dst->data, src->data, bytes );
+      break;
+    case BENCH_TRANSPOSE:
+      Tensor2D_transpose_into( src, dst );
+      break;
+    case BENCH_TRANSPOSE_INPLACE:
+      Tensor2D_transpose_inplace( src );
+      break;
+    }
+    double elapsed = now_seconds() - t0;
+
+    double gbps = 2.0 * bytes / elapsed / 1e9;
+    if ( gbps > best )
+      best = gbps;
+    if ( now_seconds() - start > BENCH_MIN_SECONDS )
+      break;
+  }
+
+  return best;
+}
+
+void
+bench_transpose ( size_t max_n )
+{
+  printf( "%8s %12s %12s %12s\n", "n", "memcpy GB/s", "transpose", "in-place" );
+
+  for ( size_t n = 1024; n <= max_n; n *= 2 ) {
+    /* allocated by hand so a size that doesn't fit is skipped, not fatal */
+    const size_t bytes = sizeof(double) * n * n;
+    Tensor2D src = { .data = malloc( bytes ), .rows = n, .cols = n };
+    Tensor2D dst = { .data = malloc( bytes ), .rows = n, .cols = n };
+
+    if ( !src.data || !dst.data ) {
+      printf( "%8zu  skipped (couldn't allocate 2 x %.1f GiB)\n",
+              n, bytes / (double) ( 1 << 30 ) );
+      free( src.data );
+      free( dst.data );
+      break;
+    }
+
+    /* fault every page in before timing anything */
+    for ( size_t i = 0; i < n * n; ++i )
+      src.data[i] = (double) i;
+    memset( dst.data, 0, bytes );
+
+    double copy      = bench_run( BENCH_MEMCPY, &src, &dst );
+    double transpose = bench_run( BENCH_TRANSPOSE, &src, &dst );
+    double inplace   = bench_run( BENCH_TRANSPOSE_INPLACE, &src, NULL );
+
+    printf( "%8zu %12.2f %12.2f %12.2f\n", n, copy, transpose, inplace );
+    fflush( stdout );
+
+    free( src.data );
+    free( dst.data );
+  }
+}
+
+void
+bench_regressions ( size_t num_series, size_t series_len )
+{
+  const size_t points = num_series * series_len;
+  double *x = malloc( points * sizeof(double) );
+  double *y = malloc( points * sizeof(double) );
+  size_t *offsets = malloc( ( num_series + 1 ) * sizeof(size_t) );
+
+  if ( !x || !y || !offsets ) {
+    printf( "skipped (couldn't allocate %zu points)\n", points );
+    free( x );
+    free( y );
+    free( offsets );
+    return;
+  }
+
+  /* y = 2x + 1 + a little deterministic noise */
+  for ( size_t i = 0; i < points; ++i ) {
+    x[i] = (double) ( i % series_len );
+    y[i] = 2.0 * x[i] + 1.0 + ( ( i * 2654435761u ) % 1000 ) * 1e-4;
+  }
+  for ( size_t s = 0; s <= num_series; ++s )
+    offsets[s] = s * series_len;
+
+  double best = 0, start = now_seconds();
+  for ( size_t rep = 0; rep < BENCH_MAX_REPS; ++rep ) {
+    double t0 = now_seconds();
+    RegressionResult *results = calculate_linear_regressions( x, y, offsets, num_series );
+    double elapsed = now_seconds() - t0;
+    free( results );
+
+    if ( num_series / elapsed > best )
+      best = num_series / elapsed;
+    if ( now_seconds() - start > BENCH_MIN_SECONDS )
+      break;
+  }
+
+  printf( "%zu series x %zu points: %.2f M fits/s (%.2f GB/s)\n",
+          num_series, series_len, best / 1e6,
+          best * series_len * 2 * sizeof(double) / 1e9 );
+
+  free( x );
+  free( y );
+  free( offsets );
+}
+
+void
+bench_sparse_ols ( size_t rows, size_t groups, size_t levels )
+{
+  if ( levels < 2 ) {
+    printf( "skipped (needs at least two levels per group)\n" );
+    return;
+  }
+
+  /* column 0 is the intercept, group g level l > 0 is column
+     1 + g * (levels - 1) + l - 1 */
+  const size_t cols = 1 + groups * ( levels - 1 );
+  const size_t max_nnz = rows * ( 1 + groups );
+  size_t *row_indices = malloc( max_nnz * sizeof(size_t) );
+  size_t *col_indices = malloc( max_nnz * sizeof(size_t) );
+  double *values = malloc( max_nnz * sizeof(double) );
+  Tensor2D *y = Tensor2D_create( rows, 1 );
+
+  size_t nnz = 0;
+  for ( size_t r = 0; r < rows; ++r ) {
+    row_indices[nnz] = r;
+    col_indices[nnz] = 0;
+    values[nnz++] = 1.0;
+    y->data[r] = 3.0 + ( ( r * 2654435761u ) % 1000 ) * 1e-4;
+
+    for ( size_t g = 0; g < groups; ++g ) {
+      uint64_t h = ( r * groups + g + 1 ) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 31;
+      const size_t level = ( h * 0xbf58476d1ce4e5b9ull >> 32 ) % levels;
+      y->data[r] += 0.01 * (double) ( ( g + 1 ) * level );
+      if ( level == 0 )
+        continue;
+      row_indices[nnz] = r;
+      col_indices[nnz] = 1 + g * ( levels - 1 ) + level - 1;
+      values[nnz++] = 1.0;
+    }
+  }
+
+  double t0 = now_seconds();
+  SparseTensor2D *x = SparseTensor2D_from_triplets( rows, cols, row_indices, col_indices,
+                                                    values, nnz, SPARSE_CSR );
+  const double build = now_seconds() - t0;
+  free( row_indices );
+  free( col_indices );
+  free( values );
+
+  t0 = now_seconds();
+  Tensor2D *sparse_beta = calculate_ols_beta_sparse( x, y );
+  const double sparse_time = now_seconds() - t0;
+
+  printf( "%zu x %zu, %zu non-zeros (%.3f%% dense, %.1f MB vs %.1f MB dense)\n",
+          rows, cols, x->nnz, 100.0 * x->nnz / ( (double) rows * cols ),
+          ( x->nnz * ( sizeof(double) + sizeof(size_t) ) +
+            ( rows + 1 ) * sizeof(size_t) ) / 1e6,
+          rows * cols * sizeof(double) / 1e6 );
+  printf( "sparse: %.3fs to build, %.3fs to fit\n", build, sparse_time );
+
+  /* the dense fit is only worth waiting for while X fits comfortably */
+  if ( rows * cols <= ( (size_t) 1 << 28 ) ) {
+    Tensor2D *dense = SparseTensor2D_to_dense( x );
+    t0 = now_seconds();
+    Tensor2D *dense_beta = calculate_ols_beta( dense, y );
+    const double dense_time = now_seconds() - t0;
+
+    double max_diff = 0;
+    for ( size_t i = 0; sparse_beta && dense_beta && i < cols; ++i ) {
+      const double diff = sparse_beta->data[i] - dense_beta->data[i];
+      if ( diff > max_diff || -diff > max_diff )
+        max_diff = diff > 0 ? diff : -diff;
+    }
+    printf( "dense:  %.3fs to fit (%.1fx), max |beta difference| %.2e\n",
+            dense_time, dense_time / sparse_time, max_diff );
+
+    Tensor2D_destroy( &dense_beta );
+    Tensor2D_destroy( &dense );
+  }
+
+  Tensor2D_destroy( &sparse_beta );
+  Tensor2D_destroy( &y );
+  SparseTensor2D_destroy( &x );
+}
+
+void
+bench_rls ( size_t points, size_t p, size_t window )
+{
+  if ( p == 0 || points < p ) {
+    printf( "skipped (needs at least p > 0 points)\n" );
+    return;
+  }
+
+  double *x = malloc( points * p * sizeof(double) );
+  double *y = malloc( points * sizeof(double) );
+  if ( !x || !y ) {
+    printf( "skipped (couldn't allocate %zu points)\n", points );
+    free( x );
+    free( y );
+    return;
+  }
+
+  /* an intercept and p - 1 hashed uniform features,
+     y = sum (j + 1) x_j + a little deterministic noise */
+  for ( size_t i = 0; i < points; ++i ) {
+    double *row = x + i * p;
+    row[0] = 1.0;
+    y[i] = 1.0 + ( ( i * 2654435761u ) % 1000 ) * 1e-4;
+    for ( size_t j = 1; j < p; ++j ) {
+      uint64_t h = ( i * p + j ) * 0x9e3779b97f4a7c15ull;
+      h ^= h >> 31;
+      row[j] = ( ( h * 0xbf58476d1ce4e5b9ull ) >> 11 ) * 0x1.0p-53;
+      y[i] += ( j + 1 ) * row[j];
+    }
+  }
+
+  RlsConfig config = rls_default_config();
+  config.window = window;
+  Rls *rls = rls_new( p, &config );
+
+  double start = now_seconds();
+  for ( size_t i = 0; i < points; ++i )
+    rls_update( rls, x + i * p, y[i] );
+  const double elapsed = now_seconds() - start;
+
+  /* the same observations the estimator ends up with, in one batch */
+  const size_t n = window && window < points ? window : points;
+  Tensor2D *batch_x = Tensor2D_create( n, p );
+  Tensor2D *batch_y = Tensor2D_create( n, 1 );
+  memcpy( batch_x->data, x + ( points - n ) * p, n * p * sizeof(double) );
+  memcpy( batch_y->data, y + ( points - n ), n * sizeof(double) );
+  Tensor2D *beta = calculate_ols_beta( batch_x, batch_y );
+
+  printf( "rls: %zu updates of %zu features (window %zu): %.2f M updates/s, %zu refits\n",
+          points, p, window, points / elapsed / 1e6, rls->refits );
+
+  if ( beta ) {
+    double max_diff = 0.0, mean_y = 0.0, total = 0.0, residual = 0.0;
+    for ( size_t j = 0; j < p; ++j )
+      if ( fabs( beta->data[j] - rls->beta->data[j] ) > max_diff )
+        max_diff = fabs( beta->data[j] - rls->beta->data[j] );
+
+    for ( size_t i = 0; i < n; ++i )
+      mean_y += batch_y->data[i] / n;
+    for ( size_t i = 0; i < n; ++i ) {
+      double fit = 0.0;
+      for ( size_t j = 0; j < p; ++j )
+        fit += batch_x->data[ i * p + j ] * beta->data[j];
+      total    += ( batch_y->data[i] - mean_y ) * ( batch_y->data[i] - mean_y );
+      residual += ( batch_y->data[i] - fit ) * ( batch_y->data[i] - fit );
+    }
+
+    printf( "batch OLS over the last %zu: max |beta difference| %.2e, R^2 %.6f (rls %.6f)\n",
+            n, max_diff, total > 0.0 ? 1 - residual / total : 1.0, rls_r_squared( rls ) );
+  }
+
+  Tensor2D_destroy( &beta );
+  Tensor2D_destroy( &batch_x );
+  Tensor2D_destroy( &batch_y );
+  rls_destroy( &rls );
+  free( x );
+  free( y );
+}
@@ -0,0 +1,27 @@
+#ifndef BENCH_HEADER
+#define BENCH_HEADER
+
+#include <stddef.h>
+
+/* transpose throughput (out-of-place and in-place) against memcpy of the same
+   bytes, for square matrices from 1024 up to max_n. bandwidth counts both the
+   read and the write of every element. */
+void bench_transpose ( size_t max_n );
+
+/* batched regression throughput in fits per second, over num_series packed
+   series of series_len points each */
+void bench_regressions ( size_t num_series, size_t series_len );
+
+/* OLS on one-hot categorical features (an intercept plus groups variables
+   of levels levels each, one level dropped per group) over rows
+   observations, sparse against dense, with the largest coefficient
+   difference between the two */
+void bench_sparse_ols ( size_t rows, size_t groups, size_t levels );
+
+/* recursive least squares update rate over points observations of p
+   features (an intercept and p - 1 uniform ones), keeping the last window
+   of them (0 for all). the final estimate is checked against
+   calculate_ols_beta over the same observations */
+void bench_rls ( size_t points, size_t p, size_t window );
+
+#endif
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+/* the header is followed by the parameters and then whichever optimizer
+   state arrays are flagged, num_params doubles each. checkpoints are meant
+   to be resumed on the machine that wrote them, so the optimizer config is
+   stored as is and header_size catches a layout change */
+typedef struct {
+  char     magic[8];
+  uint32_t version, header_size;
+  uint64_t image_size, num_classes, num_params;
+  uint64_t epoch, seed, optimizer_steps;
+  double   optimizer_learning_rate;
+  float    learning_rate;
+  uint32_t has_velocity, has_second_moment;
+  OptimizerConfig optimizer_config;
+} CheckpointHeader;
+
+CheckpointConfig
+checkpoint_default_config ( const char *path )
+{
+  return (CheckpointConfig) {
+    .path         = path,
+    .every_epochs = 1,
+    .resume       = true
+  };
+}
+
+void
+checkpoint_state_destroy ( CheckpointState **state )
+{
+  if ( state && *state ) {
+    free( (*state)->params );
+    free( (*state)->velocity );
+    free( (*state)->second_moment );
+    free( *state );
+    *state = NULL;
+  }
+}
+
+bool
+checkpoint_write ( const CheckpointState *state, const char *path, const char *tmp_path )
+{
+  FILE *f = fopen( tmp_path, "wb" );
+  if ( !f ) {
+    perror( "Failed to create checkpoint" );
+    return false;
+  }
+
+  CheckpointHeader header = {
+    .magic                   = CHECKPOINT_MAGIC,
+    .version                 = CHECKPOINT_VERSION,
+    .header_size             = sizeof(CheckpointHeader),
+    .image_size              = state->image_size,
+    .num_classes             = state->num_classes,
+    .num_params              = state->num_params,
+    .epoch                   = state->epoch,
+    .seed                    = state->seed,
+    .optimizer_steps         = state->optimizer_steps,
+    .optimizer_learning_rate = state->optimizer_learning_rate,
+    .learning_rate           = state->learning_rate,
+    .has_velocity            = state->velocity != NULL,
+    .has_second_moment       = state->second_moment != NULL,
+    .optimizer_config        = state->optimizer_config
+  };
+
+  const size_t n = state->num_params;
+  bool ok = fwrite( &header, sizeof(header), 1, f ) == 1 &&
+            fwrite( state->params, sizeof(double), n, f ) == n;
+  if ( ok && state->velocity )
+    ok = fwrite( state->velocity, sizeof(double), n, f ) == n;
+  if ( ok && state->second_moment )
+    ok = fwrite( state->second_moment, sizeof(double), n, f ) == n;
+
+  /* on disk before the rename makes it the latest checkpoint */
+  ok = ok && fflush( f ) == 0 && fsync( fileno( f ) ) == 0;
+  ok = fclose( f ) == 0 && ok;
+
+  if ( !ok || rename( tmp_path, path ) != 0 ) {
+    perror( "Failed to write checkpoint" );
+    remove( tmp_path );
+    return false;
+  }
+
+  return true;
+}
+
+CheckpointState *
+checkpoint_read ( const char *path )
+{
+  FILE *f = fopen( path, "rb" );
+  if ( !f )
+    return NULL;
+
+  CheckpointHeader header;
+  if ( fread( &header, sizeof(header), 1, f ) != 1 ||
+       memcmp( header.magic, CHECKPOINT_MAGIC, sizeof(header.magic) ) != 0 ||
+       header.version != CHECKPOINT_VERSION ||
+       header.header_size != sizeof(CheckpointHeader) ) {
+    fprintf( stderr, "'%s' isn't a version %d checkpoint\n", path, CHECKPOINT_VERSION );
+    fclose( f );
+    return NULL;
+  }
+
+  const size_t n = header.num_params;
+  CheckpointState *state = calloc( 1, sizeof(CheckpointState) );
+  state->image_size              = header.image_size;
+  state->num_classes             = header.num_classes;
+  state->num_params              = n;
+  state->epoch                   = header.epoch;
+  state->seed                    = header.seed;
+  state->optimizer_steps         = header.optimizer_steps;
+  state->optimizer_learning_rate = header.optimizer_learning_rate;
+  state->learning_rate           = header.learning_rate;
+  state->optimizer_config        = header.optimizer_config;
+
+  state->params = malloc( n * sizeof(double) );
+  bool ok = fread( state->params, sizeof(double), n, f ) == n;
+  if ( ok && header.has_velocity ) {
+    state->velocity = malloc( n * sizeof(double) );
+    ok = fread( state->velocity, sizeof(double), n, f ) == n;
+  }
+  if ( ok && header.has_second_moment ) {
+    state->second_moment = malloc( n * sizeof(double) );
+    ok = fread( state->second_moment, sizeof(double), n, f ) == n;
+  }
+
+  /* anything left over means the sizes don't add up */
+  ok = ok && fgetc( f ) == EOF;
+  fclose( f );
+
+  if ( !ok ) {
+    fprintf( stderr, "checkpoint '%s' is truncated\n", path );
+    checkpoint_state_destroy( &state );
+  }
+
+  return state;
+}
+
+static void *
+checkpoint_thread ( void *arg )
+{
+  Checkpointer *checkpointer = arg;
+
+  pthread_mutex_lock( &checkpointer->lock );
+  for (;;) {
+    while ( !checkpointer->has_pending && !checkpointer->shutdown )
+      pthread_cond_wait( &checkpointer->wake, &checkpointer->lock );
+
+    /* shutting down only once the last snapshot is written */
+    if ( !checkpointer->has_pending )
+      break;
+
+    CheckpointState *state = checkpointer->pending;
+    checkpointer->pending  = checkpointer->writing;
+    checkpointer->writing  = state;
+    checkpointer->has_pending = false;
+    checkpointer->busy = true;
+    pthread_mutex_unlock( &checkpointer->lock );
+
+    const bool ok = checkpoint_write( state, checkpointer->path, checkpointer->tmp_path );
+
+    pthread_mutex_lock( &checkpointer->lock );
+    checkpointer->busy = false;
+    if ( ok )
+      ++checkpointer->written;
+    else
+      checkpointer->failure = true;
+    pthread_cond_broadcast( &checkpointer->idle );
+  }
+  pthread_mutex_unlock( &checkpointer->lock );
+
+  return NULL;
+}
+
+Checkpointer *
+checkpointer_new ( const CheckpointConfig *config )
+{
+  if ( !config->path || !*config->path ) {
+    fprintf( stderr, "checkpointing needs a path\n" );
+    return NULL;
+  }
+
+  Checkpointer *new = calloc( 1, sizeof(Checkpointer) );
+  new->config   = *config;
+  new->path     = strdup( config->path );
+  new->tmp_path = malloc( strlen( config->path ) + 5 );
+  sprintf( new->tmp_path, "%s.tmp", config->path );
+  new->config.path = new->path;
+
+  pthread_mutex_init( &new->lock, NULL );
+  pthread_cond_init( &new->wake, NULL );
+  pthread_cond_init( &new->idle, NULL );
+
+  if ( pthread_create( &new->thread, NULL, checkpoint_thread, new ) != 0 ) {
+    perror( "Failed to start checkpoint writer" );
+    new->running = false;
+    checkpointer_destroy( &new );
+    return NULL;
+  }
+  new->running = true;
+
+  return new;
+}
+
+void
+checkpointer_destroy ( Checkpointer **checkpointerptr )
+{
+  if ( checkpointerptr && *checkpointerptr ) {
+    Checkpointer *checkpointer = *checkpointerptr;
+
+    pthread_mutex_lock( &checkpointer->lock );
+    checkpointer->shutdown = true;
+    pthread_cond_signal( &checkpointer->wake );
+    pthread_mutex_unlock( &checkpointer->lock );
+    if ( checkpointer->running )
+      pthread_join( checkpointer->thread, NULL );
+
+    if ( checkpointer->skipped )
+      fprintf( stderr, "checkpoint: %zu snapshots were superseded before they were written\n",
+               checkpointer->skipped );
+
+    checkpoint_state_destroy( &checkpointer->spare );
+    checkpoint_state_destroy( &checkpointer->pending );
+    checkpoint_state_destroy( &checkpointer->writing );
+    pthread_mutex_destroy( &checkpointer->lock );
+    pthread_cond_destroy( &checkpointer->wake );
+    pthread_cond_destroy( &checkpointer->idle );
+    free( checkpointer->path );
+    free( checkpointer->tmp_path );
+    free( checkpointer );
+    *checkpointerptr = NULL;
+  }
+}
+
+bool
+checkpoint_due ( const Checkpointer *checkpointer, const size_t epoch, const size_t epochs )
+{
+  const size_t every = checkpointer->config.every_epochs;
+  return epoch + 1 == epochs || ( every && ( epoch + 1 ) % every == 0 );
+}
+
+static void
+checkpoint_state_array ( double **array, const size_t n, const bool wanted )
+{
+  if ( wanted && !*array )
+    *array = malloc( n * sizeof(double) );
+  else if ( !wanted ) {
+    free( *array );
+    *array = NULL;
+  }
+}
+
+CheckpointState *
+checkpoint_begin ( Checkpointer *checkpointer, const size_t num_params,
+                   const bool velocity, const bool second_moment )
+{
+  CheckpointState *spare = checkpointer->spare;
+  if ( spare && spare->num_params != num_params )
+    checkpoint_state_destroy( &spare );
+
+  if ( !spare ) {
+    spare = calloc( 1, sizeof(CheckpointState) );
+    spare->num_params = num_params;
+    spare->params = malloc( num_params * sizeof(double) );
+  }
+
+  checkpoint_state_array( &spare->velocity, num_params, velocity );
+  checkpoint_state_array( &spare->second_moment, num_params, second_moment );
+
+  checkpointer->spare = spare;
+  return spare;
+}
+
+void
+checkpoint_submit ( Checkpointer *checkpointer )
+{
+  pthread_mutex_lock( &checkpointer->lock );
+
+  /* a snapshot the writer hasn't got to yet is stale now */
+  if ( checkpointer->has_pending )
+    ++checkpointer->skipped;
+
+  CheckpointState *state = checkpointer->pending;
+  checkpointer->pending  = checkpointer->spare;
+  checkpointer->spare    = state;
+  checkpointer->has_pending = true;
+
+  pthread_cond_signal( &checkpointer->wake );
+  pthread_mutex_unlock( &checkpointer->lock );
+}
+
+bool
+checkpoint_wait ( Checkpointer *checkpointer )
+{
+  pthread_mutex_lock( &checkpointer->lock );
+  while ( checkpointer->has_pending || checkpointer->busy )
+    pthread_cond_wait( &checkpointer->idle, &checkpointer->lock );
+  const bool ok = !checkpointer->failure;
+  pthread_mutex_unlock( &checkpointer->lock );
+
+  return ok;
+}
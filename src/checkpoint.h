@@ -0,0 +1,86 @@
+#ifndef CHECKPOINT_HEADER
+#define CHECKPOINT_HEADER
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "optimizer.h"
+
+#define CHECKPOINT_MAGIC   "CMLCKPT"
+#define CHECKPOINT_VERSION 1
+
+typedef struct {
+  const char *path;      /* '<path>.tmp' is written, then renamed over path */
+  size_t every_epochs;   /* 0 only checkpoints the final epoch */
+  bool resume;           /* model_train picks up from path if it matches the run */
+} CheckpointConfig;
+
+/* everything needed to carry on training exactly where it stopped. the
+   sampler's shuffles and augmentations are a pure function of the seed and
+   the epoch, so those two are its whole RNG state */
+typedef struct {
+  size_t image_size, num_classes;
+  size_t epoch;          /* epochs completed */
+  uint64_t seed;
+  float learning_rate;
+
+  OptimizerConfig optimizer_config;
+  size_t optimizer_steps;
+  double optimizer_learning_rate;
+
+  /* parameters in the normalized training space, weights then biases, and
+     the optimizer state laid out the same way (NULL if unused) */
+  double *params, *velocity, *second_moment;
+  size_t num_params;
+} CheckpointState;
+
+/* periodic training snapshots written off the training thread. the
+   training thread copies its state into a spare snapshot and swaps it in
+   under a lock held for a pointer swap, the writer thread owns the one it
+   is writing, so a slow disk never stalls training: if snapshots arrive
+   faster than they can be written, only the newest is kept */
+typedef struct {
+  CheckpointConfig config;
+  char *path, *tmp_path;
+
+  /* spare is owned by the training thread, writing by the writer thread,
+     pending is handed between them under lock */
+  CheckpointState *spare, *pending, *writing;
+  bool has_pending, busy;
+  size_t written, skipped;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, idle;
+  bool running, shutdown, failure;
+} Checkpointer;
+
+CheckpointConfig checkpoint_default_config ( const char *path );
+
+/* starts the writer thread. NULL if it can't be started */
+Checkpointer *checkpointer_new     ( const CheckpointConfig *config );
+/* writes whatever is still pending, then stops the thread */
+void          checkpointer_destroy ( Checkpointer **checkpointer );
+
+/* training thread side: true if a snapshot is due after this (0-based)
+   epoch of a run of epochs */
+bool checkpoint_due ( const Checkpointer *checkpointer, const size_t epoch,
+                      const size_t epochs );
+/* the spare snapshot to fill in, shaped for num_params parameters and the
+   optimizer state that is in use */
+CheckpointState *checkpoint_begin  ( Checkpointer *checkpointer, const size_t num_params,
+                                     const bool velocity, const bool second_moment );
+/* hands the filled spare to the writer and returns straight away */
+void             checkpoint_submit ( Checkpointer *checkpointer );
+/* blocks until every submitted snapshot is on disk. false if any failed */
+bool             checkpoint_wait   ( Checkpointer *checkpointer );
+
+/* reads a checkpoint file into a fresh state. NULL if it's missing, from
+   another version or truncated */
+CheckpointState *checkpoint_read          ( const char *path );
+bool             checkpoint_write         ( const CheckpointState *state,
+                                            const char *path, const char *tmp_path );
+void             checkpoint_state_destroy ( CheckpointState **state );
+
+#endif
@@ -0,0 +1,470 @@
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cli.h"
+#include "threadpool.h"
+#include "util.h"
+
+/* long options without a short form */
+enum {
+  OPT_LOADERS = 256, OPT_NO_CACHE, OPT_LR, OPT_HIDDEN, OPT_OPTIMIZER, OPT_AUGMENT,
+  OPT_SEED, OPT_CHECKPOINT, OPT_NO_CHECKPOINT, OPT_NO_RESUME, OPT_MONITOR,
+  OPT_INDEX, OPT_SOCKET, OPT_TEMPERATURE, OPT_CALIBRATE, OPT_PLOT, OPT_TIMING
+};
+
+static const struct option cli_options[] = {
+  { "threads",       required_argument, NULL, 't' },
+  { "batch-size",    required_argument, NULL, 'b' },
+  { "loaders",       required_argument, NULL, OPT_LOADERS },
+  { "precision",     required_argument, NULL, 'p' },
+  { "data",          required_argument, NULL, 'd' },
+  { "cache",         required_argument, NULL, 'c' },
+  { "no-cache",      no_argument,       NULL, OPT_NO_CACHE },
+  { "model",         required_argument, NULL, 'm' },
+  { "out",           required_argument, NULL, 'o' },
+  { "epochs",        required_argument, NULL, 'e' },
+  { "lr",            required_argument, NULL, OPT_LR },
+  { "hidden",        required_argument, NULL, OPT_HIDDEN },
+  { "optimizer",     required_argument, NULL, OPT_OPTIMIZER },
+  { "augment",       no_argument,       NULL, OPT_AUGMENT },
+  { "seed",          required_argument, NULL, OPT_SEED },
+  { "checkpoint",    required_argument, NULL, OPT_CHECKPOINT },
+  { "no-checkpoint", no_argument,       NULL, OPT_NO_CHECKPOINT },
+  { "no-resume",     no_argument,       NULL, OPT_NO_RESUME },
+  { "monitor",       optional_argument, NULL, OPT_MONITOR },
+  { "index",         required_argument, NULL, OPT_INDEX },
+  { "socket",        required_argument, NULL, OPT_SOCKET },
+  { "temperature",   required_argument, NULL, OPT_TEMPERATURE },
+  { "calibrate",     required_argument, NULL, OPT_CALIBRATE },
+  { "plot",          required_argument, NULL, OPT_PLOT },
+  { "timing",        required_argument, NULL, OPT_TIMING },
+  { "help",          no_argument,       NULL, 'h' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *cli_command_names[] = {
+  [CLI_TRAIN]   = "train",
+  [CLI_TEST]    = "test",
+  [CLI_PREDICT] = "predict",
+  [CLI_REGRESS] = "regress",
+  [CLI_BENCH]   = "bench",
+  [CLI_SERVE]   = "serve",
+  [CLI_HELP]    = "help"
+};
+
+CliOptions
+cli_default_options ( void )
+{
+  return (CliOptions) {
+    .command         = CLI_TRAIN,
+    .data_path       = "./data/cifar-10",
+    .model_path      = "cifar-10-model.bin",
+    .out_path        = "cifar-10-model.bin",
+    .epochs          = 10,
+    .learning_rate   = 0.001f,
+    .optimizer       = OPTIMIZER_SGD,
+    .resume          = true,
+    .precision       = MODEL_PRECISION_FLOAT,
+    .temperature     = 1.0f,
+    .bench_name      = "transpose"
+  };
+}
+
+const char *
+cli_command_name ( CliCommand command )
+{
+  return cli_command_names[ command ];
+}
+
+const char *
+cli_precision_name ( ModelPrecision precision )
+{
+  return precision == MODEL_PRECISION_DOUBLE ? "double" : "float";
+}
+
+void
+cli_usage ( FILE *out, const char *program )
+{
+  fprintf( out,
+    "usage: %s [command] [options]\n"
+    "\n"
+    "commands:\n"
+    "  train                      train on CIFAR-10, test, save the model (default)\n"
+    "  test    [model]            evaluate a saved model on the test batches\n"
+    "  predict [model]            score one test sample\n"
+    "  regress [file]             least squares fit of the file's observations, one per\n"
+    "                             line: 'x y' fits a line and plots it, 'series x y'\n"
+    "                             a line per series, 'y column:value ...' a sparse\n"
+    "                             model (the example points without a file)\n"
+    "  bench   [name] [args]      transpose [max n] | regress [series] [points]\n"
+    "                             | sparse [rows] [groups] [levels]\n"
+    "                             | rls [points] [features] [window]\n"
+    "  serve   [model] [socket]   batch inference on stdin or a unix socket\n"
+    "\n"
+    "performance:\n"
+    "  -t, --threads N            worker threads (default $CML_NUM_THREADS or every core)\n"
+    "  -b, --batch-size N         samples per training step, or the server's max batch\n"
+    "      --loaders N            threads staging training batches\n"
+    "  -p, --precision P          inference in float (packed) or double\n"
+    "\n"
+    "files:\n"
+    "  -d, --data DIR             CIFAR-10 directory (./data/cifar-10)\n"
+    "  -c, --cache PATH           binary batch cache (<data>/cifar-10.cache)\n"
+    "      --no-cache             always parse the original batches\n"
+    "  -m, --model PATH           model to load (cifar-10-model.bin)\n"
+    "  -o, --out PATH             where train saves the model (cifar-10-model.bin)\n"
+    "      --checkpoint PATH      snapshot training to PATH and resume from it (off)\n"
+    "      --no-checkpoint        don't snapshot\n"
+    "      --no-resume            with --checkpoint, start over even if a snapshot exists\n"
+    "\n"
+    "training:\n"
+    "  -e, --epochs N             (10)\n"
+    "      --lr RATE              learning rate (0.001)\n"
+    "      --hidden W[,W...]      ReLU hidden layer widths (none: softmax regression)\n"
+    "      --optimizer NAME       sgd, momentum, nesterov, adam or adamw (sgd)\n"
+    "      --augment              flips, crops and normalization while training\n"
+    "      --seed N               weights, shuffling and augmentation (0)\n"
+    "      --monitor[=PNG]        live dashboard in a window, or redrawn into a png\n"
+    "\n"
+    "other:\n"
+    "      --index N              test sample to predict (0)\n"
+    "      --socket PATH          unix socket to serve on\n"
+    "      --temperature T        softmax temperature of the served scores (1)\n"
+    "      --calibrate FILE       fit the temperature on CIFAR records held out from\n"
+    "                             training and testing (e.g. a validation split)\n"
+    "      --plot PNG             save the regression plot instead of showing it\n"
+    "      --timing PATH          json timing summary ('-' for stdout, default stderr)\n"
+    "  -h, --help\n",
+    program );
+}
+
+static bool
+cli_u64 ( const char *flag, const char *arg, uint64_t *out )
+{
+  char *end;
+  errno = 0;
+  const unsigned long long value = strtoull( arg, &end, 10 );
+  if ( errno || end == arg || *end || arg[0] == '-' || value > UINT64_MAX ) {
+    fprintf( stderr, "%s takes a non-negative integer, not '%s'\n", flag, arg );
+    return false;
+  }
+
+  *out = value;
+  return true;
+}
+
+static bool
+cli_size ( const char *flag, const char *arg, size_t *out )
+{
+  uint64_t value;
+  if ( !cli_u64( flag, arg, &value ) )
+    return false;
+  if ( value > SIZE_MAX ) {
+    fprintf( stderr, "%s is too large, '%s'\n", flag, arg );
+    return false;
+  }
+
+  *out = value;
+  return true;
+}
+
+static bool
+cli_float ( const char *flag, const char *arg, float *out )
+{
+  char *end;
+  errno = 0;
+  const float value = strtof( arg, &end );
+  if ( errno || end == arg || *end || !( value > 0.0f ) ) {
+    fprintf( stderr, "%s takes a positive number, not '%s'\n", flag, arg );
+    return false;
+  }
+
+  *out = value;
+  return true;
+}
+
+static bool
+cli_hidden ( const char *arg, CliOptions *options )
+{
+  const char *p = arg;
+  options->num_hidden = 0;
+
+  while ( *p ) {
+    if ( options->num_hidden == MODEL_MAX_LAYERS - 1 ) {
+      fprintf( stderr, "--hidden takes at most %d layers\n", MODEL_MAX_LAYERS - 1 );
+      return false;
+    }
+
+    char *end;
+    const unsigned long width = strtoul( p, &end, 10 );
+    if ( end == p || width == 0 || ( *end && *end != ',' ) ) {
+      fprintf( stderr, "--hidden takes comma separated widths, not '%s'\n", arg );
+      return false;
+    }
+
+    options->hidden[ options->num_hidden++ ] = width;
+    p = *end ? end + 1 : end;
+  }
+
+  return true;
+}
+
+static bool
+cli_optimizer ( const char *arg, OptimizerType *out )
+{
+  for ( OptimizerType type = OPTIMIZER_SGD; type <= OPTIMIZER_ADAMW; ++type )
+    if ( strcmp( arg, optimizer_name( type ) ) == 0 ) {
+      *out = type;
+      return true;
+    }
+
+  fprintf( stderr, "unknown optimizer '%s'\n", arg );
+  return false;
+}
+
+static bool
+cli_positionals ( char **args, const size_t len, CliOptions *options )
+{
+  size_t max = 0;
+
+  switch ( options->command ) {
+  case CLI_TEST:
+  case CLI_PREDICT:
+    max = 1;
+    if ( len >= 1 )
+      options->model_path = args[0];
+    break;
+
+  case CLI_REGRESS:
+    max = 1;
+    if ( len >= 1 )
+      options->input_path = args[0];
+    break;
+
+  case CLI_SERVE:
+    max = 2;
+    if ( len >= 1 )
+      options->model_path = args[0];
+    if ( len >= 2 )
+      options->socket_path = args[1];
+    break;
+
+  case CLI_BENCH: {
+    /* a bare number is the transpose size, as before the named benches */
+    size_t first = 0;
+    if ( len >= 1 && ( args[0][0] < '0' || args[0][0] > '9' ) ) {
+      if ( strcmp( args[0], "transpose" ) != 0 && strcmp( args[0], "regress" ) != 0 &&
+           strcmp( args[0], "sparse" ) != 0 && strcmp( args[0], "rls" ) != 0 ) {
+        fprintf( stderr, "unknown benchmark '%s'\n", args[0] );
+        return false;
+      }
+      options->bench_name = args[0];
+      first = 1;
+    }
+
+    max = first + CLI_MAX_BENCH_ARGS;
+    for ( size_t i = first; i < len && i < max; ++i )
+      if ( !cli_size( options->bench_name, args[i],
+                      &options->bench_args[ options->num_bench_args++ ] ) )
+        return false;
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  if ( len > max ) {
+    fprintf( stderr, "unexpected argument '%s' for %s\n", args[max],
+             cli_command_name( options->command ) );
+    return false;
+  }
+
+  return true;
+}
+
+bool
+cli_parse ( int argc, char *argv[], CliOptions *options )
+{
+  *options = cli_default_options();
+
+  /* no command (or flags straight away) trains, like the original main */
+  int first = 0;
+  if ( argc >= 2 && argv[1][0] != '-' ) {
+    first = 1;
+    bool found = false;
+    for ( size_t c = 0; c < sizeof(cli_command_names) / sizeof(*cli_command_names); ++c )
+      if ( strcmp( argv[1], cli_command_names[c] ) == 0 ) {
+        options->command = c;
+        found = true;
+      }
+
+    if ( !found ) {
+      fprintf( stderr, "unknown command '%s'\n", argv[1] );
+      return false;
+    }
+  }
+
+  /* getopt sees the command as the program name */
+  int sub_argc = argc - first;
+  char **sub_argv = argv + first;
+  optind = 1;
+
+  int opt;
+  while ( ( opt = getopt_long( sub_argc, sub_argv, "t:b:p:d:c:m:o:e:h",
+                               cli_options, NULL ) ) != -1 ) {
+    bool ok = true;
+
+    switch ( opt ) {
+    case 't': ok = cli_size( "--threads", optarg, &options->threads ); break;
+    case 'b': ok = cli_size( "--batch-size", optarg, &options->batch_size ); break;
+    case OPT_LOADERS: ok = cli_size( "--loaders", optarg, &options->loader_threads ); break;
+    case 'e': ok = cli_size( "--epochs", optarg, &options->epochs ); break;
+    case OPT_INDEX: ok = cli_size( "--index", optarg, &options->sample_index ); break;
+    case OPT_LR: ok = cli_float( "--lr", optarg, &options->learning_rate ); break;
+    case OPT_TEMPERATURE: ok = cli_float( "--temperature", optarg, &options->temperature ); break;
+    case OPT_HIDDEN: ok = cli_hidden( optarg, options ); break;
+    case OPT_OPTIMIZER: ok = cli_optimizer( optarg, &options->optimizer ); break;
+
+    case 'p':
+      if ( strcmp( optarg, "float" ) == 0 )
+        options->precision = MODEL_PRECISION_FLOAT;
+      else if ( strcmp( optarg, "double" ) == 0 )
+        options->precision = MODEL_PRECISION_DOUBLE;
+      else {
+        fprintf( stderr, "--precision is float or double, not '%s'\n", optarg );
+        ok = false;
+      }
+      break;
+
+    case OPT_SEED: ok = cli_u64( "--seed", optarg, &options->seed ); break;
+
+    case 'd': options->data_path = optarg; break;
+    case 'c': options->cache_path = optarg; break;
+    case OPT_NO_CACHE: options->no_cache = true; break;
+    case 'm': options->model_path = optarg; break;
+    case 'o': options->out_path = optarg; break;
+    case OPT_AUGMENT: options->augment = true; break;
+    case OPT_CHECKPOINT: options->checkpoint_path = optarg; break;
+    case OPT_NO_CHECKPOINT: options->checkpoint_path = NULL; break;
+    case OPT_NO_RESUME: options->resume = false; break;
+    case OPT_MONITOR: options->monitor = optarg ? optarg : ""; break;
+    case OPT_SOCKET: options->socket_path = optarg; break;
+    case OPT_CALIBRATE: options->calibrate_path = optarg; break;
+    case OPT_PLOT: options->plot_path = optarg; break;
+    case OPT_TIMING: options->timing_path = optarg; break;
+    case 'h': options->command = CLI_HELP; break;
+
+    default:
+      /* getopt already said what was wrong */
+      return false;
+    }
+
+    if ( !ok )
+      return false;
+  }
+
+  return cli_positionals( sub_argv + optind, sub_argc - optind, options );
+}
+
+void
+cli_timer_start ( CliTimer *timer, const CliOptions *options )
+{
+  *timer = (CliTimer) { .options = options };
+  timer->start = timer->phase_start = now_seconds();
+}
+
+double
+cli_timer_phase ( CliTimer *timer, const char *name )
+{
+  const double now = now_seconds();
+  const double seconds = now - timer->phase_start;
+  if ( timer->num_phases < CLI_MAX_PHASES )
+    timer->phases[ timer->num_phases++ ] = (CliMeasure) { name, seconds };
+  timer->phase_start = now;
+
+  return seconds;
+}
+
+void
+cli_timer_metric ( CliTimer *timer, const char *name, const double value )
+{
+  if ( timer->num_metrics < CLI_MAX_METRICS )
+    timer->metrics[ timer->num_metrics++ ] = (CliMeasure) { name, value };
+}
+
+static void
+cli_json_string ( FILE *out, const char *s )
+{
+  fputc( '"', out );
+  for ( ; *s; ++s ) {
+    if ( *s == '"' || *s == '\\' )
+      fprintf( out, "\\%c", *s );
+    else if ( (unsigned char) *s < 0x20 )
+      fprintf( out, "\\u%04x", *s );
+    else
+      fputc( *s, out );
+  }
+  fputc( '"', out );
+}
+
+static void
+cli_json_size ( FILE *out, const char *key, const size_t value )
+{
+  if ( value )
+    fprintf( out, ",\"%s\":%zu", key, value );
+  else
+    fprintf( out, ",\"%s\":null", key );
+}
+
+static void
+cli_json_measures ( FILE *out, const char *key, const CliMeasure *measures, const size_t len )
+{
+  fprintf( out, ",\"%s\":{", key );
+  for ( size_t i = 0; i < len; ++i ) {
+    if ( i )
+      fputc( ',', out );
+    cli_json_string( out, measures[i].name );
+    /* json has no inf or nan */
+    if ( isfinite( measures[i].value ) )
+      fprintf( out, ":%.6g", measures[i].value );
+    else
+      fprintf( out, ":null" );
+  }
+  fputc( '}', out );
+}
+
+bool
+cli_timer_report ( const CliTimer *timer, const int status )
+{
+  const CliOptions *options = timer->options;
+  const char *path = options->timing_path;
+
+  /* after whatever the command printed */
+  fflush( stdout );
+
+  FILE *out = stderr;
+  if ( path && strcmp( path, "-" ) == 0 )
+    out = stdout;
+  else if ( path && !( out = fopen( path, "w" ) ) ) {
+    perror( "Failed to open timing summary" );
+    return false;
+  }
+
+  fprintf( out, "{\"command\":\"%s\",\"status\":%d", cli_command_name( options->command ),
+           status );
+  fprintf( out, ",\"threads\":%zu", threadpool_num_threads() );
+  cli_json_size( out, "batch_size", timer->batch_size );
+  cli_json_size( out, "loader_threads", timer->loader_threads );
+  fprintf( out, ",\"precision\":\"%s\"", cli_precision_name( options->precision ) );
+  cli_json_measures( out, "phases", timer->phases, timer->num_phases );
+  cli_json_measures( out, "metrics", timer->metrics, timer->num_metrics );
+  fprintf( out, ",\"total_seconds\":%.6g}\n", now_seconds() - timer->start );
+
+  if ( out == stdout || out == stderr )
+    return fflush( out ) == 0;
+  return fclose( out ) == 0;
+}
@@ -0,0 +1,108 @@
+#ifndef CLI_HEADER
+#define CLI_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "model.h"
+#include "optimizer.h"
+
+typedef enum {
+  CLI_TRAIN,             /* train, test and save a CIFAR-10 model */
+  CLI_TEST,              /* evaluate a saved model on the test batches */
+  CLI_PREDICT,           /* score one test sample */
+  CLI_REGRESS,           /* least squares fits of a data file or the example points */
+  CLI_BENCH,             /* transpose, regress, sparse or rls micro-benchmarks */
+  CLI_SERVE,             /* batch inference over stdin or a unix socket */
+  CLI_HELP
+} CliCommand;
+
+#define CLI_MAX_BENCH_ARGS 3
+
+/* everything the driver takes from the command line. cli_parse starts from
+   cli_default_options, so leaving a flag out gives the old hard-coded run */
+typedef struct {
+  CliCommand command;
+
+  /* files. cache_path NULL means '<data>/cifar-10.cache', no_cache skips it */
+  const char *data_path, *cache_path, *model_path, *out_path;
+  bool no_cache;
+
+  /* training workload */
+  size_t epochs;
+  float learning_rate;
+  size_t hidden[ MODEL_MAX_LAYERS - 1 ], num_hidden;
+  OptimizerType optimizer;
+  bool augment;
+  uint64_t seed;
+  const char *checkpoint_path;   /* NULL (the default) disables checkpointing */
+  bool resume;                   /* with a checkpoint_path, carry on from its snapshot */
+  const char *monitor;           /* NULL off, "" a window, else a png to redraw */
+
+  /* performance modes. 0 leaves the library default: $CML_NUM_THREADS or
+     every core, one sample per step (the server's own max_batch) */
+  size_t threads, batch_size, loader_threads;
+  ModelPrecision precision;
+
+  /* per command */
+  size_t sample_index;           /* predict */
+  const char *socket_path;       /* serve, NULL for stdin -> stdout */
+  float temperature;             /* serve */
+  const char *calibrate_path;    /* serve: records to fit the temperature on, NULL for none */
+  const char *input_path;        /* regress, NULL for the example points */
+  const char *plot_path;         /* regress, NULL for a window */
+  const char *bench_name;
+  size_t bench_args[ CLI_MAX_BENCH_ARGS ], num_bench_args;
+
+  /* where the json timing summary goes: NULL for stderr, "-" for stdout */
+  const char *timing_path;
+} CliOptions;
+
+CliOptions cli_default_options ( void );
+
+/* argv[1] is the command, the rest are flags and the command's positional
+   arguments in any order. prints what's wrong and returns false on a bad
+   command line */
+bool cli_parse ( int argc, char *argv[], CliOptions *options );
+void cli_usage ( FILE *out, const char *program );
+
+const char *cli_command_name   ( CliCommand command );
+const char *cli_precision_name ( ModelPrecision precision );
+
+#define CLI_MAX_PHASES  8
+#define CLI_MAX_METRICS 8
+
+/* wall clock of each phase of a command plus whatever throughput or
+   accuracy figures it wants to report, written out as one json object:
+
+     {"command":"train","status":0,"threads":8,...,
+      "phases":{"load":0.41,"train":52.8,...},
+      "metrics":{"train_samples_per_second":9470.2,...},"total_seconds":53.6}
+
+   so runs with different modes can be compared by a script */
+typedef struct {
+  const char *name;
+  double value;
+} CliMeasure;
+
+typedef struct {
+  const CliOptions *options;
+  double start, phase_start;
+  /* the values actually in effect, reported instead of the flags: commands
+     set them once the model or server has settled its defaults. 0 is
+     reported as null, for commands that have none */
+  size_t batch_size, loader_threads;
+  CliMeasure phases[ CLI_MAX_PHASES ], metrics[ CLI_MAX_METRICS ];
+  size_t num_phases, num_metrics;
+} CliTimer;
+
+void   cli_timer_start  ( CliTimer *timer, const CliOptions *options );
+/* closes the phase running since the last call (or the start), returns its
+   seconds */
+double cli_timer_phase  ( CliTimer *timer, const char *name );
+void   cli_timer_metric ( CliTimer *timer, const char *name, const double value );
+/* false if the summary couldn't be written */
+bool   cli_timer_report ( const CliTimer *timer, const int status );
+
+#endif
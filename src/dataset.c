@@ -2,53 +2,45 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "dataset.h"
 
+/* samples are laid out back to back in one aligned block so a batch can be
+   written to (or mapped from) the cache as a single run of doubles */
 static Batch *
-batch_load ( const char *filepath, const size_t image_size, \
-             const size_t num_samples )
+batch_new ( const size_t num_samples, const size_t image_size, double *images )
 {
-  FILE *f = fopen( filepath, "rb" );
-  if ( !f ) {
-    perror( "Failed to open file!" );
-    return NULL;
-  }
-
-  size_t count = 0, label = 0;
-  uint8_t *buffer = calloc( image_size, sizeof(uint8_t) );
-
-  Batch *batch = calloc ( 1, sizeof(Batch) );
+  Batch *batch = calloc( 1, sizeof(Batch) );
   batch->num_samples = num_samples;
   batch->samples = calloc( num_samples, sizeof(Sample *) );
-  
-  while ( fread(&label, 1, 1, f) == 1 && \
-          fread(buffer, 1, image_size, f) == image_size && \
-          count < num_samples )
-  {
-    Sample *sample = calloc( 1, sizeof(Sample) );
-    sample->image = calloc( image_size, sizeof(double) );
-    sample->image_size = image_size;
-    for ( size_t i = 0; i < image_size; ++i )
-      sample->image[i] = (double) buffer[i] / 255.0;
-
-    sample->label = label;
-    batch->samples[count] = sample;
-    ++count;
-  }
-    
-  free(buffer);
-  fclose(f);
-
-  if ( count != num_samples ) {
-    for ( size_t i = 0; i < count; ++i )
-      free( batch->samples[i] );
-    free( batch );
+  batch->storage = calloc( num_samples, sizeof(Sample) );
 
-    fprintf(stderr, "unable to load batch number %zu", count);
-    
+  batch->mapped = images != NULL;
+  if ( !images &&
+       posix_memalign( (void **) &images, DATASET_ALIGNMENT,
+                       num_samples * image_size * sizeof(double) ) != 0 )
+    images = NULL;
+  batch->images = images;
+
+  if ( !batch->samples || !batch->storage || !batch->images ) {
+    fprintf( stderr, "unable to allocate a batch of %zu samples\n", num_samples );
+    free( batch->samples );
+    free( batch->storage );
+    if ( !batch->mapped )
+      free( batch->images );
+    free( batch );
     return NULL;
   }
-  
+
+  for ( size_t i = 0; i < num_samples; ++i ) {
+    batch->storage[i].image      = batch->images + i * image_size;
+    batch->storage[i].image_size = image_size;
+    batch->samples[i] = &batch->storage[i];
+  }
+
   return batch;
 }
 
@@ -58,88 +50,431 @@ batch_unload ( Batch **batchptr )
   if ( batchptr && *batchptr )
   {
     Batch *batch = *batchptr;
-    for ( size_t i = 0; i < batch->num_samples; ++i ) {
-      free( batch->samples[i] );
-      batch->samples[i] = NULL;
-    }
+    if ( !batch->mapped )
+      free( batch->images );
+    free( batch->storage );
+    free( batch->samples );
     free( batch );
-    batchptr = NULL;
+    *batchptr = NULL;
   }
 }
-  
+
+/* batch b counting through the training batches and then the test ones */
 static Batch **
-batch_load_many ( const char *filepath, const char **filenames, \
-                  const size_t len,     const size_t image_size,
-                  const size_t num_samples_per_batch )
+dataset_batch_slot ( Dataset *dataset, const size_t b )
 {
-  Batch **batches = calloc( len, sizeof(Batch *) );
-  
+  return b < dataset->train_batches_len ? &dataset->train_batches[b] :
+         &dataset->test_batches[b - dataset->train_batches_len];
+}
+
+static size_t
+dataset_batch_samples ( const Dataset *dataset, const size_t b )
+{
+  const bool train = b < dataset->train_batches_len;
+  const size_t first = ( train ? b : b - dataset->train_batches_len ) * dataset->batch_size;
+  const size_t total = train ? dataset->train_samples : dataset->test_samples;
+  return total - first < dataset->batch_size ? total - first : dataset->batch_size;
+}
+
+static void
+dataset_unload_batches ( Dataset *dataset )
+{
+  for ( size_t i = 0; dataset->test_batches && i < dataset->test_batches_len; ++i )
+    batch_unload ( &dataset->test_batches[i] );
+  free( dataset->test_batches );
+
+  for ( size_t i = 0; dataset->train_batches && i < dataset->train_batches_len; ++i )
+    batch_unload ( &dataset->train_batches[i] );
+  free( dataset->train_batches );
+
+  dataset->train_batches = dataset->test_batches = NULL;
+}
+
+/* decodes every batch through the reader, straight into its image block */
+static bool
+dataset_read_batches ( Dataset *dataset, const DatasetReader *reader, void *handle )
+{
+  const size_t num_batches = dataset->train_batches_len + dataset->test_batches_len;
+  size_t *labels = malloc( dataset->batch_size * sizeof(size_t) );
+  bool ok = true;
+
+  for ( size_t b = 0; ok && b < num_batches; ++b ) {
+    const bool train = b < dataset->train_batches_len;
+    const size_t n = dataset_batch_samples( dataset, b );
+    const size_t first = ( train ? b : b - dataset->train_batches_len ) * dataset->batch_size;
+
+    Batch *batch = batch_new( n, dataset->image_size, NULL );
+    ok = batch && reader->read( handle, train ? DATASET_TRAIN : DATASET_TEST,
+                                first, n, batch->images, labels );
+
+    for ( size_t i = 0; ok && i < n; ++i )
+      batch->storage[i].label = labels[i];
+
+    if ( !ok )
+      batch_unload( &batch );
+    *dataset_batch_slot( dataset, b ) = batch;
+  }
+
+  free( labels );
+  return ok;
+}
+
+/* binary dataset cache. one file holding every batch already converted to
+   the doubles training reads, so later runs map it instead of re-parsing:
+
+     [ header | zero padding up to DATASET_CACHE_PAYLOAD_OFFSET ]
+     per batch, train then test, each block padded to DATASET_ALIGNMENT:
+     [ labels, uint64 x samples ][ images, double x samples x image_size ]
+
+   the header records a fingerprint (name, size and mtime) of the source files
+   the cache was built from, so touching any of them invalidates it */
+#define DATASET_CACHE_MAGIC          "CMLCACHE"
+#define DATASET_CACHE_VERSION        2
+#define DATASET_CACHE_PAYLOAD_OFFSET 4096
+
+typedef struct {
+  char     magic[8];
+  uint32_t version, header_size;
+  uint64_t image_size, num_classes, batch_size;
+  uint64_t train_samples, test_samples;
+  uint64_t fingerprint;
+  uint64_t payload_offset, payload_size, payload_checksum;
+  uint64_t header_checksum;  /* over the header with this field zeroed */
+} DatasetCacheHeader;
+
+static size_t
+cache_align ( const size_t bytes )
+{
+  return ( bytes + DATASET_ALIGNMENT - 1 ) & ~(size_t) ( DATASET_ALIGNMENT - 1 );
+}
+
+/* four independent multiply-xorshift lanes over 64-bit words, so it runs
+   close to memory bandwidth. chain calls by passing the last result as seed */
+static uint64_t
+cache_checksum ( const void *data, const size_t len, const uint64_t seed )
+{
+  const uint8_t *bytes = data;
+  const size_t words = len / 8;
+  uint64_t lane[4] = { seed, seed ^ 0x243f6a8885a308d3ull,
+                       seed ^ 0x13198a2e03707344ull, seed ^ 0xa4093822299f31d0ull };
+
+  size_t i = 0;
+  for ( ; i + 4 <= words; i += 4 )
+    for ( size_t k = 0; k < 4; ++k ) {
+      uint64_t w;
+      memcpy( &w, bytes + ( i + k ) * 8, 8 );
+      lane[k] = ( lane[k] ^ w ) * 0x9e3779b97f4a7c15ull;
+      lane[k] ^= lane[k] >> 29;
+    }
+
+  for ( ; i <= words; ++i ) {
+    uint64_t w = 0;
+    memcpy( &w, bytes + i * 8, i < words ? 8 : len % 8 );
+    lane[0] = ( lane[0] ^ w ) * 0x9e3779b97f4a7c15ull;
+    lane[0] ^= lane[0] >> 29;
+  }
+
+  uint64_t h = len;
+  for ( size_t k = 0; k < 4; ++k ) {
+    h = ( h ^ lane[k] ) * 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+static uint64_t
+cache_header_checksum ( DatasetCacheHeader header )
+{
+  header.header_checksum = 0;
+  return cache_checksum( &header, sizeof(header), 0 );
+}
+
+/* reader name plus the name, size and mtime of every source file. 0 if any
+   of them is missing */
+static uint64_t
+cache_fingerprint ( const DatasetReader *reader, void *handle )
+{
+  size_t len = 0;
+  const char **sources = reader->sources( handle, &len );
+  uint64_t h = cache_checksum( reader->name, strlen( reader->name ), DATASET_CACHE_VERSION );
+
   for ( size_t i = 0; i < len; ++i ) {
-    char filename_buffer[1024];
-    snprintf ( filename_buffer, 1024, "%s/%s", filepath, filenames[i] );
-    printf("Loading batchfile \'%s\'\n", filename_buffer);
-    batches[i] = batch_load ( filename_buffer, image_size, \
-                              num_samples_per_batch );
+    struct stat st;
+    if ( stat( sources[i], &st ) != 0 )
+      return 0;
+
+    int64_t record[3] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+    h = cache_checksum( sources[i], strlen( sources[i] ), h );
+    h = cache_checksum( record, sizeof(record), h );
   }
-  
-  return batches;
+
+  return h ? h : 1;
+}
+
+static size_t
+cache_labels_bytes ( const size_t samples )
+{
+  return cache_align( samples * sizeof(uint64_t) );
+}
+
+static size_t
+cache_images_bytes ( const Dataset *dataset, const size_t samples )
+{
+  return samples * dataset->image_size * sizeof(double);
+}
+
+static size_t
+cache_payload_bytes ( const Dataset *dataset )
+{
+  size_t bytes = 0;
+  for ( size_t b = 0; b < dataset->train_batches_len + dataset->test_batches_len; ++b ) {
+    size_t n = dataset_batch_samples( dataset, b );
+    bytes += cache_labels_bytes( n ) + cache_align( cache_images_bytes( dataset, n ) );
+  }
+  return bytes;
+}
+
+static bool
+dataset_cache_open ( Dataset *dataset, const char *cache_path, const uint64_t fingerprint )
+{
+  int fd = open( cache_path, O_RDONLY );
+  if ( fd < 0 )
+    return false;
+
+  struct stat st;
+  if ( fstat( fd, &st ) != 0 || (size_t) st.st_size < DATASET_CACHE_PAYLOAD_OFFSET ) {
+    close( fd );
+    return false;
+  }
+
+  const size_t len = st.st_size;
+  void *map = mmap( NULL, len, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if ( map == MAP_FAILED ) {
+    perror( "Failed to map dataset cache" );
+    return false;
+  }
+
+  const DatasetCacheHeader *header = map;
+  const size_t num_batches = dataset->train_batches_len + dataset->test_batches_len;
+
+  if ( memcmp( header->magic, DATASET_CACHE_MAGIC, 8 ) != 0 ||
+       header->version         != DATASET_CACHE_VERSION ||
+       header->header_size     != sizeof(DatasetCacheHeader) ||
+       header->header_checksum != cache_header_checksum( *header ) ||
+       header->fingerprint     != fingerprint ||
+       header->image_size      != dataset->image_size ||
+       header->num_classes     != dataset->num_classes ||
+       header->batch_size      != dataset->batch_size ||
+       header->train_samples   != dataset->train_samples ||
+       header->test_samples    != dataset->test_samples ||
+       header->payload_offset  != DATASET_CACHE_PAYLOAD_OFFSET ||
+       header->payload_size    != cache_payload_bytes( dataset ) ||
+       header->payload_offset + header->payload_size != len ) {
+    fprintf( stderr, "dataset cache '%s' is stale, rebuilding it\n", cache_path );
+    munmap( map, len );
+    return false;
+  }
+
+  const char *payload = (const char *) map + header->payload_offset;
+
+  /* full verification reads all of the payload, which is what the cache is
+     there to avoid, so it's opt-in */
+  const char *verify = getenv( "CML_CACHE_VERIFY" );
+  if ( verify && atoi( verify ) ) {
+    uint64_t checksum = 0;
+    const char *block = payload;
+    for ( size_t b = 0; b < num_batches; ++b ) {
+      size_t n = dataset_batch_samples( dataset, b );
+      checksum = cache_checksum( block, cache_labels_bytes( n ), checksum );
+      block += cache_labels_bytes( n );
+      checksum = cache_checksum( block, cache_images_bytes( dataset, n ), checksum );
+      block += cache_align( cache_images_bytes( dataset, n ) );
+    }
+    if ( checksum != header->payload_checksum ) {
+      fprintf( stderr, "dataset cache '%s' failed its checksum, rebuilding it\n", cache_path );
+      munmap( map, len );
+      return false;
+    }
+  }
+
+  /* start reading ahead now; training touches every page anyway */
+  madvise( map, len, MADV_WILLNEED );
+
+  bool ok = true;
+  const char *block = payload;
+  for ( size_t b = 0; ok && b < num_batches; ++b ) {
+    const size_t n = dataset_batch_samples( dataset, b );
+    const uint64_t *labels = (const uint64_t *) block;
+    double *images = (double *) ( block + cache_labels_bytes( n ) );
+    block += cache_labels_bytes( n ) + cache_align( cache_images_bytes( dataset, n ) );
+
+    Batch *batch = batch_new( n, dataset->image_size, images );
+    *dataset_batch_slot( dataset, b ) = batch;
+    if ( !batch ) {
+      ok = false;
+      break;
+    }
+
+    for ( size_t i = 0; i < n; ++i ) {
+      if ( labels[i] >= dataset->num_classes )
+        ok = false;
+      batch->storage[i].label = labels[i];
+    }
+  }
+
+  if ( !ok ) {
+    fprintf( stderr, "dataset cache '%s' is corrupt, rebuilding it\n", cache_path );
+    for ( size_t b = 0; b < num_batches; ++b )
+      batch_unload( dataset_batch_slot( dataset, b ) );
+    munmap( map, len );
+    return false;
+  }
+
+  dataset->cache_map     = map;
+  dataset->cache_map_len = len;
+  return true;
+}
+
+static bool
+cache_write_block ( FILE *f, const void *data, const size_t len, uint64_t *checksum )
+{
+  static const char zeros[ DATASET_ALIGNMENT ];
+  *checksum = cache_checksum( data, len, *checksum );
+  return fwrite( data, 1, len, f ) == len &&
+         fwrite( zeros, 1, cache_align( len ) - len, f ) == cache_align( len ) - len;
+}
+
+/* written to '<cache>.tmp' and renamed into place, so a crashed or concurrent
+   run never leaves a half-written cache behind */
+static void
+dataset_cache_write ( Dataset *dataset, const char *cache_path, const uint64_t fingerprint )
+{
+  char tmp_path[1024];
+  snprintf( tmp_path, 1024, "%s.tmp", cache_path );
+
+  FILE *f = fopen( tmp_path, "wb" );
+  if ( !f ) {
+    perror( "Failed to create dataset cache" );
+    return;
+  }
+
+  const size_t num_batches = dataset->train_batches_len + dataset->test_batches_len;
+
+  DatasetCacheHeader header = {
+    .magic          = DATASET_CACHE_MAGIC,
+    .version        = DATASET_CACHE_VERSION,
+    .header_size    = sizeof(DatasetCacheHeader),
+    .image_size     = dataset->image_size,
+    .num_classes    = dataset->num_classes,
+    .batch_size     = dataset->batch_size,
+    .train_samples  = dataset->train_samples,
+    .test_samples   = dataset->test_samples,
+    .fingerprint    = fingerprint,
+    .payload_offset = DATASET_CACHE_PAYLOAD_OFFSET,
+    .payload_size   = cache_payload_bytes( dataset )
+  };
+
+  uint64_t *labels = calloc( 1, cache_labels_bytes( dataset->batch_size ) );
+  bool ok = fseek( f, DATASET_CACHE_PAYLOAD_OFFSET, SEEK_SET ) == 0;
+
+  for ( size_t b = 0; ok && b < num_batches; ++b ) {
+    const Batch *batch = *dataset_batch_slot( dataset, b );
+
+    memset( labels, 0, cache_labels_bytes( batch->num_samples ) );
+    for ( size_t i = 0; i < batch->num_samples; ++i )
+      labels[i] = batch->samples[i]->label;
+
+    ok = cache_write_block( f, labels, cache_labels_bytes( batch->num_samples ),
+                            &header.payload_checksum ) &&
+         cache_write_block( f, batch->images, cache_images_bytes( dataset, batch->num_samples ),
+                            &header.payload_checksum );
+  }
+  free( labels );
+
+  header.header_checksum = cache_header_checksum( header );
+  ok = ok && fseek( f, 0, SEEK_SET ) == 0 &&
+       fwrite( &header, sizeof(header), 1, f ) == 1 &&
+       fflush( f ) == 0 && fsync( fileno( f ) ) == 0;
+  ok = fclose( f ) == 0 && ok;
+
+  if ( !ok || rename( tmp_path, cache_path ) != 0 ) {
+    perror( "Failed to write dataset cache" );
+    remove( tmp_path );
+    return;
+  }
+
+  printf( "Wrote dataset cache '%s'\n", cache_path );
 }
 
 Dataset *
-dataset_load_cifar ( const char *filepath )
+dataset_load ( const DatasetReader *reader, const char *filepath, const char *cache_path )
 {
   Dataset * new = calloc( 1, sizeof(Dataset) );
-  new->batch_size   = 10000;
-  new->image_size   = 32 * 32 * 3;
-  new->num_classes  = 10;
+  new->batch_size   = DATASET_BATCH_SAMPLES;
   new->failure      = true;
-  
-  /* load all of the training batches */
-  new->train_batches_len = 5;
-  const char *train_batches[] = {
-    "data_batch_1.bin",
-    "data_batch_2.bin",
-    "data_batch_3.bin",
-    "data_batch_4.bin",
-    "data_batch_5.bin",
-  };
 
-  new->train_batches = batch_load_many( filepath, train_batches,
-                                        new->train_batches_len,
-                                        new->image_size,
-                                        new->batch_size );
-  
-  /* load all (the only one) of the testing batches */
-  new->test_batches_len = 1;
-  const char *test_batches[] = { "test_batch.bin" };
-
-  new->test_batches = batch_load_many( filepath, test_batches,
-                                       new->test_batches_len,
-                                       new->image_size,
-                                       new->batch_size );
-
-  char *label_map[] = {
-    "airplane", 										
-    "automobile", 										
-    "bird", 										
-    "cat",
-    "deer", 										
-    "dog", 										
-    "frog", 										
-    "horse", 										
-    "ship", 										
-    "truck"
-  };
+  void *handle = reader->open( filepath, &new->image_size, &new->num_classes );
+  if ( !handle ) {
+    fprintf( stderr, "unable to open %s dataset '%s'\n", reader->name, filepath );
+    return new;
+  }
+
+  new->train_samples     = reader->count( handle, DATASET_TRAIN );
+  new->test_samples      = reader->count( handle, DATASET_TEST );
+  new->train_batches_len = ( new->train_samples + new->batch_size - 1 ) / new->batch_size;
+  new->test_batches_len  = ( new->test_samples + new->batch_size - 1 ) / new->batch_size;
+  new->train_batches     = calloc( new->train_batches_len, sizeof(Batch *) );
+  new->test_batches      = calloc( new->test_batches_len, sizeof(Batch *) );
+
+  const uint64_t fingerprint = cache_path ? cache_fingerprint( reader, handle ) : 0;
+  bool ok = true;
 
-  new->label_map = malloc( sizeof(char *) * new->num_classes );
-  for ( size_t i = 0; i < new->num_classes; ++i )
-    new->label_map[i] = strdup(label_map[i]);
+  if ( fingerprint && dataset_cache_open( new, cache_path, fingerprint ) ) {
+    printf("Loaded dataset cache \'%s\'\n", cache_path);
+  } else {
+    printf("Loading %s dataset \'%s\'\n", reader->name, filepath);
+    ok = dataset_read_batches( new, reader, handle );
 
-  new->failure = false;
+    if ( fingerprint && ok )
+      dataset_cache_write( new, cache_path, fingerprint );
+  }
+
+  new->label_map = reader->label_map( handle );
+  reader->close( handle );
+
+  new->failure = !ok;
   
   return new;
 }
 
+Dataset *
+dataset_load_cifar ( const char *filepath )
+{
+  char cache_path[1024];
+  snprintf( cache_path, 1024, "%s/%s", filepath, "cifar-10.cache" );
+  return dataset_load( &dataset_reader_cifar10, filepath, cache_path );
+}
+
+Dataset *
+dataset_load_cifar_cached ( const char *filepath, const char *cache_path )
+{
+  return dataset_load( &dataset_reader_cifar10, filepath, cache_path );
+}
+
+char **
+dataset_load_label_map ( const char *filepath, const size_t num_classes )
+{
+  char filename_buffer[1024];
+  snprintf ( filename_buffer, 1024, "%s/%s", filepath, "batches.meta.txt" );
+
+  char **label_map = reader_load_label_names( filename_buffer, num_classes );
+  if ( !label_map )
+    perror( "Failed to open label map" );
+
+  return label_map;
+}
+
 void
 dataset_close ( Dataset **datasetptr )
 {
@@ -147,15 +482,16 @@ dataset_close ( Dataset **datasetptr )
   {
     Dataset *dataset = *datasetptr;
 
-    for ( size_t i = 0; i < dataset->test_batches_len; ++i )
-      batch_unload ( &dataset->test_batches[i] );
-    free( dataset->test_batches );
+    dataset_unload_batches( dataset );
+
+    /* only after the batches, they point into it */
+    if ( dataset->cache_map )
+      munmap( dataset->cache_map, dataset->cache_map_len );
 
-    for ( size_t i = 0; i < dataset->train_batches_len; ++i )
-      batch_unload ( &dataset->train_batches[i] );
-    free( dataset->train_batches );
-    
+    for ( size_t i = 0; dataset->label_map && i < dataset->num_classes; ++i )
+      free( dataset->label_map[i] );
     free( dataset->label_map );
+    free( dataset );
 
     *datasetptr = NULL;
   }
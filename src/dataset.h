@@ -2,6 +2,14 @@
 #define DATASET_HEADER
 
 #include <stdbool.h>
+#include <stddef.h>
+#include "reader.h"
+
+/* alignment of every batch's image block, in memory and in the cache */
+#define DATASET_ALIGNMENT 64
+
+/* samples per in-memory batch, whatever the on-disk file layout */
+#define DATASET_BATCH_SAMPLES 10000
 
 typedef struct {
   double *image;
@@ -11,6 +19,12 @@ typedef struct {
 typedef struct {
   Sample **samples;
   size_t num_samples;
+
+  /* backing storage: every sample's image lives in one contiguous,
+     cache-line aligned block, either owned or inside the mapped cache */
+  Sample *storage;
+  double *images;
+  bool mapped;
 } Batch;
 
 typedef struct {
@@ -20,13 +34,32 @@ typedef struct {
 
   /* dataset metadata */
   size_t batch_size, image_size, num_classes;
+  size_t train_samples, test_samples;
   char **label_map;
 
+  /* the mmapped cache file the batches point into, if it was used */
+  void  *cache_map;
+  size_t cache_map_len;
+
   /* did the load fail */
   bool failure;
 } Dataset;
 
+/* reads any format with a DatasetReader into batches of DATASET_BATCH_SAMPLES.
+   cache_path NULL skips the binary cache. a cache that is missing, corrupt, or
+   older than the reader's source files is rebuilt from them and written back.
+   setting CML_CACHE_VERIFY=1 also checksums the whole payload on load */
+Dataset *dataset_load ( const DatasetReader *reader, const char *root_filepath,
+                        const char *cache_path );
+
+/* loads CIFAR-10 through the binary cache at '<root>/cifar-10.cache' */
 Dataset *dataset_load_cifar ( const char *root_filepath );
+
+Dataset *dataset_load_cifar_cached ( const char *root_filepath, const char *cache_path );
 void     dataset_close      ( Dataset **data );
 
+/* reads the class names from '<root>/batches.meta.txt' without loading any
+   samples (used by the inference server) */
+char   **dataset_load_label_map ( const char *root_filepath, const size_t num_classes );
+
 #endif
@@ -2,127 +2,538 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <termios.h>
-#include "gnuplot_i.h"
 
+#include "bench.h"
+#include "cli.h"
 #include "dataset.h"
 #include "model.h"
+#include "plot.h"
 #include "tensor.h"
 #include "regression.h"
-#include "util.h"
+#include "server.h"
+#include "threadpool.h"
 
-void regression_example ();
-void classification_example ();
+int train_command   ( const CliOptions *options, CliTimer *timer );
+int test_command    ( const CliOptions *options, CliTimer *timer );
+int predict_command ( const CliOptions *options, CliTimer *timer );
+int regress_command ( const CliOptions *options, CliTimer *timer );
+int bench_command   ( const CliOptions *options, CliTimer *timer );
+int serve_command   ( const CliOptions *options, CliTimer *timer );
 
 int
 main ( int argc, char *argv[] )
 {
-  (void) argc;
-  (void) argv;
-  
-  /* regression_example (); */
-  classification_example ();
+  CliOptions options;
+  if ( !cli_parse( argc, argv, &options ) ) {
+    fprintf( stderr, "try '%s --help'\n", argv[0] );
+    return 2;
+  }
+
+  if ( options.command == CLI_HELP ) {
+    cli_usage( stdout, argv[0] );
+    return 0;
+  }
+
+  if ( options.threads )
+    threadpool_set_threads( options.threads );
+
+  CliTimer timer;
+  cli_timer_start( &timer, &options );
+
+  int status = 1;
+  switch ( options.command ) {
+  case CLI_TRAIN:   status = train_command( &options, &timer );   break;
+  case CLI_TEST:    status = test_command( &options, &timer );    break;
+  case CLI_PREDICT: status = predict_command( &options, &timer ); break;
+  case CLI_REGRESS: status = regress_command( &options, &timer ); break;
+  case CLI_BENCH:   status = bench_command( &options, &timer );   break;
+  case CLI_SERVE:   status = serve_command( &options, &timer );   break;
+  case CLI_HELP:    break;
+  }
+
+  if ( !cli_timer_report( &timer, status ) && status == 0 )
+    status = 1;
+
+  threadpool_shutdown();
+  return status;
 }
 
-static int
-getch ( void ) 
+static Dataset *
+load_dataset ( const CliOptions *options )
 {
-  int ch;
-  struct termios oldt, newt;
-  
-  tcgetattr ( STDIN_FILENO, &oldt );
-  newt = oldt;
-  newt.c_lflag &= ~( ICANON | ECHO );
-  tcsetattr ( STDIN_FILENO, TCSANOW, &newt );
-  ch = getchar();
-  tcsetattr ( STDIN_FILENO, TCSANOW, &oldt );
-  
-  return ch;
+  Dataset *dataset;
+  if ( options->no_cache )
+    dataset = dataset_load_cifar_cached( options->data_path, NULL );
+  else if ( options->cache_path )
+    dataset = dataset_load_cifar_cached( options->data_path, options->cache_path );
+  else
+    dataset = dataset_load_cifar( options->data_path );
+
+  if ( dataset->failure ) {
+    fprintf( stderr, "failed to load CIFAR-10 from '%s'\n", options->data_path );
+    dataset_close( &dataset );
+  }
+
+  return dataset;
 }
 
-void
-regression_example ()
-{ 
-  const size_t size = 10; 
-  double x[] = {1, 3, 4, 6,  7,  9,  11, 12, 14, 15};
-  double y[] = {4, 7, 9, 12, 14, 18, 20, 24, 27, 29};
-  
-  RegressionResult result = calculate_linear_regression(x, y, size);
-  
-  gnuplot_ctrl *fig = gnuplot_init();
+static Model *
+load_model ( const CliOptions *options )
+{
+  Model *model = model_load_from_file( options->model_path );
+  if ( model )
+    model_set_precision( model, options->precision );
 
-  /* set the x and y limits */
-  gnuplot_cmd(fig, "set xrange [0:15]");
-  gnuplot_cmd(fig, "set yrange [0:30]");
-  
-  gnuplot_set_xlabel(fig, "x");
-  gnuplot_set_ylabel(fig, "f(x)");
+  return model;
+}
+
+static size_t
+count_samples ( Batch **batches, const size_t len )
+{
+  size_t samples = 0;
+  for ( size_t i = 0; i < len; ++i )
+    samples += batches[i]->num_samples;
+  return samples;
+}
+
+int
+train_command ( const CliOptions *options, CliTimer *timer )
+{
+  Dataset *cifar = load_dataset( options );
+  if ( !cifar )
+    return 1;
+  cli_timer_phase( timer, "load" );
+
+  Model *model = options->num_hidden ?
+    model_new_mlp( cifar->image_size, options->hidden, options->num_hidden,
+                   cifar->num_classes, options->learning_rate ) :
+    model_new( cifar->image_size, cifar->num_classes, options->learning_rate );
+  if ( !model ) {
+    dataset_close( &cifar );
+    return 1;
+  }
+
+  model_set_seed( model, options->seed );
+  model_set_precision( model, options->precision );
+  if ( options->batch_size )
+    model->batch_size = options->batch_size;
+  if ( options->loader_threads )
+    model->loader_threads = options->loader_threads;
+  timer->batch_size     = model->batch_size;
+  timer->loader_threads = model->loader_threads;
+
+  OptimizerConfig optimizer_config = optimizer_default_config( options->optimizer,
+                                                               options->learning_rate );
+  model_set_optimizer( model, &optimizer_config );
+
+  AugmentConfig augment = augment_cifar_config();
+  if ( options->augment )
+    model->augment = &augment;
+
+  if ( options->monitor ) {
+    MonitorConfig monitor_config = monitor_default_config();
+    if ( *options->monitor )
+      monitor_config.png_path = options->monitor;
+    model->monitor = monitor_new( &monitor_config, cifar->label_map, cifar->num_classes );
+  }
+
+  if ( options->checkpoint_path ) {
+    CheckpointConfig checkpoint_config = checkpoint_default_config( options->checkpoint_path );
+    checkpoint_config.resume = options->resume;
+    model->checkpointer = checkpointer_new( &checkpoint_config );
+  }
+  cli_timer_phase( timer, "setup" );
+
+  /* a resumed run only trains the epochs after its snapshot */
+  const size_t resumed = model_train( model, cifar, options->epochs );
+  const double train_seconds = cli_timer_phase( timer, "train" );
+  cli_timer_metric( timer, "resumed_epochs", resumed );
+  if ( resumed < options->epochs && train_seconds > 0 )
+    cli_timer_metric( timer, "train_samples_per_second",
+                      ( options->epochs - resumed ) *
+                      count_samples( cifar->train_batches, cifar->train_batches_len ) /
+                      train_seconds );
+
+  TestResult result = model_test( model, cifar );
+  const double test_seconds = cli_timer_phase( timer, "test" );
+  cli_timer_metric( timer, "test_samples_per_second", result.samples / test_seconds );
+  cli_timer_metric( timer, "test_accuracy", result.accuracy );
+  cli_timer_metric( timer, "test_loss", result.avg_loss );
+
+  model_save_to_file( model, options->out_path );
+  cli_timer_phase( timer, "save" );
+
+  checkpointer_destroy( &model->checkpointer );
+  monitor_destroy( &model->monitor );
+  model_destroy( &model );
+  dataset_close( &cifar );
+
+  return 0;
+}
+
+int
+test_command ( const CliOptions *options, CliTimer *timer )
+{
+  Model *model = load_model( options );
+  if ( !model )
+    return 1;
+
+  Dataset *cifar = load_dataset( options );
+  if ( !cifar ) {
+    model_destroy( &model );
+    return 1;
+  }
+  cli_timer_phase( timer, "load" );
+
+  int status = 1;
+  if ( cifar->image_size != model->image_size || cifar->num_classes != model->num_classes )
+    fprintf( stderr, "'%s' was trained on %zu pixels and %zu classes, the data has %zu and %zu\n",
+             options->model_path, model->image_size, model->num_classes,
+             cifar->image_size, cifar->num_classes );
+  else {
+    TestResult result = model_test( model, cifar );
+    const double test_seconds = cli_timer_phase( timer, "test" );
+    cli_timer_metric( timer, "test_samples_per_second", result.samples / test_seconds );
+    cli_timer_metric( timer, "test_accuracy", result.accuracy );
+    cli_timer_metric( timer, "test_loss", result.avg_loss );
+    status = 0;
+  }
+
+  model_destroy( &model );
+  dataset_close( &cifar );
+
+  return status;
+}
+
+int
+predict_command ( const CliOptions *options, CliTimer *timer )
+{
+  Model *model = load_model( options );
+  if ( !model )
+    return 1;
+
+  Dataset *cifar = load_dataset( options );
+  if ( !cifar ) {
+    model_destroy( &model );
+    return 1;
+  }
+  cli_timer_phase( timer, "load" );
+
+  /* the index runs through the test batches end to end */
+  Sample *sample = NULL;
+  size_t index = options->sample_index;
+  for ( size_t b = 0; b < cifar->test_batches_len && !sample; ++b ) {
+    Batch *batch = cifar->test_batches[b];
+    if ( index < batch->num_samples )
+      sample = batch->samples[ index ];
+    else
+      index -= batch->num_samples;
+  }
+
+  int status = 1;
+  if ( !sample )
+    fprintf( stderr, "there are only %zu test samples\n",
+             count_samples( cifar->test_batches, cifar->test_batches_len ) );
+  else if ( cifar->image_size != model->image_size || cifar->num_classes != model->num_classes )
+    fprintf( stderr, "'%s' doesn't match the data's image size and classes\n",
+             options->model_path );
+  else {
+    Prediction *pred = model_predict( model, sample );
+    cli_timer_phase( timer, "predict" );
+
+    for ( size_t i = 0; i < cifar->num_classes; ++i )
+      printf( "score[%10s] = %.3lf\n", cifar->label_map[i], pred->scores[i] );
+    printf( "Guess: %s\n", cifar->label_map[ pred->most_likely ] );
+    printf( "True Class: %s\n", cifar->label_map[ sample->label ] );
+
+    prediction_destroy( &pred );
+    status = 0;
+  }
+
+  model_destroy( &model );
+  dataset_close( &cifar );
+
+  return status;
+}
+
+/* one line through x, y, printed and plotted over the points. the example
+   points keep their old fixed ranges, a file's are autoscaled */
+static int
+regress_line ( const CliOptions *options, CliTimer *timer, double *x, double *y,
+               const size_t size, const bool example )
+{
+  RegressionResult result = calculate_linear_regression(x, y, size);
+  cli_timer_phase( timer, "fit" );
 
-  /* plot x and y */
-  gnuplot_setstyle(fig, "points") ;
-  gnuplot_plot_xy(fig, x, y, size, "data");
-  
   char regression_label_buffer[1024];
 
   snprintf(regression_label_buffer, 1024, "f(x) = %.3fx + %.3f, R^2 = %.3f",
 	   result.coefficient,
 	   result.intercept,
 	   result.r_squared);
+  printf( "%s\n", regression_label_buffer );
+  cli_timer_metric( timer, "r_squared", result.r_squared );
+
+  /* plot_path NULL opens a window that stays up after we exit */
+  Plot *fig = plot_open(options->plot_path, 1280, 720);
+  if (!fig)
+    return 1;
+
+  /* set the x and y limits */
+  if ( example ) {
+    plot_set_xrange(fig, 0, 15);
+    plot_set_yrange(fig, 0, 30);
+  }
+
+  plot_set_labels(fig, "x", "f(x)");
 
-  gnuplot_setstyle(fig, "lines");
-  gnuplot_plot_slope(fig,
-                     result.coefficient,
-                     result.intercept,
-                     regression_label_buffer);
+  /* plot x and y */
+  plot_xy(fig, x, y, size, "points", "data");
+
+  plot_slope(fig,
+             result.coefficient,
+             result.intercept,
+             regression_label_buffer);
 
-  /* wait for user input */
-  printf("Press any key to exit.");
-  getch();
-  printf("\n");
+  plot_render(fig);
 
   /* end session */
-  gnuplot_close(fig);
+  plot_close(&fig);
+  cli_timer_phase( timer, "plot" );
+
+  return 0;
+}
+
+/* a line per series, all fitted in one sweep */
+static int
+regress_series ( CliTimer *timer, const RegressionData *data )
+{
+  RegressionResult *results = calculate_linear_regressions( data->x, data->y, data->offsets,
+                                                            data->num_series );
+  const double fit_seconds = cli_timer_phase( timer, "fit" );
+  cli_timer_metric( timer, "series", data->num_series );
+  if ( fit_seconds > 0 )
+    cli_timer_metric( timer, "fits_per_second", data->num_series / fit_seconds );
+
+  for ( size_t i = 0; i < data->num_series; ++i )
+    printf( "%s: f(x) = %.3fx + %.3f, R^2 = %.3f (%zu points)\n", data->names[i],
+            results[i].coefficient, results[i].intercept, results[i].r_squared,
+            data->offsets[i + 1] - data->offsets[i] );
+
+  free( results );
+  return 0;
 }
 
-void
-classification_example ()
+/* least squares over the sparse design, with R^2 from its predictions */
+static int
+regress_sparse ( CliTimer *timer, const RegressionData *data )
 {
-  /* load CIFAR 10 */
-  
-  Dataset *cifar = dataset_load_cifar("./data/cifar-10");
-  if (cifar->failure) {
-    fprintf(stderr, "failed to load CIFAR-10");
-    return;
+  Tensor2D response = { .data = data->y, .rows = data->len, .cols = 1 };
+  Tensor2D *beta = calculate_ols_beta_sparse( data->design, &response );
+  cli_timer_phase( timer, "fit" );
+  if ( !beta )
+    return 1;
+
+  double *predictions = malloc( data->len * sizeof(double) );
+  if ( !predictions ) {
+    fprintf( stderr, "not enough memory for %zu predictions\n", data->len );
+    Tensor2D_destroy( &beta );
+    return 1;
+  }
+  SparseTensor2D_spmv( data->design, beta->data, predictions );
+
+  double mean = 0, residual = 0, total = 0;
+  for ( size_t i = 0; i < data->len; ++i )
+    mean += data->y[i];
+  mean /= data->len;
+  for ( size_t i = 0; i < data->len; ++i ) {
+    residual += ( data->y[i] - predictions[i] ) * ( data->y[i] - predictions[i] );
+    total    += ( data->y[i] - mean ) * ( data->y[i] - mean );
   }
-  
-  Model *model = model_new ( cifar->image_size, cifar->num_classes, 0.001 );
+  /* a constant response is all intercept */
+  const double r_squared = total > 0 ? 1 - residual / total : 1.0;
 
-  model_train ( model, cifar, 10 );
+  for ( size_t c = 0; c < beta->rows; ++c )
+    printf( "beta[%zu] = %.6g\n", c, beta->data[c] );
+  printf( "%zu observations, %zu columns, %zu non-zeros, R^2 = %.3f\n", data->len,
+          data->design->cols, data->design->nnz, r_squared );
+  cli_timer_metric( timer, "r_squared", r_squared );
 
-  printf( "Total Guesses: %zu\n", model->total_guesses );
+  free( predictions );
+  Tensor2D_destroy( &beta );
+  return 0;
+}
+
+int
+regress_command ( const CliOptions *options, CliTimer *timer )
+{
+  if ( !options->input_path ) {
+    double x[] = {1, 3, 4, 6,  7,  9,  11, 12, 14, 15};
+    double y[] = {4, 7, 9, 12, 14, 18, 20, 24, 27, 29};
+    return regress_line( options, timer, x, y, 10, true );
+  }
+
+  RegressionData *data = regression_data_read( options->input_path );
+  if ( !data )
+    return 1;
+  cli_timer_phase( timer, "read" );
+
+  int status = 1;
+  switch ( data->kind ) {
+  case REGRESSION_DATA_LINE:
+    status = regress_line( options, timer, data->x, data->y, data->len, false );
+    break;
+  case REGRESSION_DATA_SERIES:
+    status = regress_series( timer, data );
+    break;
+  case REGRESSION_DATA_SPARSE:
+    status = regress_sparse( timer, data );
+    break;
+  }
+
+  regression_data_destroy( &data );
+  return status;
+}
+
+int
+bench_command ( const CliOptions *options, CliTimer *timer )
+{
+  const size_t *args = options->bench_args;
+  const size_t len = options->num_bench_args;
+
+  /* ./main bench regress [number of series] [points per series] */
+  if ( strcmp( options->bench_name, "regress" ) == 0 )
+    bench_regressions( len >= 1 ? args[0] : 1000000,
+                       len >= 2 ? args[1] : 32 );
+
+  /* ./main bench sparse [rows] [groups] [levels per group] */
+  else if ( strcmp( options->bench_name, "sparse" ) == 0 )
+    bench_sparse_ols( len >= 1 ? args[0] : 100000,
+                      len >= 2 ? args[1] : 8,
+                      len >= 3 ? args[2] : 50 );
+
+  /* ./main bench rls [points] [features] [window, 0 for all] */
+  else if ( strcmp( options->bench_name, "rls" ) == 0 )
+    bench_rls( len >= 1 ? args[0] : 1000000,
+               len >= 2 ? args[1] : 8,
+               len >= 3 ? args[2] : 1000 );
+
+  /* ./main bench [transpose] [max matrix size] */
+  else
+    bench_transpose( len >= 1 ? args[0] : 16384 );
+
+  cli_timer_phase( timer, options->bench_name );
+  return 0;
+}
+
+/* labelled records in the layout serve reads (a label byte, then the
+   image's bytes), scaled to [0, 1] */
+static bool
+load_records ( const char *path, const Model *model, double **images, size_t **labels,
+               size_t *samples )
+{
+  FILE *file = fopen( path, "rb" );
+  if ( !file ) {
+    perror( "Failed to open the calibration records" );
+    return false;
+  }
+
+  const size_t record_size = 1 + model->image_size;
+  fseek( file, 0, SEEK_END );
+  const long bytes = ftell( file );
+  rewind( file );
+  if ( bytes <= 0 || bytes % record_size != 0 ) {
+    fprintf( stderr, "'%s' isn't a whole number of %zu byte records\n", path, record_size );
+    fclose( file );
+    return false;
+  }
+
+  *samples = bytes / record_size;
+  *images  = malloc( *samples * model->image_size * sizeof(double) );
+  *labels  = malloc( *samples * sizeof(size_t) );
+  unsigned char *record = malloc( record_size );
+
+  bool ok = *images && *labels && record;
+  if ( !ok )
+    fprintf( stderr, "not enough memory for %zu calibration records\n", *samples );
+  for ( size_t i = 0; ok && i < *samples; ++i ) {
+    ok = fread( record, 1, record_size, file ) == record_size && record[0] < model->num_classes;
+    if ( !ok ) {
+      fprintf( stderr, "'%s': record %zu is truncated or has no such class\n", path, i );
+      break;
+    }
+    ( *labels )[i] = record[0];
+    for ( size_t k = 0; k < model->image_size; ++k )
+      ( *images )[ i * model->image_size + k ] = record[k + 1] / 255.0;
+  }
+
+  free( record );
+  fclose( file );
+  if ( !ok ) {
+    free( *images );
+    free( *labels );
+  }
+  return ok;
+}
+
+int
+serve_command ( const CliOptions *options, CliTimer *timer )
+{
+  Model *model = load_model( options );
+  if ( !model )
+    return 1;
+
+  char **label_map = dataset_load_label_map ( options->data_path, model->num_classes );
+  if ( !label_map ) {
+    model_destroy ( &model );
+    return 1;
+  }
+  cli_timer_phase( timer, "load" );
+
+  ServerConfig config = server_default_config ();
+  config.socket_path = options->socket_path;
+  config.temperature = options->temperature;
+  if ( options->batch_size )
+    config.max_batch = options->batch_size;
+  timer->batch_size = config.max_batch;
+
+  if ( options->calibrate_path ) {
+    /* stdin mode answers on stdout, keep the calibration chatter off it */
+    fflush( stdout );
+    const int saved_stdout = dup( STDOUT_FILENO );
+    dup2( STDERR_FILENO, STDOUT_FILENO );
+
+    double *images;
+    size_t *labels, samples;
+    const bool loaded = load_records( options->calibrate_path, model, &images, &labels,
+                                      &samples );
+    if ( loaded ) {
+      config.temperature = model_fit_temperature( model, images, labels, samples );
+      free( images );
+      free( labels );
+    }
+
+    fflush( stdout );
+    dup2( saved_stdout, STDOUT_FILENO );
+    close( saved_stdout );
+    if ( !loaded ) {
+      for ( size_t i = 0; i < model->num_classes; ++i )
+        free( label_map[i] );
+      free( label_map );
+      model_destroy( &model );
+      return 1;
+    }
+    cli_timer_phase( timer, "calibrate" );
+    cli_timer_metric( timer, "temperature", config.temperature );
+  }
+
+  int status = model_serve ( model, label_map, &config );
+  cli_timer_phase( timer, "serve" );
 
-  printf( "Guess Dist.:        [" );
-  for ( size_t i = 0; i < model->num_classes; ++i )
-    printf( "% 6zu ", model->guess_dist[i] );
-  printf( "]\n" );
-  
-  float *guess_prob_dist = calloc( model->num_classes, sizeof(float) );
   for ( size_t i = 0; i < model->num_classes; ++i )
-    guess_prob_dist[i] = ( model->guess_dist[i] / (float) model->total_guesses );
-  printf( "Guess Prob. Dist.:  " );
-  print_array( guess_prob_dist, model->num_classes );
-  free( guess_prob_dist );
-  guess_prob_dist = NULL;
-
-  Sample *test_sample = cifar->train_batches[0]->samples[0];
-  Prediction *pred = model_predict ( model, test_sample );
-  for ( size_t i = 0; i < cifar->num_classes; ++i )
-    printf( "score[% 10s] = %.3lf\n", cifar->label_map[i], pred->scores[i] );
-  printf( "True Class: %s\n", cifar->label_map[ test_sample->label ] );
-  
-  model_test  ( model, cifar );
-  model_save_to_file ( model, "cifar-10-model.bin" );
-  
+    free( label_map[i] );
+  free( label_map );
   model_destroy ( &model );
-  dataset_close ( &cifar );
+
+  return status;
 }
@@ -3,19 +3,82 @@
 #include <string.h>
 #include <stdlib.h>
 #include "model.h"
+#include "rng.h"
+#include "sampler.h"
+#include "tensor_expr.h"
+#include "threadpool.h"
 #include "util.h"
 
 Model *
 model_new ( const size_t image_size, const size_t num_classes, float learning_rate )
 {
+  return model_new_mlp( image_size, NULL, 0, num_classes, learning_rate );
+}
+
+Model *
+model_new_mlp ( const size_t image_size, const size_t *hidden, const size_t num_hidden,
+                const size_t num_classes, float learning_rate )
+{
+  if ( num_hidden >= MODEL_MAX_LAYERS ) {
+    fprintf( stderr, "a model has at most %d hidden layers\n", MODEL_MAX_LAYERS - 1 );
+    return NULL;
+  }
+  for ( size_t l = 0; l < num_hidden; ++l )
+    if ( hidden[l] == 0 ) {
+      fprintf( stderr, "hidden layer %zu has no units\n", l + 1 );
+      return NULL;
+    }
+
   Model *new = malloc( sizeof(Model) );
 
-  new->weights       = calloc( num_classes * image_size, sizeof(double) );
-  new->biases        = calloc( num_classes, sizeof(double) );
+  /* lay the layers out end to end, each one's weights then its biases */
+  new->num_layers = num_hidden + 1;
+  new->num_params = 0;
+  new->max_width  = num_classes;
+  for ( size_t l = 0; l < new->num_layers; ++l ) {
+    ModelLayer *layer = &new->layers[l];
+    layer->inputs  = l ? new->layers[l - 1].outputs : image_size;
+    layer->outputs = l < num_hidden ? hidden[l] : num_classes;
+    layer->offset  = new->num_params;
+    new->num_params += layer->outputs * ( layer->inputs + 1 );
+    if ( layer->outputs > new->max_width )
+      new->max_width = layer->outputs;
+  }
+
+  new->params = calloc( new->num_params, sizeof(double) );
+  for ( size_t l = 0; l < new->num_layers; ++l ) {
+    ModelLayer *layer = &new->layers[l];
+    layer->weights = new->params + layer->offset;
+    layer->biases  = layer->weights + layer->outputs * layer->inputs;
+  }
+
+  new->logits_scratch = new->num_layers > 1 ?
+                        malloc( 2 * new->max_width * sizeof(double) ) : NULL;
+
+  new->weights       = new->layers[0].weights;
+  new->biases        = new->layers[0].biases;
   new->image_size    = image_size;
   new->num_classes   = num_classes;
   new->learning_rate = learning_rate;
 
+  /* only a linear model has a packed inference layout */
+  new->num_panels     = new->num_layers == 1 ?
+                        ( num_classes + MODEL_PACK_PANEL - 1 ) / MODEL_PACK_PANEL : 0;
+  new->packed_weights = new->num_panels ?
+                        calloc( new->num_panels * MODEL_PACK_PANEL * image_size, sizeof(float) ) :
+                        NULL;
+  new->packed_valid   = false;
+  new->precision      = MODEL_PRECISION_FLOAT;
+
+  new->optimizer      = NULL;
+  new->batch_size     = 1;
+  new->loader_threads = 1;
+  new->seed           = 0;
+  new->augment        = NULL;
+  new->normalization_folded = false;
+  new->monitor        = NULL;
+  new->checkpointer   = NULL;
+
   new->guess_dist    = calloc( num_classes, sizeof(size_t) );
   new->total_guesses = 0;
   
@@ -27,19 +90,75 @@ model_new ( const size_t image_size, const size_t num_classes, float learning_ra
 void
 model_reset ( Model *model )
 {
-  /* initialize the weights with random values */
-  for ( size_t i = 0; i < model->num_classes * model->image_size; ++i )
-    model->weights[i] = ( rand() / (double) RAND_MAX ) * 0.1 - 0.05;
+  /* initialize the weights with random values from the model's seed, one
+     stream per layer: small ones for a softmax regression, He
+     initialization (variance 2 / fan-in) ahead of ReLUs */
+  for ( size_t l = 0; l < model->num_layers; ++l ) {
+    ModelLayer *layer = &model->layers[l];
+    const double limit = model->num_layers == 1 ? 0.05 : sqrt( 6.0 / layer->inputs );
+
+    rng_fill_uniform( model->seed, RNG_STREAM( RNG_WEIGHTS, l ), layer->weights,
+                      layer->outputs * layer->inputs, -limit, limit );
+    memset( layer->biases, 0, layer->outputs * sizeof(double) );
+  }
+
+  model->packed_valid = false;
+}
+
+void
+model_set_seed ( Model *model, const uint64_t seed )
+{
+  model->seed = seed;
+  model_reset( model );
+}
+
+void
+model_pack ( Model *model )
+{
+  const size_t image_size = model->image_size;
+
+  if ( model->num_layers > 1 || model->precision == MODEL_PRECISION_DOUBLE ) {
+    model->packed_valid = false;
+    return;
+  }
+
+  for ( size_t panel = 0; panel < model->num_panels; ++panel ) {
+    float *dst = model->packed_weights + panel * image_size * MODEL_PACK_PANEL;
+
+    for ( size_t c = 0; c < MODEL_PACK_PANEL; ++c ) {
+      size_t class_index = panel * MODEL_PACK_PANEL + c;
+
+      /* padding classes stay zero */
+      if ( class_index >= model->num_classes ) {
+        for ( size_t k = 0; k < image_size; ++k )
+          dst[ k * MODEL_PACK_PANEL + c ] = 0.0f;
+        continue;
+      }
 
-  memset( model->biases, 0, model->num_classes );
+      const double *src = model->weights + class_index * image_size;
+      for ( size_t k = 0; k < image_size; ++k )
+        dst[ k * MODEL_PACK_PANEL + c ] = (float) src[k];
+    }
+  }
+
+  model->packed_valid = true;
+}
+
+void
+model_set_precision ( Model *model, const ModelPrecision precision )
+{
+  model->precision = precision;
+  model_pack( model );
 }
 
 void
 model_destroy ( Model **model )
 {
   if ( model && *model ) {
-    free( (*model)->weights    );
-    free( (*model)->biases     );
+    free( (*model)->params     );
+    free( (*model)->logits_scratch );
+    free( (*model)->packed_weights );
+    optimizer_destroy( &(*model)->optimizer );
     free( (*model)->guess_dist );
     free( *model );
     *model = NULL;
@@ -47,119 +166,628 @@ model_destroy ( Model **model )
 }
 
 void
+model_set_optimizer ( Model *model, const OptimizerConfig *config )
+{
+  optimizer_destroy( &model->optimizer );
+  model->optimizer = optimizer_new( config, model->num_params );
+  model->learning_rate = config->learning_rate;
+}
+
+/* copies the training state into the checkpointer's spare snapshot and
+   hands it to the writer thread. the copy is the only cost to training */
+static void
+model_checkpoint ( Model *model, const size_t epochs_done )
+{
+  const Optimizer *optimizer = model->optimizer;
+  const size_t num_params = model->num_params;
+
+  CheckpointState *state = checkpoint_begin( model->checkpointer, num_params,
+                                             optimizer->velocity != NULL,
+                                             optimizer->second_moment != NULL );
+  state->image_size              = model->image_size;
+  state->num_classes             = model->num_classes;
+  state->epoch                   = epochs_done;
+  state->seed                    = model->seed;
+  state->learning_rate           = model->learning_rate;
+  state->optimizer_config        = optimizer->config;
+  state->optimizer_steps         = optimizer->steps;
+  state->optimizer_learning_rate = optimizer->learning_rate;
+
+  memcpy( state->params, model->params, num_params * sizeof(double) );
+  if ( state->velocity )
+    memcpy( state->velocity, optimizer->velocity, num_params * sizeof(double) );
+  if ( state->second_moment )
+    memcpy( state->second_moment, optimizer->second_moment, num_params * sizeof(double) );
+
+  checkpoint_submit( model->checkpointer );
+}
+
+/* loads the latest checkpoint into the model. returns the number of epochs
+   it had completed, 0 when there's nothing (usable) to resume from: no
+   file, another model, a run that already reached epochs, or one trained
+   with a different optimizer, learning rate or seed than this one asks for */
+static size_t
+model_resume ( Model *model, const size_t epochs )
+{
+  const char *path = model->checkpointer->config.path;
+  CheckpointState *state = checkpoint_read( path );
+  if ( !state )
+    return 0;
+
+  const size_t num_params = model->num_params;
+  const OptimizerConfig requested = model->optimizer ? model->optimizer->config :
+    optimizer_default_config( OPTIMIZER_SGD, model->learning_rate );
+
+  const char *mismatch = NULL;
+  if ( state->image_size != model->image_size || state->num_classes != model->num_classes ||
+       state->num_params != num_params )
+    mismatch = "is for a different model";
+  else if ( state->epoch >= epochs )
+    mismatch = "has already finished training";
+  else if ( state->optimizer_config.type != requested.type )
+    mismatch = "was trained with a different optimizer";
+  else if ( state->optimizer_config.learning_rate != requested.learning_rate ||
+            state->learning_rate != model->learning_rate )
+    mismatch = "was trained at a different learning rate";
+  else if ( state->seed != model->seed )
+    mismatch = "was trained with a different seed";
+
+  if ( mismatch ) {
+    fprintf( stderr, "checkpoint '%s' %s (epoch %zu of %zu), starting over\n",
+             path, mismatch, state->epoch, epochs );
+    checkpoint_state_destroy( &state );
+    return 0;
+  }
+
+  /* snapshots are taken in the training space, never folded */
+  memcpy( model->params, state->params, num_params * sizeof(double) );
+  model->normalization_folded = false;
+
+  /* the schedule and the rest of the config come from the snapshot too */
+  model_set_optimizer( model, &state->optimizer_config );
+
+  Optimizer *optimizer = model->optimizer;
+  optimizer->steps         = state->optimizer_steps;
+  optimizer->learning_rate = state->optimizer_learning_rate;
+  if ( optimizer->velocity && state->velocity )
+    memcpy( optimizer->velocity, state->velocity, num_params * sizeof(double) );
+  if ( optimizer->second_moment && state->second_moment )
+    memcpy( optimizer->second_moment, state->second_moment, num_params * sizeof(double) );
+
+  const size_t epoch = state->epoch;
+  checkpoint_state_destroy( &state );
+
+  printf( "Resuming from '%s' after epoch %zu\n", path, epoch );
+  return epoch;
+}
+
+ModelWorkspace *
+model_workspace_new ( const Model *model, const size_t rows )
+{
+  ModelWorkspace *new = calloc( 1, sizeof(ModelWorkspace) );
+  new->rows = rows;
+  for ( size_t l = 0; l < model->num_layers; ++l )
+    new->activations[l] = Tensor2D_create( rows, model->layers[l].outputs );
+  for ( size_t i = 0; i < 2; ++i )
+    new->deltas[i] = Tensor2D_create( rows, model->max_width );
+  return new;
+}
+
+void
+model_workspace_destroy ( ModelWorkspace **workspace )
+{
+  if ( workspace && *workspace ) {
+    for ( size_t l = 0; l < MODEL_MAX_LAYERS; ++l )
+      Tensor2D_destroy( &(*workspace)->activations[l] );
+    Tensor2D_destroy( &(*workspace)->deltas[0] );
+    Tensor2D_destroy( &(*workspace)->deltas[1] );
+    free( *workspace );
+    *workspace = NULL;
+  }
+}
+
+/* forward pass over count rows of images. every layer is one product with
+   the layer below, A W^T (no transpose is materialized), followed by the
+   bias and, for hidden layers, the ReLU. returns the logits */
+static Tensor2D *
+model_forward ( Model *model, ModelWorkspace *workspace, double *images, const size_t count )
+{
+  Tensor2D input = { .data = images, .rows = count, .cols = model->image_size };
+  Tensor2D *below = &input;
+
+  for ( size_t l = 0; l < model->num_layers; ++l ) {
+    const ModelLayer *layer = &model->layers[l];
+    const bool hidden = l + 1 < model->num_layers;
+    Tensor2D weights = { .data = layer->weights, .rows = layer->outputs, .cols = layer->inputs };
+    Tensor2D *out = workspace->activations[l];
+    out->rows = count;
+
+    TensorExpr *forward = TensorExpr_mult( TensorExpr_leaf( below ),
+                                           TensorExpr_transpose( TensorExpr_leaf( &weights ) ) );
+    TensorExpr_eval_into( forward, out );
+    TensorExpr_destroy( &forward );
+
+    for ( size_t b = 0; b < count; ++b ) {
+      double *row = out->data + b * layer->outputs;
+      for ( size_t c = 0; c < layer->outputs; ++c ) {
+        const double z = row[c] + layer->biases[c];
+        row[c] = hidden && z < 0.0 ? 0.0 : z;
+      }
+    }
+
+    below = out;
+  }
+
+  return workspace->activations[ model->num_layers - 1 ];
+}
+
+/* backward pass from the loss gradient w.r.t. the logits, which the caller
+   leaves in deltas[0], into grads (laid out like params). per layer:
+   dW = delta^T A in one pass over the layer below, db = column sums of
+   delta, and the delta below is delta W masked by that layer's ReLU */
+static void
+model_backward ( Model *model, ModelWorkspace *workspace, double *images, const size_t count,
+                 double *grads )
+{
+  Tensor2D input = { .data = images, .rows = count, .cols = model->image_size };
+  size_t current = 0;
+
+  for ( size_t l = model->num_layers; l-- > 0; ) {
+    const ModelLayer *layer = &model->layers[l];
+    Tensor2D *delta = workspace->deltas[ current ];
+    Tensor2D *below = l ? workspace->activations[ l - 1 ] : &input;
+    delta->rows = count;
+    delta->cols = layer->outputs;
+
+    Tensor2D weight_grads = {
+      .data = grads + layer->offset,
+      .rows = layer->outputs,
+      .cols = layer->inputs
+    };
+    TensorExpr *backward = TensorExpr_mult( TensorExpr_transpose( TensorExpr_leaf( delta ) ),
+                                            TensorExpr_leaf( below ) );
+    TensorExpr_eval_into( backward, &weight_grads );
+    TensorExpr_destroy( &backward );
+
+    double *bias_grads = weight_grads.data + layer->outputs * layer->inputs;
+    memset( bias_grads, 0, layer->outputs * sizeof(double) );
+    for ( size_t b = 0; b < count; ++b )
+      for ( size_t c = 0; c < layer->outputs; ++c )
+        bias_grads[c] += delta->data[ b * layer->outputs + c ];
+
+    if ( l == 0 )
+      break;
+
+    Tensor2D weights = { .data = layer->weights, .rows = layer->outputs, .cols = layer->inputs };
+    Tensor2D *next = workspace->deltas[ current ^ 1 ];
+    next->rows = count;
+    next->cols = layer->inputs;
+
+    TensorExpr *propagate = TensorExpr_mult( TensorExpr_leaf( delta ), TensorExpr_leaf( &weights ) );
+    TensorExpr_eval_into( propagate, next );
+    TensorExpr_destroy( &propagate );
+
+    /* the ReLU passed the gradient wherever its output was positive */
+    for ( size_t i = 0; i < count * layer->inputs; ++i )
+      if ( below->data[i] <= 0.0 )
+        next->data[i] = 0.0;
+
+    current ^= 1;
+  }
+}
+
+size_t
 model_train ( Model *model, Dataset *dataset, const size_t epochs )
 { 
   printf( "Beginning training..\n" );
+
+  /* updates go to the class-major weights, the packed copy is stale until
+     training is done */
+  model->packed_valid = false;
+
+  /* the optimizer state has to be restored before the sampler starts */
+  const size_t first_epoch = model->checkpointer && model->checkpointer->config.resume ?
+                             model_resume( model, epochs ) : 0;
+
+  if ( !model->optimizer ) {
+    OptimizerConfig config = optimizer_default_config( OPTIMIZER_SGD, model->learning_rate );
+    model_set_optimizer( model, &config );
+  }
+
+  Optimizer *optimizer = model->optimizer;
+  const size_t num_classes = model->num_classes;
+
+  Sampler *sampler = sampler_new( dataset, model->batch_size, model->loader_threads,
+                                  model->seed, model->augment );
+  if ( !sampler )
+    return first_epoch;
+
+  /* train in the normalized input space */
+  if ( model->normalization_folded && model->augment ) {
+    augment_fold_normalization( model->augment, model->weights, model->biases,
+                                model->layers[0].outputs, true );
+    model->normalization_folded = false;
+  }
+
+  /* per mini-batch buffers, reused across steps */
+  const size_t batch_size = sampler->batch_size;
+  ModelWorkspace *workspace = model_workspace_new( model, batch_size );
+  float *scores_raw = calloc( num_classes, sizeof(float) );
+  float *scores     = calloc( num_classes, sizeof(float) );
+  double *grads     = calloc( model->num_params, sizeof(double) );
+  Monitor *monitor = model->monitor;
+  size_t *confusion = monitor ? calloc( num_classes * num_classes, sizeof(size_t) ) : NULL;
+
+  printf( "Optimizer: %s, batch size: %zu\n", optimizer_name( optimizer->config.type ),
+          batch_size );
+  if ( model->num_layers > 1 ) {
+    printf( "Layers: %zu", model->image_size );
+    for ( size_t l = 0; l < model->num_layers; ++l )
+      printf( " -> %zu", model->layers[l].outputs );
+    printf( "\n" );
+  }
   
-  for ( size_t epoch = 0; epoch < epochs; ++epoch ) {
+  for ( size_t epoch = first_epoch; epoch < epochs; ++epoch ) {
     double total_loss = 0;
     size_t total_samples = 0;
-    
-    for ( size_t batch_index = 0; batch_index < dataset->train_batches_len; ++batch_index ) {
-      printf( "Reading batch %zu/%zu..\n", batch_index + 1, dataset->train_batches_len );
-      Batch *batch = dataset->train_batches[batch_index];
-
-      for ( size_t sample_index = 0; sample_index < batch->num_samples; ++sample_index ) {
-
-        /* generate prediction */
-        Sample *sample = batch->samples[sample_index];
-        Prediction *pred = model_predict(model, sample);
-
-        if ( sample->image_size != model->image_size )
-          printf( "ERR SIZE MISMATCH! %zu != %zu\n", sample->image_size, model->image_size );
-        
-        ++total_samples;
-
-	static unsigned int error_print_counter = 0;
-
-	if ( error_print_counter < 20 )
-	  printf( "Error:          [" );
-	
-        /* compute losses and gradients */
-        for ( size_t class_index = 0; class_index < dataset->num_classes; ++class_index ) {
-          bool correct = class_index == sample->label;
-          double predicted = clamp( pred->scores[class_index], 1e-9, 1.0 - 1e-9 );
-
-          double error;
-          if ( correct ) {
-            error = -predicted;
-            total_loss += -log( predicted );
-          } else
-            error = predicted;
-
-	  if (error_print_counter < 20)
-	    printf( "% 05.3lf ", error );
-          
-          /* update weights and biases in the model */
-          for ( size_t k = 0; k < sample->image_size; ++k )
-            model->weights[ class_index * model->image_size + k ] -= \
-              model->learning_rate * error * sample->image[ k ];
-          model->biases[ class_index ] -= model->learning_rate * error;
+
+    optimizer_begin_epoch( optimizer, epoch );
+    sampler_begin_epoch( sampler, epoch );
+    if ( confusion )
+      memset( confusion, 0, num_classes * num_classes * sizeof(size_t) );
+
+    MiniBatch *batch;
+    size_t step = 0;
+    while ( ( batch = sampler_next( sampler ) ) ) {
+      const size_t count = batch->count;
+      const double loss_before = total_loss;
+      size_t correct = 0;
+
+      Tensor2D *logits = model_forward( model, workspace, batch->images, count );
+      Tensor2D *errors = workspace->deltas[0];
+
+      /* d(loss)/d(logit) = (p - y) / count for mean softmax cross entropy */
+      for ( size_t b = 0; b < count; ++b ) {
+        for ( size_t c = 0; c < num_classes; ++c )
+          scores_raw[c] = logits->data[ b * num_classes + c ];
+        softmax( scores_raw, scores, num_classes );
+
+        const size_t label = batch->labels[b];
+        total_loss += -log( clamp( scores[label], 1e-9, 1.0 - 1e-9 ) );
+
+        size_t most_likely = 0;
+        double *error_row = errors->data + b * num_classes;
+        for ( size_t c = 0; c < num_classes; ++c ) {
+          error_row[c] = ( scores[c] - ( c == label ? 1.0 : 0.0 ) ) / count;
+          if ( scores[c] > scores[most_likely] )
+            most_likely = c;
         }
 
-	if ( error_print_counter < 20 )
-	  printf("]\n\n");
-	
-	++error_print_counter;
+        ++model->guess_dist[ most_likely ];
+        ++model->total_guesses;
+        correct += most_likely == label;
+        if ( confusion )
+          ++confusion[ label * num_classes + most_likely ];
+      }
+      total_samples += count;
+
+      if ( monitor ) {
+        monitor_record( monitor, epoch, count, correct, total_loss - loss_before );
+        if ( ++step % MONITOR_CONFUSION_STEPS == 0 )
+          monitor_publish_confusion( monitor, confusion, "training", false );
+      }
+
+      model_backward( model, workspace, batch->images, count, grads );
+      sampler_release( sampler, batch );
 
-        prediction_destroy( &pred );
+      /* update every layer's weights and biases */
+      optimizer_begin_step( optimizer );
+      for ( size_t l = 0; l < model->num_layers; ++l ) {
+        const ModelLayer *layer = &model->layers[l];
+        const size_t num_weights = layer->outputs * layer->inputs;
+        optimizer_step( optimizer, layer->weights, grads + layer->offset, num_weights,
+                        layer->offset, true );
+        optimizer_step( optimizer, layer->biases, grads + layer->offset + num_weights,
+                        layer->outputs, layer->offset + num_weights, false );
       }
     }
 
+    if ( monitor ) {
+      monitor_flush( monitor );
+      monitor_publish_confusion( monitor, confusion, "training", true );
+    }
+
     if (total_samples == 0)
       fprintf(stderr, "no samples were seen!");
     else 
-      printf("Epoch %zu/%zu, Samples: %zu, Loss: %.4f\n",
-             epoch + 1, epochs, total_samples, total_loss / total_samples);
+      printf("Epoch %zu/%zu, Samples: %zu, Loss: %.4f, LR: %.6f\n",
+             epoch + 1, epochs, total_samples, total_loss / total_samples,
+             optimizer->learning_rate);
+
+    if ( model->checkpointer && checkpoint_due( model->checkpointer, epoch, epochs ) )
+      model_checkpoint( model, epoch + 1 );
+  }
+
+  model_workspace_destroy( &workspace );
+  free( grads );
+  free( scores_raw );
+  free( scores );
+  free( confusion );
+  sampler_destroy( &sampler );
+
+  /* the final snapshot is on disk before training is reported done */
+  if ( model->checkpointer && !checkpoint_wait( model->checkpointer ) )
+    fprintf( stderr, "couldn't write every checkpoint to '%s'\n",
+             model->checkpointer->config.path );
+
+  if ( model->augment && model->augment->normalize ) {
+    augment_fold_normalization( model->augment, model->weights, model->biases,
+                                model->layers[0].outputs, false );
+    model->normalization_folded = true;
   }
+
+  model_pack( model );
+  return first_epoch;
 }
 
-void
+/* per-thread accumulators for model_test, padded so neighbouring threads
+   don't share cache lines */
+typedef struct {
+  size_t *confusion_matrix;
+  size_t correct, top_k_correct;
+  double total_loss;
+  float *logits, *scores;
+  char padding[64];
+} EvalShard;
+
+/* rows per forward pass when a multi-layer model is evaluated in blocks */
+#define MODEL_TEST_BLOCK 64
+
+typedef struct {
+  Model *model;
+  Batch *batch;
+  EvalShard *shards;
+  ModelWorkspace **workspaces;  /* per worker, multi-layer models only */
+} EvalArgs;
+
+/* scores one sample whose logits are in shard->logits */
+static void
+model_test_score ( const Model *model, EvalShard *shard, const size_t label )
+{
+  const size_t num_classes = model->num_classes;
+  softmax( shard->logits, shard->scores, num_classes );
+
+  /* rank of the true class = number of classes scored above it */
+  const float truth = shard->scores[ label ];
+  size_t most_likely = 0, rank = 0;
+  for ( size_t c = 0; c < num_classes; ++c ) {
+    if ( shard->scores[c] > shard->scores[most_likely] )
+      most_likely = c;
+    if ( shard->scores[c] > truth )
+      ++rank;
+  }
+
+  shard->total_loss += -log( truth + 1e-9 );
+  shard->correct += most_likely == label;
+  shard->top_k_correct += rank < MODEL_TEST_TOP_K;
+  ++shard->confusion_matrix[ label * num_classes + most_likely ];
+}
+
+static void
+model_test_samples ( size_t begin, size_t end, void *ctx )
+{
+  EvalArgs *args = ctx;
+  EvalShard *shard = &args->shards[ threadpool_worker_index() ];
+
+  for ( size_t sample_index = begin; sample_index < end; ++sample_index ) {
+    Sample *sample = args->batch->samples[sample_index];
+    model_logits( args->model, sample->image, shard->logits );
+    model_test_score( args->model, shard, sample->label );
+  }
+}
+
+/* multi-layer models: whole blocks of samples go through the GEMM forward
+   pass, so every weight is reused across the block */
+static void
+model_test_blocks ( size_t begin, size_t end, void *ctx )
+{
+  EvalArgs *args = ctx;
+  Model *model = args->model;
+  const size_t worker = threadpool_worker_index();
+  EvalShard *shard = &args->shards[ worker ];
+  ModelWorkspace *workspace = args->workspaces[ worker ];
+  const size_t num_classes = model->num_classes;
+
+  for ( size_t block = begin; block < end; ++block ) {
+    const size_t first = block * MODEL_TEST_BLOCK;
+    const size_t rows = args->batch->num_samples - first < MODEL_TEST_BLOCK ?
+                        args->batch->num_samples - first : MODEL_TEST_BLOCK;
+    Tensor2D *logits = model_forward( model, workspace,
+                                      args->batch->images + first * model->image_size, rows );
+
+    for ( size_t r = 0; r < rows; ++r ) {
+      for ( size_t c = 0; c < num_classes; ++c )
+        shard->logits[c] = logits->data[ r * num_classes + c ];
+      model_test_score( model, shard, args->batch->samples[ first + r ]->label );
+    }
+  }
+}
+
+TestResult
 model_test ( Model *model, Dataset *dataset )
 {
   printf( "Beginning testing..\n" );
-  
-  int correct = 0;
-  double total_loss = 0.0;
+
+  const size_t num_classes = model->num_classes;
+  const size_t num_shards = threadpool_num_threads();
+  EvalShard *shards = calloc( num_shards, sizeof(EvalShard) );
+  for ( size_t i = 0; i < num_shards; ++i ) {
+    shards[i].confusion_matrix = calloc( num_classes * num_classes, sizeof(size_t) );
+    shards[i].logits = calloc( num_classes, sizeof(float) );
+    shards[i].scores = calloc( num_classes, sizeof(float) );
+  }
+
+  ModelWorkspace **workspaces = NULL;
+  if ( model->num_layers > 1 ) {
+    workspaces = calloc( num_shards, sizeof(ModelWorkspace *) );
+    for ( size_t i = 0; i < num_shards; ++i )
+      workspaces[i] = model_workspace_new( model, MODEL_TEST_BLOCK );
+  }
+
   size_t total_samples = 0;
-  float *confusion_matrix = calloc ( model->num_classes * model->num_classes, sizeof(float) );
-  
   for ( size_t batch_index = 0; batch_index < dataset->test_batches_len; ++batch_index ) {
-    printf( "Reading batch %zu/%zu..\n", batch_index + 1, dataset->test_batches_len );
     Batch *batch = dataset->test_batches[ batch_index ];
     total_samples += batch->num_samples;
-    
-    for ( size_t sample_index = 0; sample_index < batch->num_samples; ++sample_index ) {
-      /* generate prediction */
-      Sample *sample = batch->samples[sample_index];
-      Prediction *pred = model_predict( model, sample );
-      
-      total_loss += -log( pred->scores[ sample->label ] + 1e-9 );
-      if ( pred->most_likely == sample->label )
-        ++correct;
-
-      confusion_matrix[ sample->label * model->num_classes + pred->most_likely ]++;
-
-      prediction_destroy( &pred );
-    }
+
+    EvalArgs args = { .model = model, .batch = batch, .shards = shards,
+                      .workspaces = workspaces };
+    if ( workspaces )
+      parallel_for( 0, ( batch->num_samples + MODEL_TEST_BLOCK - 1 ) / MODEL_TEST_BLOCK, 1,
+                    model_test_blocks, &args );
+    else
+      parallel_for( 0, batch->num_samples,
+                    parallel_grain( num_classes * model->image_size ),
+                    model_test_samples, &args );
   }
 
-  float accuracy = 100.0 * correct / total_samples;
-  float avg_loss = total_loss / total_samples;
+  /* merge the shards into the first one */
+  EvalShard *merged = &shards[0];
+  for ( size_t i = 1; i < num_shards; ++i ) {
+    merged->correct       += shards[i].correct;
+    merged->top_k_correct += shards[i].top_k_correct;
+    merged->total_loss    += shards[i].total_loss;
+    for ( size_t j = 0; j < num_classes * num_classes; ++j )
+      merged->confusion_matrix[j] += shards[i].confusion_matrix[j];
+  }
 
-  
-  printf("Test Accuracy: %.2f%%\n", accuracy);
-  printf("Average Loss: %.4f\n", avg_loss);
+  TestResult result = { .samples = total_samples };
+  if ( total_samples > 0 ) {
+    result.accuracy       = (double) merged->correct / total_samples;
+    result.top_k_accuracy = (double) merged->top_k_correct / total_samples;
+    result.avg_loss       = merged->total_loss / total_samples;
+  }
+
+  printf("Test Accuracy: %.2f%%\n", 100.0 * result.accuracy);
+  printf("Top-%d Accuracy: %.2f%%\n", MODEL_TEST_TOP_K, 100.0 * result.top_k_accuracy);
+  printf("Average Loss: %.4f\n", result.avg_loss);
+
+  /* the monitor draws it as a heatmap with the class names */
+  if ( model->monitor )
+    monitor_publish_confusion( model->monitor, merged->confusion_matrix, "test", true );
 
-  /* TODO: make this graphical so that the actual
-           heatmap is displayed with the class names */
   printf("\nConfusion Matrix:\n");
-  for ( size_t i = 0; i < model->num_classes; i++ ) {
-    for ( size_t j = 0; j < model->num_classes; j++ )
-      printf( "%3.0f ", confusion_matrix[i * model->num_classes + j] );
+  for ( size_t i = 0; i < num_classes; i++ ) {
+    for ( size_t j = 0; j < num_classes; j++ )
+      printf( "%5zu ", merged->confusion_matrix[i * num_classes + j] );
     printf("\n");
   }
-  
+
+  /* rows are the true class, columns the guess */
+  printf("\n%12s %9s %9s\n", "class", "precision", "recall");
+  for ( size_t c = 0; c < num_classes; ++c ) {
+    size_t true_positive = merged->confusion_matrix[ c * num_classes + c ];
+    size_t guessed = 0, actual = 0;
+    for ( size_t j = 0; j < num_classes; ++j ) {
+      guessed += merged->confusion_matrix[ j * num_classes + c ];
+      actual  += merged->confusion_matrix[ c * num_classes + j ];
+    }
+
+    const char *name = dataset->label_map ? dataset->label_map[c] : "?";
+    printf( "%12s %9.3f %9.3f\n", name,
+            guessed ? (double) true_positive / guessed : 0.0,
+            actual  ? (double) true_positive / actual  : 0.0 );
+  }
+
+  for ( size_t i = 0; i < num_shards; ++i ) {
+    free( shards[i].confusion_matrix );
+    free( shards[i].logits );
+    free( shards[i].scores );
+    if ( workspaces )
+      model_workspace_destroy( &workspaces[i] );
+  }
+  free( shards );
+  free( workspaces );
+
+  return result;
+}
+
+/* mean negative log likelihood of the labels under softmax( logits / T ) */
+static double
+model_temperature_nll ( const float *logits, const size_t *labels, const size_t samples,
+                        const size_t num_classes, const double temperature )
+{
+  double total = 0.0;
+  for ( size_t i = 0; i < samples; ++i ) {
+    const float *z = logits + i * num_classes;
+    float max = z[0];
+    for ( size_t c = 1; c < num_classes; ++c )
+      if ( z[c] > max )
+        max = z[c];
+
+    double sum = 0.0;
+    for ( size_t c = 0; c < num_classes; ++c )
+      sum += exp( ( z[c] - max ) / temperature );
+    total += log( sum ) - ( z[ labels[i] ] - max ) / temperature;
+  }
+
+  return total / samples;
+}
+
+/* search bounds for the temperature and golden section steps. the nll is
+   convex in 1 / T, so the search runs over that */
+#define MODEL_TEMPERATURE_MIN   0.05
+#define MODEL_TEMPERATURE_MAX   20.0
+#define MODEL_TEMPERATURE_STEPS 60
+
+float
+model_fit_temperature ( Model *model, double *images, const size_t *labels,
+                        const size_t samples )
+{
+  const size_t num_classes = model->num_classes;
+  if ( samples == 0 )
+    return 1.0f;
+
+  /* the logits don't depend on T, score everything once */
+  float *logits = malloc( samples * num_classes * sizeof(float) );
+  ModelWorkspace *workspace = model_workspace_new( model, MODEL_TEST_BLOCK );
+
+  for ( size_t first = 0; first < samples; first += MODEL_TEST_BLOCK ) {
+    const size_t rows = samples - first < MODEL_TEST_BLOCK ? samples - first : MODEL_TEST_BLOCK;
+    model_logits_batch( model, workspace, images + first * model->image_size, rows,
+                        logits + first * num_classes );
+  }
+
+  const double ratio = ( sqrt( 5.0 ) - 1.0 ) / 2.0;
+  double lo = 1.0 / MODEL_TEMPERATURE_MAX, hi = 1.0 / MODEL_TEMPERATURE_MIN;
+  double a = hi - ratio * ( hi - lo ), b = lo + ratio * ( hi - lo );
+  double fa = model_temperature_nll( logits, labels, samples, num_classes, 1.0 / a );
+  double fb = model_temperature_nll( logits, labels, samples, num_classes, 1.0 / b );
+
+  for ( int step = 0; step < MODEL_TEMPERATURE_STEPS; ++step ) {
+    if ( fa < fb ) {
+      hi = b;
+      b = a;
+      fb = fa;
+      a = hi - ratio * ( hi - lo );
+      fa = model_temperature_nll( logits, labels, samples, num_classes, 1.0 / a );
+    } else {
+      lo = a;
+      a = b;
+      fa = fb;
+      b = lo + ratio * ( hi - lo );
+      fb = model_temperature_nll( logits, labels, samples, num_classes, 1.0 / b );
+    }
+  }
+
+  const double temperature = 2.0 / ( lo + hi );
+  printf( "Temperature %.3f: nll %.4f -> %.4f over %zu calibration samples\n", temperature,
+          model_temperature_nll( logits, labels, samples, num_classes, 1.0 ),
+          model_temperature_nll( logits, labels, samples, num_classes, temperature ), samples );
+
+  model_workspace_destroy( &workspace );
+  free( logits );
+
+  return temperature;
 }
 
 /* https://en.wikipedia.org/wiki/Softmax_function#Reinforcement_learning */
@@ -182,6 +810,126 @@ softmax (float *input, float *output, size_t len)
     output[i] /= sum;
 }
 
+/* one pass over the image feeds every class accumulator of a panel from
+   contiguous memory */
+static void
+model_logits_packed ( Model *model, const double *image, float *logits )
+{
+  const size_t image_size = model->image_size;
+
+  for ( size_t panel = 0; panel < model->num_panels; ++panel ) {
+    const float *w = model->packed_weights + panel * image_size * MODEL_PACK_PANEL;
+    float acc[ MODEL_PACK_PANEL ] = { 0 };
+
+    for ( size_t k = 0; k < image_size; ++k ) {
+      const float x = (float) image[k];
+      const float *wk = w + k * MODEL_PACK_PANEL;
+      for ( size_t c = 0; c < MODEL_PACK_PANEL; ++c )
+        acc[c] += wk[c] * x;
+    }
+
+    for ( size_t c = 0; c < MODEL_PACK_PANEL; ++c ) {
+      size_t class_index = panel * MODEL_PACK_PANEL + c;
+      if ( class_index < model->num_classes )
+        logits[ class_index ] = acc[c] + (float) model->biases[ class_index ];
+    }
+  }
+}
+
+void
+model_logits ( Model *model, const double *image, float *logits )
+{
+  if ( model->packed_valid ) {
+    model_logits_packed( model, image, logits );
+    return;
+  }
+
+  if ( model->num_layers > 1 ) {
+    /* one sample at a time, alternating between two activation vectors */
+    const double *below = image;
+
+    for ( size_t l = 0; l < model->num_layers; ++l ) {
+      const ModelLayer *layer = &model->layers[l];
+      const bool hidden = l + 1 < model->num_layers;
+      double *out = model->logits_scratch + ( l & 1 ) * model->max_width;
+
+      for ( size_t o = 0; o < layer->outputs; ++o ) {
+        const double *w = layer->weights + o * layer->inputs;
+        double sum = layer->biases[o];
+        for ( size_t k = 0; k < layer->inputs; ++k )
+          sum += w[k] * below[k];
+        out[o] = hidden && sum < 0.0 ? 0.0 : sum;
+      }
+      below = out;
+    }
+
+    for ( size_t c = 0; c < model->num_classes; ++c )
+      logits[c] = below[c];
+    return;
+  }
+
+  for (size_t ci = 0; ci < model->num_classes; ci++) {
+    double sum = model->biases[ci];
+    for (size_t k = 0; k < model->image_size; k++)
+      sum += model->weights[ci * model->image_size + k] * image[k];
+    logits[ci] = sum;
+  }
+}
+
+/* images per pass of the packed batch kernel, each panel row of weights is
+   loaded once for all of them */
+#define MODEL_PACK_ROWS 8
+
+/* the same sums as model_logits_packed, in the same order, so a batch
+   scores exactly like its images one at a time */
+static void
+model_logits_packed_rows ( Model *model, const double *images, const size_t rows,
+                           float *logits )
+{
+  const size_t image_size = model->image_size, num_classes = model->num_classes;
+
+  for ( size_t first = 0; first < rows; first += MODEL_PACK_ROWS ) {
+    const size_t count = rows - first < MODEL_PACK_ROWS ? rows - first : MODEL_PACK_ROWS;
+    const double *x = images + first * image_size;
+
+    for ( size_t panel = 0; panel < model->num_panels; ++panel ) {
+      const float *w = model->packed_weights + panel * image_size * MODEL_PACK_PANEL;
+      float acc[ MODEL_PACK_ROWS ][ MODEL_PACK_PANEL ] = { { 0 } };
+
+      for ( size_t k = 0; k < image_size; ++k ) {
+        const float *wk = w + k * MODEL_PACK_PANEL;
+        for ( size_t r = 0; r < count; ++r ) {
+          const float xr = (float) x[ r * image_size + k ];
+          for ( size_t c = 0; c < MODEL_PACK_PANEL; ++c )
+            acc[r][c] += wk[c] * xr;
+        }
+      }
+
+      for ( size_t r = 0; r < count; ++r )
+        for ( size_t c = 0; c < MODEL_PACK_PANEL; ++c ) {
+          size_t class_index = panel * MODEL_PACK_PANEL + c;
+          if ( class_index < num_classes )
+            logits[ ( first + r ) * num_classes + class_index ] =
+              acc[r][c] + (float) model->biases[ class_index ];
+        }
+    }
+  }
+}
+
+void
+model_logits_batch ( Model *model, ModelWorkspace *workspace, double *images,
+                     const size_t rows, float *logits )
+{
+  if ( model->packed_valid ) {
+    model_logits_packed_rows( model, images, rows, logits );
+    return;
+  }
+
+  const Tensor2D *out = model_forward( model, workspace, images, rows );
+  for ( size_t i = 0; i < rows * model->num_classes; ++i )
+    logits[i] = out->data[i];
+}
+
 Prediction *
 model_predict ( Model *model, Sample *sample )
 {
@@ -194,11 +942,7 @@ model_predict ( Model *model, Sample *sample )
   pred->num_classes = model->num_classes;
     
   /* generate raw predictions (convert to a probability distribution) */
-  for (size_t ci = 0; ci < model->num_classes; ci++) {
-    scores_raw[ci] = model->biases[ci];
-    for (size_t k = 0; k < sample->image_size; k++)
-      scores_raw[ci] += model->weights[ci * model->image_size + k] * sample->image[k];
-  }
+  model_logits( model, sample->image, scores_raw );
 
   /* normalize via softmax */
   softmax(scores_raw, pred->scores, model->num_classes);
@@ -226,7 +970,7 @@ model_predict ( Model *model, Sample *sample )
 
     float *biases = calloc( model->num_classes, sizeof(float) );
     for (size_t i = 0; i < model->num_classes; ++i)
-      biases[i] = (float) model->biases[i] * 1000;
+      biases[i] = (float) model->layers[ model->num_layers - 1 ].biases[i] * 1000;
     
     print_array( biases, model->num_classes );
     free(biases);
@@ -254,25 +998,84 @@ prediction_destroy ( Prediction **pred )
   }
 }
 
+/* the original format: image_size, num_classes and the learning rate,
+   then the weights and biases of a linear model */
+static Model *
+model_read_legacy ( FILE *f, const char *filepath )
+{
+  /* metadata */
+  size_t image_size = 0, num_classes = 0;
+  float learning_rate = 0;
+  if ( fread(&image_size,    sizeof(size_t), 1, f) != 1 ||
+       fread(&num_classes,   sizeof(size_t), 1, f) != 1 ||
+       fread(&learning_rate, sizeof(float),  1, f) != 1 ) {
+    fprintf(stderr, "model file '%s' has a truncated header\n", filepath);
+    return NULL;
+  }
+
+  return model_new( image_size, num_classes, learning_rate );
+}
+
+/* magic, version, layer count, the width of the input and every layer, the
+   learning rate, then the parameter block */
+static Model *
+model_read_layers ( FILE *f, const char *filepath )
+{
+  uint32_t version = 0, num_layers = 0;
+  uint64_t widths[ MODEL_MAX_LAYERS + 1 ];
+  float learning_rate = 0;
+
+  if ( fread(&version,    sizeof(uint32_t), 1, f) != 1 ||
+       fread(&num_layers, sizeof(uint32_t), 1, f) != 1 ) {
+    fprintf(stderr, "model file '%s' has a truncated header\n", filepath);
+    return NULL;
+  }
+  if ( version != MODEL_FILE_VERSION || num_layers == 0 || num_layers > MODEL_MAX_LAYERS ) {
+    fprintf(stderr, "model file '%s' is version %u with %u layers, expected version %d\n",
+            filepath, version, num_layers, MODEL_FILE_VERSION);
+    return NULL;
+  }
+  if ( fread(widths, sizeof(uint64_t), num_layers + 1, f) != num_layers + 1 ||
+       fread(&learning_rate, sizeof(float), 1, f) != 1 ) {
+    fprintf(stderr, "model file '%s' has a truncated header\n", filepath);
+    return NULL;
+  }
+
+  size_t hidden[ MODEL_MAX_LAYERS ];
+  for ( size_t l = 0; l + 1 < num_layers; ++l )
+    hidden[l] = widths[ l + 1 ];
+
+  return model_new_mlp( widths[0], hidden, num_layers - 1, widths[ num_layers ],
+                        learning_rate );
+}
+
 Model *
 model_load_from_file ( const char *filepath )
 {
-  Model *model = malloc( sizeof(Model) );
-  
   FILE* f = fopen(filepath, "rb");
   if (!f) {
     perror("Failed to load model");
     return NULL;
   }
 
-  /* metadata */
-  fread(&model->image_size,    sizeof(size_t), 1, f);
-  fread(&model->num_classes,   sizeof(size_t), 1, f);
-  fread(&model->learning_rate, sizeof(float),  1, f);
+  char magic[8];
+  Model *model;
+  if ( fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+       memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) == 0 )
+    model = model_read_layers( f, filepath );
+  else {
+    rewind( f );
+    model = model_read_legacy( f, filepath );
+  }
 
-  /* data */
-  fread(model->weights,        sizeof(double), model->num_classes * model->image_size, f);
-  fread(model->biases,         sizeof(double), model->num_classes, f);
+  /* data, laid out like params in both formats */
+  if ( model ) {
+    if ( fread(model->params, sizeof(double), model->num_params, f) != model->num_params ) {
+      fprintf(stderr, "model file '%s' has truncated weights\n", filepath);
+      model_destroy( &model );
+    } else
+      model_pack( model );
+  }
   
   fclose(f);
 
@@ -289,13 +1092,19 @@ model_save_to_file ( Model *model, const char *filepath )
   }
   
   /* metadata */
-  fwrite(&model->image_size,    sizeof(size_t), 1, f);
-  fwrite(&model->num_classes,   sizeof(size_t), 1, f);
-  fwrite(&model->learning_rate, sizeof(float),  1, f);
+  const uint32_t version = MODEL_FILE_VERSION, num_layers = model->num_layers;
+  uint64_t widths[ MODEL_MAX_LAYERS + 1 ] = { model->image_size };
+  for ( size_t l = 0; l < model->num_layers; ++l )
+    widths[ l + 1 ] = model->layers[l].outputs;
+
+  fwrite(MODEL_FILE_MAGIC,      1,                8,              f);
+  fwrite(&version,              sizeof(uint32_t), 1,              f);
+  fwrite(&num_layers,           sizeof(uint32_t), 1,              f);
+  fwrite(widths,                sizeof(uint64_t), num_layers + 1, f);
+  fwrite(&model->learning_rate, sizeof(float),    1,              f);
 
   /* data */
-  fwrite(model->weights,        sizeof(double), model->num_classes * model->image_size, f);
-  fwrite(model->biases,         sizeof(double), model->num_classes, f);
+  fwrite(model->params,         sizeof(double), model->num_params, f);
   
   fclose(f);
 }
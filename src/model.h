@@ -3,7 +3,13 @@
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "augment.h"
+#include "checkpoint.h"
 #include "dataset.h"
+#include "monitor.h"
+#include "optimizer.h"
+#include "tensor.h"
 
 typedef struct {
   float *scores;
@@ -15,28 +21,164 @@ typedef struct {
   bool failure;
 } Prediction;
 
+/* classes per panel of the packed inference layout (one or two SIMD
+   registers of floats) */
+#define MODEL_PACK_PANEL 16
+
+/* arithmetic of inference (training is always double). float scores a
+   linear model through the packed layout, double skips it and scores with
+   the training weights. multi-layer models always run in double */
+typedef enum {
+  MODEL_PRECISION_FLOAT,
+  MODEL_PRECISION_DOUBLE
+} ModelPrecision;
+
+/* hidden layers plus the output layer */
+#define MODEL_MAX_LAYERS 8
+
+/* model files start with this, files without it are the original headerless
+   linear format and are still read */
+#define MODEL_FILE_MAGIC   "CMLMODEL"
+#define MODEL_FILE_VERSION 1
+
+/* one fully connected layer, a slice of the model's parameter block */
+typedef struct {
+  double *weights;       /* outputs x inputs */
+  double *biases;
+  size_t inputs, outputs;
+  size_t offset;         /* of weights within params, biases follow them */
+} ModelLayer;
+
 typedef struct {
+  /* every layer's weights then biases, end to end in one block so the
+     optimizer and checkpoints see a single parameter array */
+  double *params;
+  size_t num_params;
+
+  /* ReLU hidden layers followed by the softmax output layer. a plain
+     softmax regression is just the output layer */
+  ModelLayer layers[ MODEL_MAX_LAYERS ];
+  size_t num_layers, max_width;
+
+  /* the two activation vectors model_logits alternates between for a
+     multi-layer model, 2 x max_width (NULL for a linear one) */
+  double *logits_scratch;
+
+  /* the input layer (the only one of a linear model) */
   double *weights, *biases;
   size_t image_size, num_classes;
   float learning_rate;
 
+  /* inference copy of a linear model's weights, pixel-major within panels
+     of MODEL_PACK_PANEL classes: packed[(panel * image_size + k) * PANEL + c].
+     rebuilt by model_pack, training keeps using the class-major weights.
+     unused by multi-layer models */
+  float *packed_weights;
+  size_t num_panels;
+  bool packed_valid;
+  ModelPrecision precision;
+
+  /* training state, weights first then biases. created on the first
+     model_train as plain SGD at learning_rate unless model_set_optimizer
+     picked something else */
+  Optimizer *optimizer;
+
+  /* mini-batching: samples per optimizer step and loader threads staging
+     the shuffled batches. the seed keys every random stream (weight
+     initialization, shuffling, augmentation), so a seed gives the same run
+     whatever the number of threads */
+  size_t batch_size, loader_threads;
+  uint64_t seed;
+
+  /* training-time augmentation (borrowed, NULL for none). a normalizing
+     config is folded into the weights after training so inference takes
+     raw pixels, and unfolded again if training resumes */
+  const AugmentConfig *augment;
+  bool normalization_folded;
+
+  /* live dashboard (borrowed, NULL for none). training reports every step
+     and the running confusion matrix to it, model_test the final one */
+  Monitor *monitor;
+
+  /* periodic snapshots (borrowed, NULL for none). with resume set,
+     model_train carries on from the latest one instead of epoch 0, as long
+     as it is an unfinished run of the same optimizer, learning rate and seed */
+  Checkpointer *checkpointer;
+
   /* model metrics */
   size_t *guess_dist;
   size_t total_guesses;
 } Model;
 
+/* per layer activations for a block of rows, plus the two deltas the
+   backward pass alternates between. sized once for the largest block and
+   reused by every step */
+typedef struct {
+  Tensor2D *activations[ MODEL_MAX_LAYERS ];
+  Tensor2D *deltas[2];
+  size_t rows;
+} ModelWorkspace;
+
+/* summary of a model_test run (accuracies are fractions) */
+#define MODEL_TEST_TOP_K 3
+
+typedef struct {
+  double accuracy, top_k_accuracy, avg_loss;
+  size_t samples;
+} TestResult;
+
 Model *model_new ( const size_t image_size, const size_t num_classes, \
 		   float learning_rate );
+/* multi-layer perceptron with num_hidden ReLU layers of the given widths.
+   NULL if there are too many layers or one is empty */
+Model *model_new_mlp ( const size_t image_size, const size_t *hidden, const size_t num_hidden,
+                       const size_t num_classes, float learning_rate );
 
+/* redraws the initial weights from model->seed */
 void   model_reset   ( Model  *model );
+/* sets the seed and redraws the initial weights from it */
+void   model_set_seed ( Model *model, const uint64_t seed );
 void   model_destroy ( Model **model );
-void   model_train   ( Model  *model, Dataset *dataset, const size_t epochs );
-void   model_test    ( Model  *model, Dataset *dataset );
+/* trains up to epochs, returns the epochs a checkpoint had already done
+   (0 when the run started from scratch) */
+size_t model_train   ( Model  *model, Dataset *dataset, const size_t epochs );
+TestResult model_test ( Model  *model, Dataset *dataset );
+
+/* replaces the optimizer (and resets its state) */
+void   model_set_optimizer ( Model *model, const OptimizerConfig *config );
+
+/* refreshes the packed inference layout from the training weights. done
+   automatically after model_train and model_load_from_file, call it after
+   editing the weights by hand (or clear packed_valid) */
+void   model_pack    ( Model  *model );
+/* switches the inference precision and repacks (or drops) the packed layout */
+void   model_set_precision ( Model *model, const ModelPrecision precision );
 
 /* prediction */
 Prediction * model_predict      ( Model *model, Sample *sample );
+/* a multi-layer model scores through the model's own scratch, so calls on
+   the same one mustn't overlap (linear models can be scored concurrently) */
+void         model_logits       ( Model *model, const double *image, float *logits );
 void         prediction_destroy ( Prediction **pred );
 
+/* scratch for model_logits_batch, for blocks of up to rows images */
+ModelWorkspace *model_workspace_new     ( const Model *model, const size_t rows );
+void            model_workspace_destroy ( ModelWorkspace **workspace );
+/* logits of rows images (rows x num_classes) as one product per layer, so
+   every weight is loaded once for the whole block instead of once per
+   image. the packed layout is used when it's valid, the workspace isn't
+   touched then */
+void model_logits_batch ( Model *model, ModelWorkspace *workspace, double *images,
+                          const size_t rows, float *logits );
+
+/* softmax temperature that minimizes the negative log likelihood of
+   samples images (samples x image_size) with their labels, for calibrated
+   confidence scores. they should be a validation set kept out of both
+   training and testing, or the test metrics are biased by the fit. 1 if
+   there are no samples */
+float model_fit_temperature ( Model *model, double *images, const size_t *labels,
+                              const size_t samples );
+
 /* I/O */
 Model * model_load_from_file ( const char *filepath );
 void    model_save_to_file   ( Model *model, const char *filepath );
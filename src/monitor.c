@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "monitor.h"
+#include "plot.h"
+#include "util.h"
+
+MonitorConfig
+monitor_default_config ( void )
+{
+  return (MonitorConfig) {
+    .refresh_ms = 500,
+    .png_path   = NULL,
+    .width      = 1280,
+    .height     = 960
+  };
+}
+
+/* producer side */
+
+static void
+monitor_push ( Monitor *monitor, const MonitorEvent *event )
+{
+  const size_t head = monitor->head;
+  const size_t tail = __atomic_load_n( &monitor->tail, __ATOMIC_ACQUIRE );
+
+  /* never wait on the monitor, a full ring just loses the event */
+  if ( head - tail == MONITOR_RING_SIZE ) {
+    __atomic_fetch_add( &monitor->dropped, 1, __ATOMIC_RELAXED );
+    return;
+  }
+
+  monitor->ring[ head & ( MONITOR_RING_SIZE - 1 ) ] = *event;
+  __atomic_store_n( &monitor->head, head + 1, __ATOMIC_RELEASE );
+}
+
+void
+monitor_flush ( Monitor *monitor )
+{
+  if ( monitor->pending.samples == 0 )
+    return;
+
+  monitor->pending.time = now_seconds() - monitor->start;
+  monitor_push( monitor, &monitor->pending );
+  memset( &monitor->pending, 0, sizeof(MonitorEvent) );
+}
+
+void
+monitor_record ( Monitor *monitor, const size_t epoch, const size_t samples,
+                 const size_t correct, const double loss )
+{
+  if ( monitor->pending.samples && monitor->pending.epoch != epoch )
+    monitor_flush( monitor );
+
+  monitor->pending.epoch    = epoch;
+  monitor->pending.samples += samples;
+  monitor->pending.correct += correct;
+  monitor->pending.loss    += loss;
+
+  if ( monitor->pending.samples >= MONITOR_EVENT_SAMPLES )
+    monitor_flush( monitor );
+}
+
+void
+monitor_publish_confusion ( Monitor *monitor, const size_t *matrix,
+                            const char *title, const bool wait )
+{
+  if ( wait )
+    pthread_mutex_lock( &monitor->confusion_lock );
+  else if ( pthread_mutex_trylock( &monitor->confusion_lock ) != 0 )
+    return;
+
+  memcpy( monitor->confusion, matrix,
+          monitor->num_classes * monitor->num_classes * sizeof(size_t) );
+  snprintf( monitor->confusion_title, sizeof(monitor->confusion_title), "%s", title );
+  monitor->confusion_dirty = true;
+
+  pthread_mutex_unlock( &monitor->confusion_lock );
+}
+
+/* consumer side */
+
+static bool
+monitor_drain ( Monitor *monitor )
+{
+  const size_t tail = monitor->tail;
+  const size_t head = __atomic_load_n( &monitor->head, __ATOMIC_ACQUIRE );
+
+  if ( head == tail )
+    return false;
+
+  if ( monitor->history_len + ( head - tail ) > monitor->history_cap ) {
+    size_t cap = monitor->history_cap ? monitor->history_cap : MONITOR_RING_SIZE;
+    while ( cap < monitor->history_len + ( head - tail ) )
+      cap *= 2;
+    monitor->history = realloc( monitor->history, cap * sizeof(MonitorEvent) );
+    monitor->history_cap = cap;
+  }
+
+  for ( size_t i = tail; i != head; ++i )
+    monitor->history[ monitor->history_len++ ] = monitor->ring[ i & ( MONITOR_RING_SIZE - 1 ) ];
+
+  __atomic_store_n( &monitor->tail, head, __ATOMIC_RELEASE );
+  return true;
+}
+
+static void
+monitor_send_curve ( Monitor *monitor, const char *name, const double *x,
+                     const double *y, const size_t n, double *decimated )
+{
+  size_t len = plot_decimate_lttb( x, y, n, 2 * monitor->config.width, decimated );
+
+  gnuplot_cmd( monitor->gnuplot, "%s << EOD", name );
+  for ( size_t i = 0; i < len; ++i )
+    gnuplot_cmd( monitor->gnuplot, "%.9g %.9g", decimated[2 * i], decimated[2 * i + 1] );
+  gnuplot_cmd( monitor->gnuplot, "EOD" );
+}
+
+static void
+monitor_draw ( Monitor *monitor, const size_t *confusion, const char *confusion_title )
+{
+  gnuplot_ctrl *g = monitor->gnuplot;
+  const size_t n = monitor->history_len, num_classes = monitor->num_classes;
+
+  /* x is samples seen so far, every metric is per event */
+  double *x = malloc( n * sizeof(double) );
+  double *loss = malloc( n * sizeof(double) );
+  double *accuracy = malloc( n * sizeof(double) );
+  double *throughput = malloc( n * sizeof(double) );
+  double *decimated = malloc( 2 * ( n > 2 * monitor->config.width ? n : 2 * monitor->config.width ) *
+                              sizeof(double) );
+
+  double seen = 0, previous = 0;
+  for ( size_t i = 0; i < n; ++i ) {
+    const MonitorEvent *event = &monitor->history[i];
+    seen += event->samples;
+    x[i]          = seen;
+    loss[i]       = event->loss / event->samples;
+    accuracy[i]   = (double) event->correct / event->samples;
+    throughput[i] = event->time > previous ? event->samples / ( event->time - previous ) : 0;
+    previous = event->time;
+  }
+
+  gnuplot_cmd( g, "reset" );
+  if ( monitor->config.png_path ) {
+    char quoted[1024];
+    plot_quote( quoted, sizeof(quoted), monitor->config.png_path );
+    gnuplot_cmd( g, "set output '%s'", quoted );
+  }
+
+  if ( n > 0 ) {
+    monitor_send_curve( monitor, "$loss", x, loss, n, decimated );
+    monitor_send_curve( monitor, "$accuracy", x, accuracy, n, decimated );
+    monitor_send_curve( monitor, "$throughput", x, throughput, n, decimated );
+  }
+
+  if ( confusion ) {
+    /* rows normalized to recall so every class uses the same color scale */
+    gnuplot_cmd( g, "$confusion << EOD" );
+    char *line = malloc( num_classes * 16 + 1 );
+    for ( size_t r = 0; r < num_classes; ++r ) {
+      size_t total = 0, used = 0;
+      for ( size_t c = 0; c < num_classes; ++c )
+        total += confusion[r * num_classes + c];
+      for ( size_t c = 0; c < num_classes; ++c )
+        used += snprintf( line + used, 16, "%.4f ",
+                          total ? (double) confusion[r * num_classes + c] / total : 0.0 );
+      gnuplot_cmd( g, "%s", line );
+    }
+    free( line );
+    gnuplot_cmd( g, "EOD" );
+  }
+
+  gnuplot_cmd( g, "set multiplot layout 2,2 title 'epoch %zu, %zu samples, %zu events dropped'",
+               n ? monitor->history[n - 1].epoch + 1 : 0, (size_t) seen,
+               __atomic_load_n( &monitor->dropped, __ATOMIC_RELAXED ) );
+  gnuplot_cmd( g, "set xlabel 'samples'" );
+  gnuplot_cmd( g, "set grid" );
+
+  if ( n > 0 ) {
+    gnuplot_cmd( g, "set ylabel 'loss'" );
+    gnuplot_cmd( g, "plot $loss with lines notitle" );
+    gnuplot_cmd( g, "set ylabel 'accuracy'" );
+    gnuplot_cmd( g, "set yrange [0:1]" );
+    gnuplot_cmd( g, "plot $accuracy with lines notitle" );
+    gnuplot_cmd( g, "set autoscale y" );
+    gnuplot_cmd( g, "set ylabel 'samples/s'" );
+    gnuplot_cmd( g, "plot $throughput with lines notitle" );
+  }
+
+  if ( confusion ) {
+    char quoted[128];
+    plot_quote( quoted, sizeof(quoted), confusion_title );
+    gnuplot_cmd( g, "unset grid" );
+    gnuplot_cmd( g, "set title '%s confusion (rows: true class)'", quoted );
+    gnuplot_cmd( g, "set xlabel 'guess'" );
+    gnuplot_cmd( g, "set ylabel 'true'" );
+    gnuplot_cmd( g, "set xrange [-0.5:%zu.5]", num_classes - 1 );
+    gnuplot_cmd( g, "set yrange [%zu.5:-0.5]", num_classes - 1 );
+    gnuplot_cmd( g, "set cbrange [0:1]" );
+
+    /* names only fit when there are few classes */
+    if ( monitor->label_map && num_classes <= 20 ) {
+      char *tics = malloc( num_classes * 96 + 16 );
+      size_t used = 0;
+      for ( size_t c = 0; c < num_classes; ++c ) {
+        char name[64];
+        plot_quote( name, sizeof(name), monitor->label_map[c] );
+        used += snprintf( tics + used, 96, "%s'%s' %zu", c ? ", " : "(", name, c );
+      }
+      snprintf( tics + used, 16, ")" );
+      gnuplot_cmd( g, "set xtics %s rotate by 45 right", tics );
+      gnuplot_cmd( g, "set ytics %s", tics );
+      free( tics );
+    }
+
+    gnuplot_cmd( g, "plot $confusion matrix with image notitle" );
+  }
+
+  gnuplot_cmd( g, "unset multiplot" );
+  if ( monitor->config.png_path )
+    gnuplot_cmd( g, "unset output" );
+
+  free( x );
+  free( loss );
+  free( accuracy );
+  free( throughput );
+  free( decimated );
+}
+
+static void *
+monitor_thread ( void *arg )
+{
+  Monitor *monitor = arg;
+
+  /* only run when training leaves a core idle */
+  struct sched_param param = { .sched_priority = 0 };
+  if ( pthread_setschedparam( pthread_self(), SCHED_IDLE, &param ) != 0 )
+    fprintf( stderr, "monitor: couldn't drop to idle priority\n" );
+
+  monitor->gnuplot = gnuplot_init();
+  if ( !monitor->gnuplot )
+    fprintf( stderr, "monitor: gnuplot isn't available, nothing will be drawn\n" );
+  else if ( monitor->config.png_path ) {
+    char terminal[256];
+    plot_png_terminal( terminal, sizeof(terminal), monitor->config.width,
+                       monitor->config.height );
+    gnuplot_cmd( monitor->gnuplot, "%s", terminal );
+  }
+
+  const size_t cells = monitor->num_classes * monitor->num_classes;
+  size_t *confusion = malloc( cells * sizeof(size_t) );
+  char confusion_title[64] = "";
+  bool have_confusion = false;
+
+  for (;;) {
+    const bool last = __atomic_load_n( &monitor->shutdown, __ATOMIC_ACQUIRE );
+
+    bool changed = monitor_drain( monitor );
+
+    pthread_mutex_lock( &monitor->confusion_lock );
+    if ( monitor->confusion_dirty ) {
+      memcpy( confusion, monitor->confusion, cells * sizeof(size_t) );
+      memcpy( confusion_title, monitor->confusion_title, sizeof(confusion_title) );
+      monitor->confusion_dirty = false;
+      have_confusion = changed = true;
+    }
+    pthread_mutex_unlock( &monitor->confusion_lock );
+
+    if ( changed && monitor->gnuplot )
+      monitor_draw( monitor, have_confusion ? confusion : NULL, confusion_title );
+
+    if ( last )
+      break;
+
+    /* sleep in short slices so shutdown isn't held up by a long refresh */
+    for ( unsigned waited = 0; waited < monitor->config.refresh_ms; waited += 20 ) {
+      if ( __atomic_load_n( &monitor->shutdown, __ATOMIC_ACQUIRE ) )
+        break;
+      struct timespec slice = { .tv_sec = 0, .tv_nsec = 20 * 1000000L };
+      nanosleep( &slice, NULL );
+    }
+  }
+
+  free( confusion );
+  if ( monitor->gnuplot )
+    gnuplot_close( monitor->gnuplot );
+  monitor->gnuplot = NULL;
+
+  return NULL;
+}
+
+Monitor *
+monitor_new ( const MonitorConfig *config, char **label_map, const size_t num_classes )
+{
+  Monitor *new = calloc( 1, sizeof(Monitor) );
+  new->config      = *config;
+  new->label_map   = label_map;
+  new->num_classes = num_classes;
+  new->start       = now_seconds();
+  new->confusion   = calloc( num_classes * num_classes, sizeof(size_t) );
+
+  if ( new->config.refresh_ms == 0 )
+    new->config.refresh_ms = 500;
+  if ( new->config.width == 0 || new->config.height == 0 ) {
+    new->config.width  = 1280;
+    new->config.height = 960;
+  }
+
+  pthread_mutex_init( &new->confusion_lock, NULL );
+
+  if ( pthread_create( &new->thread, NULL, monitor_thread, new ) != 0 ) {
+    perror( "Failed to start monitor thread" );
+    pthread_mutex_destroy( &new->confusion_lock );
+    free( new->confusion );
+    free( new );
+    return NULL;
+  }
+  new->running = true;
+
+  return new;
+}
+
+void
+monitor_destroy ( Monitor **monitorptr )
+{
+  if ( monitorptr && *monitorptr ) {
+    Monitor *monitor = *monitorptr;
+
+    monitor_flush( monitor );
+    __atomic_store_n( &monitor->shutdown, true, __ATOMIC_RELEASE );
+    if ( monitor->running )
+      pthread_join( monitor->thread, NULL );
+
+    if ( monitor->dropped )
+      fprintf( stderr, "monitor: %zu events were dropped\n", monitor->dropped );
+
+    pthread_mutex_destroy( &monitor->confusion_lock );
+    free( monitor->confusion );
+    free( monitor->history );
+    free( monitor );
+    *monitorptr = NULL;
+  }
+}
@@ -0,0 +1,88 @@
+#ifndef MONITOR_HEADER
+#define MONITOR_HEADER
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "gnuplot_i.h"
+
+/* events in the ring, a power of two */
+#define MONITOR_RING_SIZE 1024
+
+/* the training thread folds steps together until this many samples have
+   gone by, so the event rate doesn't depend on the batch size */
+#define MONITOR_EVENT_SAMPLES 512
+
+/* mini-batches between live confusion matrix snapshots */
+#define MONITOR_CONFUSION_STEPS 64
+
+typedef struct {
+  double time;           /* seconds since the monitor started */
+  size_t epoch, samples, correct;
+  double loss;           /* summed over the samples */
+} MonitorEvent;
+
+typedef struct {
+  unsigned refresh_ms;
+  const char *png_path;  /* draw into this png instead of a window */
+  size_t width, height;
+} MonitorConfig;
+
+/* opt-in live training dashboard. the training thread only aggregates a few
+   counters and pushes an event into a single-producer single-consumer ring
+   (no locks, no waiting: a full ring drops the event). a separate thread at
+   idle priority drains the ring and redraws loss, accuracy and throughput
+   curves and a confusion heatmap through gnuplot_i every refresh_ms. */
+typedef struct {
+  MonitorConfig config;
+  char **label_map;      /* borrowed */
+  size_t num_classes;
+  double start;
+
+  /* ring: head is only written by the producer, tail by the consumer */
+  MonitorEvent ring[ MONITOR_RING_SIZE ];
+  size_t head;
+  char head_padding[64];
+  size_t tail;
+  char tail_padding[64];
+  size_t dropped;
+
+  /* producer side aggregation, touched only by the training thread */
+  MonitorEvent pending;
+
+  /* latest confusion matrix (rows are the true class) */
+  pthread_mutex_t confusion_lock;
+  size_t *confusion;
+  char confusion_title[64];
+  bool confusion_dirty;
+
+  /* consumer side history */
+  MonitorEvent *history;
+  size_t history_len, history_cap;
+  gnuplot_ctrl *gnuplot;
+
+  pthread_t thread;
+  bool running, shutdown;
+} Monitor;
+
+MonitorConfig monitor_default_config ( void );
+
+/* starts the monitor thread. NULL if it can't be started */
+Monitor *monitor_new     ( const MonitorConfig *config, char **label_map,
+                           const size_t num_classes );
+/* flushes, draws one last time and stops the thread */
+void     monitor_destroy ( Monitor **monitor );
+
+/* training thread side: samples seen in a step, how many were guessed
+   right, and their summed loss */
+void monitor_record ( Monitor *monitor, const size_t epoch, const size_t samples,
+                      const size_t correct, const double loss );
+/* pushes whatever has been aggregated so far (at the end of an epoch) */
+void monitor_flush  ( Monitor *monitor );
+
+/* copies a num_classes x num_classes confusion matrix for the heatmap. with
+   wait false it gives up instead of blocking if the monitor is drawing */
+void monitor_publish_confusion ( Monitor *monitor, const size_t *matrix,
+                                 const char *title, const bool wait );
+
+#endif
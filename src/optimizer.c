@@ -0,0 +1,165 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "optimizer.h"
+
+OptimizerConfig
+optimizer_default_config ( OptimizerType type, float learning_rate )
+{
+  return (OptimizerConfig) {
+    .type              = type,
+    .learning_rate     = learning_rate,
+    .momentum          = 0.9f,
+    .beta1             = 0.9f,
+    .beta2             = 0.999f,
+    .epsilon           = 1e-8f,
+    .weight_decay      = type == OPTIMIZER_ADAMW ? 1e-2f : 0.0f,
+    .schedule          = SCHEDULE_CONSTANT,
+    .step_size         = 1,
+    .total_epochs      = 1,
+    .gamma             = 1.0f,
+    .min_learning_rate = 0.0f
+  };
+}
+
+const char *
+optimizer_name ( OptimizerType type )
+{
+  switch ( type ) {
+  case OPTIMIZER_SGD:      return "sgd";
+  case OPTIMIZER_MOMENTUM: return "momentum";
+  case OPTIMIZER_NESTEROV: return "nesterov";
+  case OPTIMIZER_ADAM:     return "adam";
+  case OPTIMIZER_ADAMW:    return "adamw";
+  }
+  return "unknown";
+}
+
+Optimizer *
+optimizer_new ( const OptimizerConfig *config, size_t num_params )
+{
+  Optimizer *new = calloc( 1, sizeof(Optimizer) );
+  new->config        = *config;
+  new->num_params    = num_params;
+  new->learning_rate = config->learning_rate;
+
+  if ( config->type != OPTIMIZER_SGD )
+    new->velocity = calloc( num_params, sizeof(double) );
+  if ( config->type == OPTIMIZER_ADAM || config->type == OPTIMIZER_ADAMW )
+    new->second_moment = calloc( num_params, sizeof(double) );
+
+  return new;
+}
+
+void
+optimizer_destroy ( Optimizer **optimizer )
+{
+  if ( optimizer && *optimizer ) {
+    free( (*optimizer)->velocity );
+    free( (*optimizer)->second_moment );
+    free( *optimizer );
+    *optimizer = NULL;
+  }
+}
+
+void
+optimizer_begin_epoch ( Optimizer *optimizer, size_t epoch )
+{
+  const OptimizerConfig *c = &optimizer->config;
+  double lr = c->learning_rate;
+
+  switch ( c->schedule ) {
+  case SCHEDULE_CONSTANT:
+    break;
+  case SCHEDULE_STEP:
+    lr *= pow( c->gamma, (double) ( epoch / ( c->step_size ? c->step_size : 1 ) ) );
+    break;
+  case SCHEDULE_EXPONENTIAL:
+    lr *= pow( c->gamma, (double) epoch );
+    break;
+  case SCHEDULE_COSINE: {
+    double progress = c->total_epochs > 1 ? (double) epoch / ( c->total_epochs - 1 ) : 1.0;
+    if ( progress > 1.0 )
+      progress = 1.0;
+    lr = c->min_learning_rate +
+         0.5 * ( c->learning_rate - c->min_learning_rate ) * ( 1.0 + cos( M_PI * progress ) );
+    break;
+  }
+  }
+
+  optimizer->learning_rate = lr;
+}
+
+void
+optimizer_begin_step ( Optimizer *optimizer )
+{
+  ++optimizer->steps;
+
+  /* adam bias correction folded into a single step-size scale */
+  if ( optimizer->second_moment ) {
+    const OptimizerConfig *c = &optimizer->config;
+    double t = (double) optimizer->steps;
+    optimizer->step_size_scale = sqrt( 1.0 - pow( c->beta2, t ) ) / ( 1.0 - pow( c->beta1, t ) );
+  }
+}
+
+void
+optimizer_step ( Optimizer *optimizer, double *params, const double *grads,
+                 const size_t len, const size_t state_offset, const bool decay )
+{
+  if ( state_offset + len > optimizer->num_params ) {
+    fprintf( stderr, "optimizer step out of range: %zu + %zu > %zu params\n",
+             state_offset, len, optimizer->num_params );
+    return;
+  }
+
+  const OptimizerConfig *c = &optimizer->config;
+  const double lr = optimizer->learning_rate;
+  const double wd = decay ? c->weight_decay : 0.0;
+  const double mu = c->momentum;
+
+  double *restrict p = params;
+  const double *restrict g = grads;
+  double *restrict v = optimizer->velocity ? optimizer->velocity + state_offset : NULL;
+  double *restrict s = optimizer->second_moment ? optimizer->second_moment + state_offset : NULL;
+
+  /* one branch-free loop per optimizer so each vectorizes on its own */
+  switch ( c->type ) {
+  case OPTIMIZER_SGD:
+    for ( size_t i = 0; i < len; ++i )
+      p[i] -= lr * ( g[i] + wd * p[i] );
+    break;
+
+  case OPTIMIZER_MOMENTUM:
+    for ( size_t i = 0; i < len; ++i ) {
+      v[i] = mu * v[i] + g[i] + wd * p[i];
+      p[i] -= lr * v[i];
+    }
+    break;
+
+  case OPTIMIZER_NESTEROV:
+    for ( size_t i = 0; i < len; ++i ) {
+      const double gi = g[i] + wd * p[i];
+      v[i] = mu * v[i] + gi;
+      p[i] -= lr * ( gi + mu * v[i] );
+    }
+    break;
+
+  case OPTIMIZER_ADAM:
+  case OPTIMIZER_ADAMW: {
+    const double b1 = c->beta1, b2 = c->beta2, eps = c->epsilon;
+    const double step = lr * optimizer->step_size_scale;
+    /* adam folds decay into the gradient (L2), adamw applies it to the weights */
+    const double l2 = c->type == OPTIMIZER_ADAM ? wd : 0.0;
+    const double decoupled = c->type == OPTIMIZER_ADAMW ? lr * wd : 0.0;
+
+    for ( size_t i = 0; i < len; ++i ) {
+      const double gi = g[i] + l2 * p[i];
+      v[i] = b1 * v[i] + ( 1.0 - b1 ) * gi;
+      s[i] = b2 * s[i] + ( 1.0 - b2 ) * gi * gi;
+      p[i] -= step * v[i] / ( sqrt( s[i] ) + eps ) + decoupled * p[i];
+    }
+    break;
+  }
+  }
+}
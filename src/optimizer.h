@@ -0,0 +1,64 @@
+#ifndef OPTIMIZER_HEADER
+#define OPTIMIZER_HEADER
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum {
+  OPTIMIZER_SGD,
+  OPTIMIZER_MOMENTUM,
+  OPTIMIZER_NESTEROV,
+  OPTIMIZER_ADAM,
+  OPTIMIZER_ADAMW
+} OptimizerType;
+
+typedef enum {
+  SCHEDULE_CONSTANT,
+  SCHEDULE_STEP,         /* lr *= gamma every step_size epochs */
+  SCHEDULE_EXPONENTIAL,  /* lr *= gamma every epoch */
+  SCHEDULE_COSINE        /* cosine from lr down to min_learning_rate over total_epochs */
+} ScheduleType;
+
+typedef struct {
+  OptimizerType type;
+  float learning_rate;
+  float momentum;                /* momentum, nesterov */
+  float beta1, beta2, epsilon;   /* adam, adamw */
+  float weight_decay;            /* decoupled for adamw, L2 for everything else */
+
+  ScheduleType schedule;
+  size_t step_size, total_epochs;
+  float gamma, min_learning_rate;
+} OptimizerConfig;
+
+typedef struct {
+  OptimizerConfig config;
+  size_t num_params, steps;
+  double learning_rate;          /* after the schedule is applied */
+
+  /* state, one entry per parameter (NULL when the optimizer doesn't need it) */
+  double *velocity;              /* momentum buffer / adam first moment */
+  double *second_moment;
+
+  /* adam bias corrections for the current step */
+  double step_size_scale;
+} Optimizer;
+
+OptimizerConfig optimizer_default_config ( OptimizerType type, float learning_rate );
+Optimizer      *optimizer_new            ( const OptimizerConfig *config, size_t num_params );
+void            optimizer_destroy        ( Optimizer **optimizer );
+const char     *optimizer_name           ( OptimizerType type );
+
+/* applies the learning rate schedule for this (0-based) epoch */
+void optimizer_begin_epoch ( Optimizer *optimizer, size_t epoch );
+
+/* one optimizer iteration: call begin_step once, then step for each parameter
+   array. state_offset is where the array's state lives inside the optimizer
+   (the parameter arrays are laid end to end), decay says whether weight decay
+   applies (usually not for biases). each step is a single fused pass over the
+   parameters, gradients and state. */
+void optimizer_begin_step ( Optimizer *optimizer );
+void optimizer_step       ( Optimizer *optimizer, double *params, const double *grads,
+                            const size_t len, const size_t state_offset, const bool decay );
+
+#endif
@@ -0,0 +1,430 @@
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "plot.h"
+
+Plot *
+plot_open ( const char *png_path, const size_t width, const size_t height )
+{
+  if ( system( "command -v gnuplot > /dev/null 2>&1" ) != 0 ) {
+    fprintf( stderr, "gnuplot isn't installed (or isn't on PATH)\n" );
+    return NULL;
+  }
+
+  /* a gnuplot that dies mid-plot shouldn't take the process with it */
+  signal( SIGPIPE, SIG_IGN );
+
+  FILE *pipe = popen( png_path ? "gnuplot" : "gnuplot -persist", "w" );
+  if ( !pipe ) {
+    perror( "Failed to start gnuplot" );
+    return NULL;
+  }
+
+  Plot *new = calloc( 1, sizeof(Plot) );
+  new->pipe     = pipe;
+  new->headless = png_path != NULL;
+  new->width    = width ? width : 1280;
+  new->height   = height ? height : 720;
+
+  if ( new->headless ) {
+    char terminal[256];
+    plot_png_terminal( terminal, sizeof(terminal), new->width, new->height );
+    plot_cmd( new, "%s", terminal );
+    snprintf( new->output, sizeof(new->output), "%s", png_path );
+  }
+
+  return new;
+}
+
+static void
+plot_clear ( Plot *plot )
+{
+  for ( size_t i = 0; i < plot->num_series; ++i ) {
+    free( plot->series[i].xy );
+    free( plot->series[i].function );
+  }
+  memset( plot->series, 0, sizeof(plot->series) );
+  plot->num_series = 0;
+}
+
+void
+plot_close ( Plot **plotptr )
+{
+  if ( plotptr && *plotptr ) {
+    Plot *plot = *plotptr;
+    plot_clear( plot );
+
+    plot_cmd( plot, "quit" );
+    pclose( plot->pipe );
+
+    free( plot );
+    *plotptr = NULL;
+  }
+}
+
+void
+plot_cmd ( Plot *plot, const char *format, ... )
+{
+  va_list args;
+  va_start( args, format );
+  vfprintf( plot->pipe, format, args );
+  va_end( args );
+
+  fputc( '\n', plot->pipe );
+  fflush( plot->pipe );
+}
+
+/* gnuplot single-quoted strings only escape the quote, as '' */
+void
+plot_quote ( char *dst, const size_t len, const char *src )
+{
+  size_t j = 0;
+  for ( size_t i = 0; src && src[i] && j + 2 < len; ++i ) {
+    if ( src[i] == '\'' )
+      dst[j++] = '\'';
+    dst[j++] = src[i];
+  }
+  dst[j] = '\0';
+}
+
+void
+plot_png_terminal ( char *dst, const size_t len, const size_t width, const size_t height )
+{
+  snprintf( dst, len, "if (strstrt(GPVAL_TERMINALS, 'pngcairo') > 0) "
+                      "{ set terminal pngcairo size %zu,%zu } "
+                      "else { set terminal png size %zu,%zu }",
+            width, height, width, height );
+}
+
+void
+plot_set_labels ( Plot *plot, const char *xlabel, const char *ylabel )
+{
+  char quoted[512];
+  plot_quote( quoted, sizeof(quoted), xlabel );
+  plot_cmd( plot, "set xlabel '%s'", quoted );
+  plot_quote( quoted, sizeof(quoted), ylabel );
+  plot_cmd( plot, "set ylabel '%s'", quoted );
+}
+
+void
+plot_set_xrange ( Plot *plot, const double min, const double max )
+{
+  plot->xrange[0] = min;
+  plot->xrange[1] = max;
+  plot->has_xrange = true;
+  plot_cmd( plot, "set xrange [%.17g:%.17g]", min, max );
+}
+
+void
+plot_set_yrange ( Plot *plot, const double min, const double max )
+{
+  plot->yrange[0] = min;
+  plot->yrange[1] = max;
+  plot->has_yrange = true;
+  plot_cmd( plot, "set yrange [%.17g:%.17g]", min, max );
+}
+
+size_t
+plot_decimate_lttb ( const double *x, const double *y, const size_t n,
+                     const size_t target, double *out )
+{
+  if ( target >= n || target < 3 ) {
+    for ( size_t i = 0; i < n; ++i ) {
+      out[2 * i]     = x[i];
+      out[2 * i + 1] = y[i];
+    }
+    return n;
+  }
+
+  /* first and last points are kept, the rest is split into target - 2
+     buckets and each bucket keeps the point making the largest triangle with
+     the last kept point and the average of the next bucket */
+  const double every = (double) ( n - 2 ) / ( target - 2 );
+  size_t kept = 0, a = 0;
+
+  out[kept++] = x[0];
+  out[kept++] = y[0];
+
+  for ( size_t bucket = 0; bucket < target - 2; ++bucket ) {
+    size_t next_begin = (size_t) ( ( bucket + 1 ) * every ) + 1;
+    size_t next_end   = (size_t) ( ( bucket + 2 ) * every ) + 1;
+    if ( next_end > n )
+      next_end = n;
+
+    double avg_x = 0, avg_y = 0;
+    for ( size_t i = next_begin; i < next_end; ++i ) {
+      avg_x += x[i];
+      avg_y += y[i];
+    }
+    if ( next_end > next_begin ) {
+      avg_x /= next_end - next_begin;
+      avg_y /= next_end - next_begin;
+    } else {
+      avg_x = x[n - 1];
+      avg_y = y[n - 1];
+    }
+
+    size_t begin = (size_t) ( bucket * every ) + 1;
+    size_t end   = next_begin;
+
+    double best_area = -1;
+    size_t best = begin;
+    for ( size_t i = begin; i < end; ++i ) {
+      double area = fabs( ( x[a] - avg_x ) * ( y[i] - y[a] ) -
+                          ( x[a] - x[i] ) * ( avg_y - y[a] ) );
+      if ( area > best_area ) {
+        best_area = area;
+        best = i;
+      }
+    }
+
+    out[kept++] = x[best];
+    out[kept++] = y[best];
+    a = best;
+  }
+
+  out[kept++] = x[n - 1];
+  out[kept++] = y[n - 1];
+
+  return kept / 2;
+}
+
+size_t
+plot_decimate_minmax ( const double *x, const double *y, const size_t n,
+                       const size_t columns, double *out )
+{
+  if ( n == 0 )
+    return 0;
+
+  const double x0 = x[0], span = x[n - 1] - x[0];
+  const double scale = span > 0 ? columns / span : 0;
+  size_t kept = 0, column = 0, lo = 0, hi = 0;
+
+  for ( size_t i = 0; i <= n; ++i ) {
+    /* clamped so that a nan or a step back in x can't start more than
+       columns columns, which is what the output is sized for */
+    size_t c = column;
+    if ( i < n ) {
+      const double position = ( x[i] - x0 ) * scale;
+      if ( position >= columns )
+        c = columns - 1;
+      else if ( position > column )
+        c = (size_t) position;
+    }
+
+    /* flush the finished column, min and max in the order they occurred */
+    if ( i == n || ( i > 0 && c != column ) ) {
+      size_t first = lo < hi ? lo : hi, second = lo < hi ? hi : lo;
+      out[2 * kept]     = x[first];
+      out[2 * kept + 1] = y[first];
+      ++kept;
+      if ( second != first ) {
+        out[2 * kept]     = x[second];
+        out[2 * kept + 1] = y[second];
+        ++kept;
+      }
+      if ( i == n )
+        break;
+    }
+
+    if ( i == 0 || c != column ) {
+      column = c;
+      lo = hi = i;
+    } else {
+      if ( y[i] < y[lo] )
+        lo = i;
+      if ( y[i] > y[hi] )
+        hi = i;
+    }
+  }
+
+  return kept;
+}
+
+size_t
+plot_decimate_pixels ( const double *x, const double *y, const size_t n,
+                       const double *xrange, const double *yrange,
+                       const size_t width, const size_t height, double *out )
+{
+  const double x_scale = xrange[1] > xrange[0] ? ( width - 1 ) / ( xrange[1] - xrange[0] ) : 0;
+  const double y_scale = yrange[1] > yrange[0] ? ( height - 1 ) / ( yrange[1] - yrange[0] ) : 0;
+  uint8_t *taken = calloc( ( width * height + 7 ) / 8, 1 );
+  size_t kept = 0;
+
+  for ( size_t i = 0; i < n; ++i ) {
+    /* anything outside the ranges isn't drawn anyway */
+    if ( !( x[i] >= xrange[0] && x[i] <= xrange[1] &&
+            y[i] >= yrange[0] && y[i] <= yrange[1] ) )
+      continue;
+
+    size_t px = (size_t) ( ( x[i] - xrange[0] ) * x_scale + 0.5 );
+    size_t py = (size_t) ( ( y[i] - yrange[0] ) * y_scale + 0.5 );
+    size_t pixel = py * width + px;
+
+    if ( taken[pixel / 8] & ( 1u << ( pixel % 8 ) ) )
+      continue;
+    taken[pixel / 8] |= 1u << ( pixel % 8 );
+
+    out[2 * kept]     = x[i];
+    out[2 * kept + 1] = y[i];
+    ++kept;
+  }
+
+  free( taken );
+  return kept;
+}
+
+/* over the finite values only, the rest can't be drawn */
+static void
+plot_extent ( const double *v, const size_t n, double *range )
+{
+  range[0] = INFINITY;
+  range[1] = -INFINITY;
+  for ( size_t i = 0; i < n; ++i ) {
+    if ( !isfinite( v[i] ) )
+      continue;
+    if ( v[i] < range[0] )
+      range[0] = v[i];
+    if ( v[i] > range[1] )
+      range[1] = v[i];
+  }
+}
+
+static PlotSeries *
+plot_add_series ( Plot *plot, const char *style, const char *title )
+{
+  if ( plot->num_series == PLOT_MAX_SERIES ) {
+    fprintf( stderr, "a plot holds at most %d series\n", PLOT_MAX_SERIES );
+    return NULL;
+  }
+
+  PlotSeries *series = &plot->series[ plot->num_series++ ];
+  snprintf( series->style, sizeof(series->style), "%s", style ? style : "points" );
+  plot_quote( series->title, sizeof(series->title), title );
+  return series;
+}
+
+void
+plot_xy ( Plot *plot, const double *x, const double *y, const size_t n,
+          const char *style, const char *title )
+{
+  PlotSeries *series = plot_add_series( plot, style, title );
+  if ( !series )
+    return;
+
+  PlotDecimation decimation = plot->decimation;
+  if ( n <= 2 * plot->width )
+    decimation = PLOT_DECIMATE_NONE;
+
+  /* lttb and minmax walk x in order, anything else (or a nan or infinite
+     x) goes to pixels, auto or not */
+  if ( decimation == PLOT_DECIMATE_AUTO || decimation == PLOT_DECIMATE_LTTB ||
+       decimation == PLOT_DECIMATE_MINMAX ) {
+    bool sorted = true;
+    for ( size_t i = 0; sorted && i < n; ++i )
+      sorted = isfinite( x[i] ) && ( i == 0 || x[i - 1] <= x[i] );
+    if ( !sorted )
+      decimation = PLOT_DECIMATE_PIXELS;
+    else if ( decimation == PLOT_DECIMATE_AUTO )
+      decimation = PLOT_DECIMATE_LTTB;
+  }
+
+  /* every kernel keeps at most this many points */
+  size_t capacity = n;
+  if ( decimation == PLOT_DECIMATE_LTTB || decimation == PLOT_DECIMATE_MINMAX )
+    capacity = 2 * plot->width < n ? 2 * plot->width : n;
+  else if ( decimation == PLOT_DECIMATE_PIXELS && plot->width * plot->height < n )
+    capacity = plot->width * plot->height;
+
+  series->xy = malloc( 2 * capacity * sizeof(double) );
+
+  switch ( decimation ) {
+  case PLOT_DECIMATE_LTTB:
+    series->len = plot_decimate_lttb( x, y, n, 2 * plot->width, series->xy );
+    break;
+  case PLOT_DECIMATE_MINMAX:
+    series->len = plot_decimate_minmax( x, y, n, plot->width, series->xy );
+    break;
+  case PLOT_DECIMATE_PIXELS: {
+    double xrange[2], yrange[2];
+    if ( plot->has_xrange )
+      memcpy( xrange, plot->xrange, sizeof(xrange) );
+    else
+      plot_extent( x, n, xrange );
+    if ( plot->has_yrange )
+      memcpy( yrange, plot->yrange, sizeof(yrange) );
+    else
+      plot_extent( y, n, yrange );
+    series->len = plot_decimate_pixels( x, y, n, xrange, yrange,
+                                        plot->width, plot->height, series->xy );
+    break;
+  }
+  default:
+    for ( size_t i = 0; i < n; ++i ) {
+      series->xy[2 * i]     = x[i];
+      series->xy[2 * i + 1] = y[i];
+    }
+    series->len = n;
+  }
+}
+
+void
+plot_slope ( Plot *plot, const double slope, const double intercept, const char *title )
+{
+  PlotSeries *series = plot_add_series( plot, "lines", title );
+  if ( !series )
+    return;
+
+  char buffer[128];
+  snprintf( buffer, sizeof(buffer), "%.17g * x + %.17g", slope, intercept );
+  series->function = strdup( buffer );
+}
+
+void
+plot_render ( Plot *plot )
+{
+  if ( plot->num_series == 0 )
+    return;
+
+  /* every render rewrites the png, rather than appending a page to it */
+  if ( plot->headless ) {
+    char quoted[2048];
+    plot_quote( quoted, sizeof(quoted), plot->output );
+    plot_cmd( plot, "set output '%s'", quoted );
+  }
+
+  /* one plot command naming every series, then the data of each '-' in
+     order, as raw native doubles */
+  fprintf( plot->pipe, "plot " );
+  for ( size_t i = 0; i < plot->num_series; ++i ) {
+    const PlotSeries *series = &plot->series[i];
+    if ( i > 0 )
+      fprintf( plot->pipe, ", " );
+
+    if ( series->function )
+      fprintf( plot->pipe, "%s", series->function );
+    else if ( series->len == 0 )
+      fprintf( plot->pipe, "NaN" );
+    else
+      fprintf( plot->pipe, "'-' binary record=(%zu) format='%%float64%%float64' using 1:2",
+               series->len );
+    fprintf( plot->pipe, " with %s title '%s'", series->style, series->title );
+  }
+  fputc( '\n', plot->pipe );
+
+  for ( size_t i = 0; i < plot->num_series; ++i ) {
+    const PlotSeries *series = &plot->series[i];
+    if ( !series->function && series->len > 0 )
+      fwrite( series->xy, 2 * sizeof(double), series->len, plot->pipe );
+  }
+
+  /* closing the output is what finishes writing a png */
+  if ( plot->headless )
+    fprintf( plot->pipe, "unset output\n" );
+  fflush( plot->pipe );
+
+  plot_clear( plot );
+}
@@ -0,0 +1,80 @@
+#ifndef PLOT_HEADER
+#define PLOT_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define PLOT_MAX_SERIES 16
+
+typedef enum {
+  PLOT_DECIMATE_AUTO,    /* lttb for series sorted by x, pixels otherwise */
+  PLOT_DECIMATE_NONE,
+  PLOT_DECIMATE_LTTB,    /* largest triangle three buckets, pixels unless x is sorted */
+  PLOT_DECIMATE_MINMAX,  /* min and max of every pixel column, likewise */
+  PLOT_DECIMATE_PIXELS   /* first point landing on every pixel, any order */
+} PlotDecimation;
+
+typedef struct {
+  double *xy;            /* decimated points, x and y interleaved */
+  size_t len;
+  char style[32], title[256];
+  char *function;        /* a gnuplot expression plotted instead of data */
+} PlotSeries;
+
+/* plotting straight through a gnuplot pipe. series are decimated to the
+   output resolution when they're added and streamed inline as binary on
+   render, so no temp files are written and the cost of drawing doesn't grow
+   with the size of the data. headless plots go to a png instead of a window,
+   and interactive ones persist after the pipe is closed instead of blocking */
+typedef struct {
+  FILE *pipe;
+  bool headless;
+  char output[1024];     /* png path when headless */
+  size_t width, height;
+  PlotDecimation decimation;
+
+  double xrange[2], yrange[2];
+  bool has_xrange, has_yrange;
+
+  PlotSeries series[ PLOT_MAX_SERIES ];
+  size_t num_series;
+} Plot;
+
+/* png_path NULL opens a window. NULL if gnuplot can't be started */
+Plot *plot_open  ( const char *png_path, const size_t width, const size_t height );
+void  plot_close ( Plot **plot );
+
+/* helpers for anything else driving gnuplot. plot_quote escapes src for a
+   single-quoted gnuplot string, plot_png_terminal writes the command that
+   selects a png terminal of the given size, pngcairo where it's available */
+void plot_quote        ( char *dst, const size_t len, const char *src );
+void plot_png_terminal ( char *dst, const size_t len, const size_t width, const size_t height );
+
+/* raw gnuplot command, a newline is appended */
+void plot_cmd        ( Plot *plot, const char *format, ... );
+void plot_set_labels ( Plot *plot, const char *xlabel, const char *ylabel );
+void plot_set_xrange ( Plot *plot, const double min, const double max );
+void plot_set_yrange ( Plot *plot, const double min, const double max );
+
+/* queue a series for the next render. data is decimated and copied, so the
+   caller's arrays can go away straight after */
+void plot_xy    ( Plot *plot, const double *x, const double *y, const size_t n,
+                  const char *style, const char *title );
+void plot_slope ( Plot *plot, const double slope, const double intercept, const char *title );
+
+/* draws every queued series and clears the queue */
+void plot_render ( Plot *plot );
+
+/* decimation kernels, writing x, y pairs to out. they return the number of
+   points kept: at most min(n, target) for lttb, 2 x columns for minmax and
+   width x height for pixels */
+size_t plot_decimate_lttb   ( const double *x, const double *y, const size_t n,
+                              const size_t target, double *out );
+size_t plot_decimate_minmax ( const double *x, const double *y, const size_t n,
+                              const size_t columns, double *out );
+size_t plot_decimate_pixels ( const double *x, const double *y, const size_t n,
+                              const double *xrange, const double *yrange,
+                              const size_t width, const size_t height, double *out );
+
+#endif
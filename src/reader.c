@@ -0,0 +1,496 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "reader.h"
+
+#define READER_MAX_SEGMENTS 8
+
+/* records decoded per fread */
+#define READER_CHUNK 256
+
+/* every supported format is a run of fixed-size records, optionally with the
+   labels in a separate file, so one decoder serves them all. a segment is one
+   such file */
+typedef struct {
+  char   path[1024];
+  char   label_path[1024];    /* empty when the label is inside the record */
+  size_t num_samples;
+  size_t header_bytes;        /* bytes before the first record */
+  size_t record_bytes;
+  size_t image_at, label_at;  /* offsets inside a record */
+  size_t label_header_bytes;  /* bytes before the first label of label_path */
+} ReaderSegment;
+
+typedef struct {
+  char *root;
+  ReaderSegment segments[2][ READER_MAX_SEGMENTS ];
+  size_t num_segments[2], num_samples[2];
+  size_t image_size, num_classes;
+
+  const char *sources[ 4 * READER_MAX_SEGMENTS ];
+  size_t num_sources;
+} RecordReader;
+
+static size_t
+file_size ( const char *filepath )
+{
+  struct stat st;
+  return stat( filepath, &st ) == 0 ? (size_t) st.st_size : 0;
+}
+
+static RecordReader *
+record_reader_new ( const char *root )
+{
+  RecordReader *reader = calloc( 1, sizeof(RecordReader) );
+  reader->root = strdup( root );
+  return reader;
+}
+
+static ReaderSegment *
+record_reader_add ( RecordReader *reader, const DatasetSplit split, const char *filename )
+{
+  ReaderSegment *segment = &reader->segments[split][ reader->num_segments[split]++ ];
+  snprintf( segment->path, 1024, "%s/%s", reader->root, filename );
+  reader->sources[ reader->num_sources++ ] = segment->path;
+  return segment;
+}
+
+/* a file of records with the label inside each one (the CIFAR layout); the
+   sample count follows from the file size */
+static bool
+record_reader_add_records ( RecordReader *reader, const DatasetSplit split,
+                            const char *filename, const size_t label_at,
+                            const size_t image_at )
+{
+  ReaderSegment *segment = record_reader_add( reader, split, filename );
+  segment->record_bytes = image_at + reader->image_size;
+  segment->image_at     = image_at;
+  segment->label_at     = label_at;
+
+  size_t bytes = file_size( segment->path );
+  if ( bytes == 0 || bytes % segment->record_bytes != 0 ) {
+    fprintf( stderr, "'%s' is missing or not a whole number of %zu byte records\n",
+             segment->path, segment->record_bytes );
+    return false;
+  }
+
+  segment->num_samples = bytes / segment->record_bytes;
+  reader->num_samples[split] += segment->num_samples;
+  return true;
+}
+
+static void
+record_close ( void *handle )
+{
+  RecordReader *reader = handle;
+  free( reader->root );
+  free( reader );
+}
+
+static size_t
+record_count ( void *handle, DatasetSplit split )
+{
+  return ( (RecordReader *) handle )->num_samples[split];
+}
+
+static const char **
+record_sources ( void *handle, size_t *len )
+{
+  RecordReader *reader = handle;
+  *len = reader->num_sources;
+  return reader->sources;
+}
+
+/* samples [first, first + count) of one segment */
+static bool
+record_read_segment ( const RecordReader *reader, const ReaderSegment *segment,
+                      const size_t first, const size_t count,
+                      double *images, size_t *labels )
+{
+  const size_t image_size = reader->image_size;
+  bool ok = true;
+
+  FILE *f = fopen( segment->path, "rb" );
+  if ( !f ) {
+    perror( "Failed to open file!" );
+    return false;
+  }
+
+  uint8_t *chunk = malloc( READER_CHUNK * segment->record_bytes );
+  ok = fseek( f, segment->header_bytes + first * segment->record_bytes, SEEK_SET ) == 0;
+
+  for ( size_t done = 0; ok && done < count; ) {
+    size_t n = count - done < READER_CHUNK ? count - done : READER_CHUNK;
+    if ( fread( chunk, segment->record_bytes, n, f ) != n ) {
+      ok = false;
+      break;
+    }
+
+    for ( size_t k = 0; k < n; ++k ) {
+      const uint8_t *record = chunk + k * segment->record_bytes;
+      double *image = images + ( done + k ) * image_size;
+      for ( size_t i = 0; i < image_size; ++i )
+        image[i] = (double) record[ segment->image_at + i ] / 255.0;
+
+      if ( !segment->label_path[0] )
+        labels[done + k] = record[ segment->label_at ];
+    }
+    done += n;
+  }
+
+  free( chunk );
+  fclose( f );
+
+  if ( ok && segment->label_path[0] ) {
+    uint8_t *raw = malloc( count );
+    f = fopen( segment->label_path, "rb" );
+    ok = f &&
+         fseek( f, segment->label_header_bytes + first, SEEK_SET ) == 0 &&
+         fread( raw, 1, count, f ) == count;
+    if ( f )
+      fclose( f );
+
+    for ( size_t k = 0; ok && k < count; ++k )
+      labels[k] = raw[k];
+    free( raw );
+  }
+
+  for ( size_t k = 0; ok && k < count; ++k )
+    if ( labels[k] >= reader->num_classes ) {
+      fprintf( stderr, "'%s' has label %zu, expected fewer than %zu classes\n",
+               segment->path, labels[k], reader->num_classes );
+      ok = false;
+    }
+
+  if ( !ok )
+    fprintf( stderr, "unable to read samples %zu-%zu of '%s'\n",
+             first, first + count, segment->path );
+
+  return ok;
+}
+
+static bool
+record_read ( void *handle, DatasetSplit split, size_t first, size_t count,
+              double *images, size_t *labels )
+{
+  RecordReader *reader = handle;
+
+  if ( first + count > reader->num_samples[split] ) {
+    fprintf( stderr, "samples %zu-%zu are out of range (%zu)\n",
+             first, first + count, reader->num_samples[split] );
+    return false;
+  }
+
+  /* the range may straddle the split's files */
+  for ( size_t s = 0; count > 0 && s < reader->num_segments[split]; ++s ) {
+    const ReaderSegment *segment = &reader->segments[split][s];
+    if ( first >= segment->num_samples ) {
+      first -= segment->num_samples;
+      continue;
+    }
+
+    size_t n = segment->num_samples - first < count ? segment->num_samples - first : count;
+    if ( !record_read_segment( reader, segment, first, n, images, labels ) )
+      return false;
+
+    images += n * reader->image_size;
+    labels += n;
+    count  -= n;
+    first   = 0;
+  }
+
+  return true;
+}
+
+char **
+reader_load_label_names ( const char *filepath, const size_t num_classes )
+{
+  FILE *f = fopen( filepath, "r" );
+  if ( !f )
+    return NULL;
+
+  char **label_map = calloc( num_classes, sizeof(char *) );
+  char line[256];
+  size_t count = 0;
+
+  while ( count < num_classes && fgets(line, sizeof(line), f) ) {
+    line[ strcspn(line, "\r\n") ] = '\0';
+    if ( line[0] == '\0' )
+      continue;
+    label_map[count++] = strdup(line);
+  }
+
+  fclose(f);
+
+  /* fall back to the class index for anything the file didn't name */
+  for ( ; count < num_classes; ++count ) {
+    snprintf( line, sizeof(line), "class_%zu", count );
+    label_map[count] = strdup(line);
+  }
+
+  return label_map;
+}
+
+/* CIFAR-10: five training files and one test file of <label><3072 pixels> */
+
+static void *
+cifar10_open ( const char *root, size_t *image_size, size_t *num_classes )
+{
+  RecordReader *reader = record_reader_new( root );
+  reader->image_size  = 32 * 32 * 3;
+  reader->num_classes = 10;
+
+  const char *train_batches[] = {
+    "data_batch_1.bin",
+    "data_batch_2.bin",
+    "data_batch_3.bin",
+    "data_batch_4.bin",
+    "data_batch_5.bin",
+  };
+
+  bool ok = true;
+  for ( size_t i = 0; i < 5; ++i )
+    ok = record_reader_add_records( reader, DATASET_TRAIN, train_batches[i], 0, 1 ) && ok;
+  ok = record_reader_add_records( reader, DATASET_TEST, "test_batch.bin", 0, 1 ) && ok;
+
+  if ( !ok ) {
+    record_close( reader );
+    return NULL;
+  }
+
+  *image_size  = reader->image_size;
+  *num_classes = reader->num_classes;
+  return reader;
+}
+
+static char **
+cifar10_label_map ( void *handle )
+{
+  RecordReader *reader = handle;
+  char filename_buffer[1024];
+  snprintf( filename_buffer, 1024, "%s/%s", reader->root, "batches.meta.txt" );
+
+  char **label_map = reader_load_label_names( filename_buffer, reader->num_classes );
+  if ( label_map )
+    return label_map;
+
+  const char *names[] = {
+    "airplane",
+    "automobile",
+    "bird",
+    "cat",
+    "deer",
+    "dog",
+    "frog",
+    "horse",
+    "ship",
+    "truck"
+  };
+
+  label_map = malloc( sizeof(char *) * reader->num_classes );
+  for ( size_t i = 0; i < reader->num_classes; ++i )
+    label_map[i] = strdup( names[i] );
+  return label_map;
+}
+
+const DatasetReader dataset_reader_cifar10 = {
+  .name      = "cifar-10",
+  .open      = cifar10_open,
+  .count     = record_count,
+  .read      = record_read,
+  .label_map = cifar10_label_map,
+  .sources   = record_sources,
+  .close     = record_close
+};
+
+/* CIFAR-100: one training and one test file of <coarse><fine><3072 pixels>,
+   trained on the 100 fine labels */
+
+static void *
+cifar100_open ( const char *root, size_t *image_size, size_t *num_classes )
+{
+  RecordReader *reader = record_reader_new( root );
+  reader->image_size  = 32 * 32 * 3;
+  reader->num_classes = 100;
+
+  bool ok = record_reader_add_records( reader, DATASET_TRAIN, "train.bin", 1, 2 );
+  ok = record_reader_add_records( reader, DATASET_TEST, "test.bin", 1, 2 ) && ok;
+
+  if ( !ok ) {
+    record_close( reader );
+    return NULL;
+  }
+
+  *image_size  = reader->image_size;
+  *num_classes = reader->num_classes;
+  return reader;
+}
+
+static char **
+cifar100_label_map ( void *handle )
+{
+  RecordReader *reader = handle;
+  char filename_buffer[1024];
+  snprintf( filename_buffer, 1024, "%s/%s", reader->root, "fine_label_names.txt" );
+
+  char **label_map = reader_load_label_names( filename_buffer, reader->num_classes );
+  if ( label_map )
+    return label_map;
+
+  label_map = malloc( sizeof(char *) * reader->num_classes );
+  for ( size_t i = 0; i < reader->num_classes; ++i ) {
+    snprintf( filename_buffer, 1024, "class_%zu", i );
+    label_map[i] = strdup( filename_buffer );
+  }
+  return label_map;
+}
+
+const DatasetReader dataset_reader_cifar100 = {
+  .name      = "cifar-100",
+  .open      = cifar100_open,
+  .count     = record_count,
+  .read      = record_read,
+  .label_map = cifar100_label_map,
+  .sources   = record_sources,
+  .close     = record_close
+};
+
+/* IDX (the MNIST format): big-endian headers, images and labels in separate
+   files, one unsigned byte per pixel and per label */
+
+static bool
+idx_header ( const char *filepath, const uint8_t type, size_t *dims, size_t *ndims )
+{
+  FILE *f = fopen( filepath, "rb" );
+  if ( !f ) {
+    perror( "Failed to open IDX file" );
+    return false;
+  }
+
+  uint8_t magic[4], raw[4];
+  bool ok = fread( magic, 1, 4, f ) == 4 &&
+            magic[0] == 0 && magic[1] == 0 && magic[2] == type &&
+            magic[3] >= 1 && magic[3] <= 4;
+
+  *ndims = ok ? magic[3] : 0;
+  for ( size_t i = 0; ok && i < *ndims; ++i ) {
+    ok = fread( raw, 1, 4, f ) == 4;
+    dims[i] = (size_t) raw[0] << 24 | (size_t) raw[1] << 16 | (size_t) raw[2] << 8 | raw[3];
+  }
+  fclose( f );
+
+  if ( !ok )
+    fprintf( stderr, "'%s' is not an unsigned byte IDX file\n", filepath );
+  return ok;
+}
+
+static bool
+idx_add ( RecordReader *reader, const DatasetSplit split,
+          const char *images_filename, const char *labels_filename )
+{
+  ReaderSegment *segment = record_reader_add( reader, split, images_filename );
+  snprintf( segment->label_path, 1024, "%s/%s", reader->root, labels_filename );
+  reader->sources[ reader->num_sources++ ] = segment->label_path;
+
+  size_t dims[4], ndims, label_dims[4], label_ndims;
+  if ( !idx_header( segment->path, 0x08, dims, &ndims ) ||
+       !idx_header( segment->label_path, 0x08, label_dims, &label_ndims ) )
+    return false;
+
+  size_t image_size = 1;
+  for ( size_t i = 1; i < ndims; ++i )
+    image_size *= dims[i];
+
+  if ( label_ndims != 1 || label_dims[0] != dims[0] ||
+       ( reader->image_size && reader->image_size != image_size ) ) {
+    fprintf( stderr, "'%s' and '%s' don't describe the same samples\n",
+             segment->path, segment->label_path );
+    return false;
+  }
+
+  reader->image_size          = image_size;
+  segment->num_samples        = dims[0];
+  segment->header_bytes       = 4 + 4 * ndims;
+  segment->record_bytes       = image_size;
+  segment->label_header_bytes = 8;
+  reader->num_samples[split] += segment->num_samples;
+
+  if ( file_size( segment->path ) < segment->header_bytes + dims[0] * image_size ||
+       file_size( segment->label_path ) < 8 + dims[0] ) {
+    fprintf( stderr, "'%s' is truncated\n", segment->path );
+    return false;
+  }
+
+  /* IDX doesn't record the class count, so take it from the labels */
+  FILE *f = fopen( segment->label_path, "rb" );
+  uint8_t *raw = malloc( dims[0] );
+  bool ok = f && fseek( f, 8, SEEK_SET ) == 0 && fread( raw, 1, dims[0], f ) == dims[0];
+  for ( size_t i = 0; ok && i < dims[0]; ++i )
+    if ( (size_t) raw[i] + 1 > reader->num_classes )
+      reader->num_classes = raw[i] + 1;
+  free( raw );
+  if ( f )
+    fclose( f );
+
+  return ok;
+}
+
+static void *
+idx_open ( const char *root, size_t *image_size, size_t *num_classes )
+{
+  RecordReader *reader = record_reader_new( root );
+
+  bool ok = idx_add( reader, DATASET_TRAIN, "train-images-idx3-ubyte", "train-labels-idx1-ubyte" ) &&
+            idx_add( reader, DATASET_TEST,  "t10k-images-idx3-ubyte",  "t10k-labels-idx1-ubyte" );
+
+  if ( !ok ) {
+    record_close( reader );
+    return NULL;
+  }
+
+  *image_size  = reader->image_size;
+  *num_classes = reader->num_classes;
+  return reader;
+}
+
+static char **
+idx_label_map ( void *handle )
+{
+  RecordReader *reader = handle;
+  char name[32];
+
+  char **label_map = malloc( sizeof(char *) * reader->num_classes );
+  for ( size_t i = 0; i < reader->num_classes; ++i ) {
+    snprintf( name, sizeof(name), "%zu", i );
+    label_map[i] = strdup( name );
+  }
+  return label_map;
+}
+
+const DatasetReader dataset_reader_idx = {
+  .name      = "idx",
+  .open      = idx_open,
+  .count     = record_count,
+  .read      = record_read,
+  .label_map = idx_label_map,
+  .sources   = record_sources,
+  .close     = record_close
+};
+
+const DatasetReader *
+dataset_reader_find ( const char *name )
+{
+  const DatasetReader *readers[] = {
+    &dataset_reader_cifar10,
+    &dataset_reader_cifar100,
+    &dataset_reader_idx
+  };
+
+  for ( size_t i = 0; i < sizeof(readers) / sizeof(readers[0]); ++i )
+    if ( strcmp( readers[i]->name, name ) == 0 )
+      return readers[i];
+
+  return NULL;
+}
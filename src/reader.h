@@ -0,0 +1,52 @@
+#ifndef READER_HEADER
+#define READER_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+  DATASET_TRAIN,
+  DATASET_TEST
+} DatasetSplit;
+
+/* a pluggable on-disk dataset format. the loader only talks to a format
+   through this table, so anything implementing it gets the binary cache and
+   the prefetching sampler for free.
+
+   zero-copy contract: read decodes straight into the caller's buffers, which
+   are the batch's final aligned image block, so no sample is staged or copied
+   twice between the file and training. images come out as doubles scaled to
+   [0, 1], planar (channel, row, column) like the sampler and augmentation
+   expect. */
+typedef struct {
+  const char *name;
+
+  /* opens the dataset under root and reports its shape, NULL on failure */
+  void   *(*open)      ( const char *root, size_t *image_size, size_t *num_classes );
+  size_t  (*count)     ( void *handle, DatasetSplit split );
+  /* samples [first, first + count) of split into images (count x image_size)
+     and labels */
+  bool    (*read)      ( void *handle, DatasetSplit split, size_t first, size_t count,
+                         double *images, size_t *labels );
+  /* num_classes strings, owned by the caller */
+  char  **(*label_map) ( void *handle );
+  /* the files the dataset is read from, for invalidating caches built from
+     them. the array stays owned by the handle */
+  const char **(*sources) ( void *handle, size_t *len );
+  void    (*close)     ( void *handle );
+} DatasetReader;
+
+/* CIFAR-10 and CIFAR-100 binary versions, and MNIST-style IDX files
+   ('train-images-idx3-ubyte' etc.) */
+extern const DatasetReader dataset_reader_cifar10;
+extern const DatasetReader dataset_reader_cifar100;
+extern const DatasetReader dataset_reader_idx;
+
+/* looks a reader up by name, NULL if there is none */
+const DatasetReader *dataset_reader_find ( const char *name );
+
+/* one class name per line of filepath, with 'class_<i>' standing in for any
+   the file doesn't name. NULL if it can't be opened */
+char **reader_load_label_names ( const char *filepath, const size_t num_classes );
+
+#endif
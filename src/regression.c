@@ -1,98 +1,495 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "regression.h"
-#include "tensor.h"
+#include "tensor_expr.h"
+#include "threadpool.h"
 
-static double
-sqr ( const double x )
+Tensor2D *
+calculate_ols_beta ( Tensor2D *x, Tensor2D *y )
 {
-  return x * x;
+  /* beta = (X^T X)^-1 X^T y
+     https://en.wikipedia.org/wiki/Linear_least_squares#Fitting_a_line
+
+     X^T [X y] is evaluated lazily in a single pass over X and y (no
+     transpose or concatenation is materialized): its first p columns are
+     the gram X^T X, the rest are the moments X^T y. only those p x (p + k)
+     entries are ever allocated. */
+  TensorExpr *moments_expr =
+    TensorExpr_mult( TensorExpr_transpose( TensorExpr_leaf( x ) ),
+                     TensorExpr_hcat( TensorExpr_leaf( x ), TensorExpr_leaf( y ) ) );
+  if (!moments_expr)
+    return NULL;
+
+  Tensor2D *moments = TensorExpr_eval( moments_expr );
+  TensorExpr_destroy( &moments_expr );
+
+  const size_t p = x->cols, k = y->cols;
+  Tensor2D *x_gram = Tensor2D_create( p, p );
+  Tensor2D *xty    = Tensor2D_create( p, k );
+  for ( size_t r = 0; r < p; ++r ) {
+    const double *row = moments->data + r * ( p + k );
+    for ( size_t c = 0; c < p; ++c )
+      x_gram->data[ r * p + c ] = row[c];
+    for ( size_t c = 0; c < k; ++c )
+      xty->data[ r * k + c ] = row[ p + c ];
+  }
+  Tensor2D_destroy( &moments );
+
+  Tensor2D *x_gram_inverse = Tensor2D_sq_inverse( x_gram );
+  Tensor2D_destroy( &x_gram );
+
+  if (!x_gram_inverse) {
+    fprintf(stderr, "Regression failed: X^T X is singular!\n");
+    Tensor2D_destroy( &xty );
+    return NULL;
+  }
+
+  TensorExpr *beta_expr = TensorExpr_mult( TensorExpr_leaf( x_gram_inverse ),
+                                           TensorExpr_leaf( xty ) );
+  Tensor2D *beta = TensorExpr_eval( beta_expr );
+  TensorExpr_destroy( &beta_expr );
+  Tensor2D_destroy( &x_gram_inverse );
+  Tensor2D_destroy( &xty );
+
+  return beta;
 }
 
-RegressionResult
-calculate_linear_regression ( double *x, double *y, const size_t size )
+Tensor2D *
+calculate_ols_beta_sparse ( const SparseTensor2D *x, Tensor2D *y )
 {
-  Tensor2D *x_tensor = Tensor2D_load_xvalue_tensor ( x, size );
-  Tensor2D *y_tensor = Tensor2D_load_yvalue_tensor ( y, size );
-
-  /* print starting tensors */
-  fprintf(stderr, "X TENSOR\n");
-  Tensor2D_print( x_tensor );
-
-  fprintf(stderr, "Y TENSOR\n");
-  Tensor2D_print( y_tensor );
-
-  /* intermediate steps
-     https://en.wikipedia.org/wiki/Linear_least_squares#Fitting_a_line */
-  Tensor2D *x_tensor_transposed = Tensor2D_transpose( x_tensor );
-  fprintf( stderr, "X TENSOR TRANSPOSED\n");
-  Tensor2D_print( x_tensor_transposed );
-  
-  Tensor2D *x_gram = Tensor2D_mult( x_tensor_transposed, x_tensor );
-  fprintf( stderr, "X GRAM MATRIX\n" );
-  Tensor2D_print( x_gram );
-  
+  if ( y->rows != x->rows || y->cols != 1 ) {
+    fprintf(stderr, "Regression failed: %zu x %zu response for %zu observations\n",
+            y->rows, y->cols, x->rows);
+    return NULL;
+  }
+
+  /* only the p x p gram and the p x 1 moments are dense */
+  Tensor2D *x_gram = SparseTensor2D_gram( x );
   Tensor2D *x_gram_inverse = Tensor2D_sq_inverse( x_gram );
-  fprintf( stderr, "X GRAM INVERSE\n" );
-  Tensor2D_print( x_gram_inverse );
-  
-  Tensor2D *gram_inv_trans_prod = Tensor2D_mult( x_gram_inverse, x_tensor_transposed );
-  fprintf( stderr, "X GRAM INVERSE TRANSPOSITION PRODUCT\n" );
-  Tensor2D_print( gram_inv_trans_prod );
-  
-  if (!gram_inv_trans_prod) {
-    fprintf(stderr, "Regression Failed!\n");
-    return (RegressionResult) {{0}};
-  }
-  
-  Tensor2D *beta = Tensor2D_mult( gram_inv_trans_prod, y_tensor );
-
-  if (!beta) {
-    fprintf(stderr, "Regression failed!\n");
-    return (RegressionResult) {{0}};
-  }
-
-  /* free original tensors */
-  Tensor2D_destroy( &x_tensor );
-  Tensor2D_destroy( &y_tensor );
-  
-  /* free intermediate steps */
-  Tensor2D_destroy( &x_tensor_transposed );
   Tensor2D_destroy( &x_gram );
+
+  if (!x_gram_inverse) {
+    fprintf(stderr, "Regression failed: X^T X is singular!\n");
+    return NULL;
+  }
+
+  Tensor2D *moments = Tensor2D_create( x->cols, 1 );
+  SparseTensor2D_spmv_transpose( x, y->data, moments->data );
+
+  TensorExpr *beta_expr = TensorExpr_mult( TensorExpr_leaf( x_gram_inverse ),
+                                           TensorExpr_leaf( moments ) );
+  Tensor2D *beta = TensorExpr_eval( beta_expr );
+  TensorExpr_destroy( &beta_expr );
   Tensor2D_destroy( &x_gram_inverse );
-  Tensor2D_destroy( &gram_inv_trans_prod );
-
-  fprintf( stderr, "Regression successful! Final BETA Matrix:\n" );
-  Tensor2D_print( beta );
-  
-  /* obtain slope and intercept from beta */
-  double intercept = Tensor2D_get_index( beta, 0, 0 );
-  double slope     = Tensor2D_get_index( beta, 1, 0 );
-  
-  /* free beta */
-  Tensor2D_destroy( &beta );
-  
-  /* calculate residuals and R^2 */
-  double predictions[size], residuals[size];
-  double residual_sq_sum = 0, total_sq_sum = 0, mean_y_value = 0;
-  
-  for (size_t i = 0; i < size; ++i)
-    mean_y_value += y[i];
-  mean_y_value = mean_y_value / size;
-
-  for (size_t i = 0; i < size; ++i) {
-    predictions[i] = intercept + slope * x[i];
-    residuals[i] = y[i] - predictions[i];
-
-    residual_sq_sum += sqr( residuals[i] );
-    total_sq_sum += sqr( y[i] - mean_y_value );
-  }
-
-  double r_squared = 1 - residual_sq_sum / total_sq_sum;
-
-  /* save data and output */
-  return (RegressionResult) {
+  Tensor2D_destroy( &moments );
+
+  return beta;
+}
+
+/* simple linear regression of one series in closed form. two passes (means,
+   then centered sums) so large offsets don't cancel, each with four
+   independent accumulators so the reductions pipeline and vectorize.
+   returns false if the system is singular */
+static bool
+regression_fit ( const double *restrict x, const double *restrict y, const size_t n,
+                 RegressionResult *result )
+{
+  double sx[4] = { 0 }, sy[4] = { 0 };
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4 )
+    for ( size_t k = 0; k < 4; ++k ) {
+      sx[k] += x[i + k];
+      sy[k] += y[i + k];
+    }
+  for ( ; i < n; ++i ) {
+    sx[0] += x[i];
+    sy[0] += y[i];
+  }
+
+  const double mean_x = ( ( sx[0] + sx[1] ) + ( sx[2] + sx[3] ) ) / n;
+  const double mean_y = ( ( sy[0] + sy[1] ) + ( sy[2] + sy[3] ) ) / n;
+
+  double sxx[4] = { 0 }, sxy[4] = { 0 }, syy[4] = { 0 };
+  for ( i = 0; i + 4 <= n; i += 4 )
+    for ( size_t k = 0; k < 4; ++k ) {
+      const double dx = x[i + k] - mean_x, dy = y[i + k] - mean_y;
+      sxx[k] += dx * dx;
+      sxy[k] += dx * dy;
+      syy[k] += dy * dy;
+    }
+  for ( ; i < n; ++i ) {
+    const double dx = x[i] - mean_x, dy = y[i] - mean_y;
+    sxx[0] += dx * dx;
+    sxy[0] += dx * dy;
+    syy[0] += dy * dy;
+  }
+
+  const double s_xx = ( sxx[0] + sxx[1] ) + ( sxx[2] + sxx[3] );
+  const double s_xy = ( sxy[0] + sxy[1] ) + ( sxy[2] + sxy[3] );
+  const double s_yy = ( syy[0] + syy[1] ) + ( syy[2] + syy[3] );
+
+  if ( n < 2 || s_xx == 0.0 ) {
+    *result = (RegressionResult) { 0 };
+    return false;
+  }
+
+  /* the normal equations [n, sum x; sum x, sum xx] b = [sum y; sum xy]
+     solved directly in centered form */
+  const double slope = s_xy / s_xx;
+
+  /* a constant y is fitted exactly by the intercept */
+  *result = (RegressionResult) {
     .coefficient = slope,
-    .intercept = intercept,
-    .r_squared = r_squared
+    .intercept   = mean_y - slope * mean_x,
+    .r_squared   = s_yy > 0.0 ? 1 - ( s_yy - slope * s_xy ) / s_yy : 1.0
   };
+  return true;
+}
+
+typedef struct {
+  const double *x, *y;
+  const size_t *offsets;
+  RegressionResult *results;
+  size_t singular;
+} RegressionSweep;
+
+static void
+regression_sweep_chunk ( size_t begin, size_t end, void *ctx )
+{
+  RegressionSweep *sweep = ctx;
+  size_t singular = 0;
+
+  for ( size_t s = begin; s < end; ++s ) {
+    const size_t first = sweep->offsets[s];
+    if ( !regression_fit( sweep->x + first, sweep->y + first,
+                          sweep->offsets[s + 1] - first, &sweep->results[s] ) )
+      ++singular;
+  }
+
+  if ( singular )
+    __atomic_fetch_add( &sweep->singular, singular, __ATOMIC_RELAXED );
+}
+
+RegressionResult *
+calculate_linear_regressions ( const double *x, const double *y,
+                               const size_t *offsets, const size_t num_series )
+{
+  RegressionResult *results = malloc( num_series * sizeof(RegressionResult) );
+  if ( !results || num_series == 0 )
+    return results;
+
+  RegressionSweep sweep = {
+    .x = x, .y = y, .offsets = offsets, .results = results
+  };
+
+  /* two passes of a few flops per point */
+  const size_t mean_len = ( offsets[num_series] - offsets[0] ) / num_series;
+  parallel_for( 0, num_series, parallel_grain( 8 * mean_len + 16 ),
+                regression_sweep_chunk, &sweep );
+
+  if ( sweep.singular )
+    fprintf( stderr, "%zu of %zu regressions were singular\n", sweep.singular, num_series );
+
+  return results;
+}
+
+RegressionResult
+calculate_linear_regression ( double *x, double *y, const size_t size )
+{
+  /* a single series needs nothing the batched kernel doesn't already do */
+  RegressionResult result;
+  if ( !regression_fit( x, y, size, &result ) )
+    fprintf(stderr, "Regression failed: X^T X is singular!\n");
+
+  return result;
+}
+
+/* resizes array to count entries of size bytes. false (and the array left
+   as it was) if there isn't the memory */
+static bool
+regression_resize ( void **array, const size_t count, const size_t size )
+{
+  void *resized = realloc( *array, count * size );
+  if ( !resized )
+    return false;
+  *array = resized;
+  return true;
+}
+
+/* the capacity after cap once len has reached it */
+static size_t
+regression_next_cap ( const size_t cap )
+{
+  return cap ? 2 * cap : 1024;
+}
+
+static bool
+regression_number ( const char *token, double *value )
+{
+  char *end;
+  errno = 0;
+  *value = strtod( token, &end );
+  return end != token && *end == '\0' && errno == 0 && isfinite( *value );
+}
+
+/* 'column:value', column below REGRESSION_MAX_COLUMNS */
+static bool
+regression_entry ( const char *token, size_t *column, double *value )
+{
+  char *end;
+  errno = 0;
+  const unsigned long long parsed = strtoull( token, &end, 10 );
+  if ( end == token || *end != ':' || errno != 0 || token[0] == '-' ||
+       parsed >= REGRESSION_MAX_COLUMNS )
+    return false;
+  *column = parsed;
+  return regression_number( end + 1, value );
+}
+
+/* where a series starts, sorted by name to find one that comes back */
+typedef struct {
+  const char *name;
+  size_t index, line;
+} RegressionSeriesStart;
+
+static int
+regression_series_order ( const void *a, const void *b )
+{
+  const RegressionSeriesStart *first = a, *second = b;
+  const int order = strcmp( first->name, second->name );
+  if ( order )
+    return order;
+  return first->index < second->index ? -1 : first->index > second->index;
+}
+
+/* false, after saying where, if a series' lines are split by another's */
+static bool
+regression_series_contiguous ( const char *path, const RegressionData *data,
+                               const size_t *lines )
+{
+  RegressionSeriesStart *starts = malloc( data->num_series * sizeof(RegressionSeriesStart) );
+  if ( !starts ) {
+    fprintf( stderr, "not enough memory to check the series of '%s'\n", path );
+    return false;
+  }
+
+  for ( size_t i = 0; i < data->num_series; ++i )
+    starts[i] = (RegressionSeriesStart) { data->names[i], i, lines[i] };
+  qsort( starts, data->num_series, sizeof(RegressionSeriesStart), regression_series_order );
+
+  bool ok = true;
+  for ( size_t i = 1; ok && i < data->num_series; ++i )
+    if ( strcmp( starts[i - 1].name, starts[i].name ) == 0 ) {
+      fprintf( stderr, "%s:%zu: series '%s' already ended, its lines (from line %zu) "
+                       "have to be together\n",
+               path, starts[i].line, starts[i].name, starts[i - 1].line );
+      ok = false;
+    }
+
+  free( starts );
+  return ok;
+}
+
+RegressionData *
+regression_data_read ( const char *path )
+{
+  FILE *file = fopen( path, "r" );
+  if ( !file ) {
+    perror( "Failed to open the regression data" );
+    return NULL;
+  }
+
+  RegressionData *data = calloc( 1, sizeof(RegressionData) );
+  if ( !data ) {
+    fclose( file );
+    fprintf( stderr, "not enough memory to read '%s'\n", path );
+    return NULL;
+  }
+
+  size_t cap = 0, series_cap = 0, line_number = 0;
+  size_t *series_lines = NULL;   /* line each series starts on */
+  bool have_kind = false, ok = true, reported = false;
+
+  /* sparse entries as triplets until every row is in */
+  size_t *entry_rows = NULL, *entry_columns = NULL;
+  double *entry_values = NULL;
+  size_t nnz = 0, entries_cap = 0, cols = 0;
+
+  char *line = NULL;
+  size_t line_cap = 0;
+  while ( ok && getline( &line, &line_cap, file ) != -1 ) {
+    ++line_number;
+
+    char *save, *first = strtok_r( line, " \t\r\n", &save );
+    if ( !first || first[0] == '#' )
+      continue;
+
+    char *fields[3] = { first, strtok_r( NULL, " \t\r\n", &save ), NULL };
+    if ( fields[1] )
+      fields[2] = strtok_r( NULL, " \t\r\n", &save );
+
+    if ( !have_kind ) {
+      if ( fields[1] && strchr( fields[1], ':' ) )
+        data->kind = REGRESSION_DATA_SPARSE;
+      else if ( fields[1] && !fields[2] )
+        data->kind = REGRESSION_DATA_LINE;
+      else if ( fields[2] && !strtok_r( NULL, " \t\r\n", &save ) )
+        data->kind = REGRESSION_DATA_SERIES;
+      else {
+        fprintf( stderr, "%s:%zu: expected 'x y', 'series x y' or 'y column:value ...'\n",
+                 path, line_number );
+        ok = false;
+        break;
+      }
+      have_kind = true;
+    }
+
+    const size_t row = data->len;
+    if ( row == cap ) {
+      const size_t next = regression_next_cap( cap );
+      ok = regression_resize( (void **) &data->y, next, sizeof(double) ) &&
+           ( data->kind == REGRESSION_DATA_SPARSE ||
+             regression_resize( (void **) &data->x, next, sizeof(double) ) );
+      if ( !ok ) {
+        fprintf( stderr, "%s:%zu: not enough memory\n", path, line_number );
+        break;
+      }
+      cap = next;
+    }
+
+    switch ( data->kind ) {
+    case REGRESSION_DATA_LINE:
+      ok = fields[1] && !fields[2] && regression_number( fields[0], &data->x[row] ) &&
+           regression_number( fields[1], &data->y[row] );
+      break;
+
+    case REGRESSION_DATA_SERIES:
+      ok = fields[2] && !strtok_r( NULL, " \t\r\n", &save ) &&
+           regression_number( fields[1], &data->x[row] ) &&
+           regression_number( fields[2], &data->y[row] );
+      if ( ok && ( data->num_series == 0 ||
+                   strcmp( fields[0], data->names[ data->num_series - 1 ] ) != 0 ) ) {
+        /* room for the closing offset too */
+        if ( data->num_series + 1 >= series_cap ) {
+          const size_t next = regression_next_cap( series_cap );
+          if ( !regression_resize( (void **) &data->names, next, sizeof(char *) ) ||
+               !regression_resize( (void **) &data->offsets, next, sizeof(size_t) ) ||
+               !regression_resize( (void **) &series_lines, next, sizeof(size_t) ) ) {
+            fprintf( stderr, "%s:%zu: not enough memory\n", path, line_number );
+            ok = false;
+            reported = true;
+            break;
+          }
+          series_cap = next;
+        }
+        char *name = strdup( fields[0] );
+        if ( !name ) {
+          fprintf( stderr, "%s:%zu: not enough memory\n", path, line_number );
+          ok = false;
+          reported = true;
+          break;
+        }
+        data->offsets[ data->num_series ] = row;
+        series_lines[ data->num_series ]  = line_number;
+        data->names[ data->num_series++ ] = name;
+      }
+      break;
+
+    case REGRESSION_DATA_SPARSE:
+      ok = regression_number( fields[0], &data->y[row] );
+      /* fields[1] and fields[2] were already split off */
+      for ( size_t f = 1; ok; ++f ) {
+        const char *token = f < 3 ? fields[f] : strtok_r( NULL, " \t\r\n", &save );
+        if ( !token )
+          break;
+
+        size_t column;
+        double value;
+        if ( !( ok = regression_entry( token, &column, &value ) ) )
+          break;
+
+        if ( nnz == entries_cap ) {
+          const size_t next = regression_next_cap( entries_cap );
+          if ( !regression_resize( (void **) &entry_rows, next, sizeof(size_t) ) ||
+               !regression_resize( (void **) &entry_columns, next, sizeof(size_t) ) ||
+               !regression_resize( (void **) &entry_values, next, sizeof(double) ) ) {
+            fprintf( stderr, "%s:%zu: not enough memory\n", path, line_number );
+            ok = false;
+            reported = true;
+            break;
+          }
+          entries_cap = next;
+        }
+        entry_rows[nnz]    = row;
+        entry_columns[nnz] = column;
+        entry_values[nnz]  = value;
+        ++nnz;
+        if ( column + 1 > cols )
+          cols = column + 1;
+      }
+      break;
+    }
+
+    if ( ok )
+      ++data->len;
+    else if ( !reported && data->kind == REGRESSION_DATA_SPARSE )
+      fprintf( stderr, "%s:%zu: not a 'y column:value ...' observation with columns "
+                       "below %d\n", path, line_number, REGRESSION_MAX_COLUMNS );
+    else if ( !reported )
+      fprintf( stderr, "%s:%zu: not a %s observation\n", path, line_number,
+               data->kind == REGRESSION_DATA_LINE ? "'x y'" : "'series x y'" );
+  }
+
+  free( line );
+  fclose( file );
+
+  if ( ok && data->len == 0 ) {
+    fprintf( stderr, "no observations in '%s'\n", path );
+    ok = false;
+  }
+
+  if ( ok && data->kind == REGRESSION_DATA_SERIES ) {
+    data->offsets[ data->num_series ] = data->len;
+    ok = regression_series_contiguous( path, data, series_lines );
+  }
+
+  if ( ok && data->kind == REGRESSION_DATA_SPARSE ) {
+    data->design = SparseTensor2D_from_triplets( data->len, cols, entry_rows, entry_columns,
+                                                 entry_values, nnz, SPARSE_CSR );
+    if ( !data->design ) {
+      fprintf( stderr, "couldn't build the %zu x %zu design matrix of '%s'\n",
+               data->len, cols, path );
+      ok = false;
+    }
+  }
+  free( series_lines );
+  free( entry_rows );
+  free( entry_columns );
+  free( entry_values );
+
+  if ( !ok )
+    regression_data_destroy( &data );
+
+  return data;
+}
+
+void
+regression_data_destroy ( RegressionData **dataptr )
+{
+  if ( dataptr && *dataptr ) {
+    RegressionData *data = *dataptr;
+    free( data->x );
+    free( data->y );
+    for ( size_t i = 0; i < data->num_series; ++i )
+      free( data->names[i] );
+    free( data->names );
+    free( data->offsets );
+    SparseTensor2D_destroy( &data->design );
+    free( data );
+    *dataptr = NULL;
+  }
 }
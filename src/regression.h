@@ -2,6 +2,8 @@
 #define REGRESSION_HEADER
 
 #include <stddef.h>
+#include "sparse.h"
+#include "tensor.h"
 
 typedef struct {
   double coefficient;
@@ -11,4 +13,57 @@ typedef struct {
 
 RegressionResult calculate_linear_regression ( double *x, double *y, const size_t size );
 
+/* fits many independent (x, y) series in one multithreaded sweep. the series
+   are packed back to back (structure of arrays): series i is
+   x[offsets[i] .. offsets[i + 1]) and the same range of y, so offsets has
+   num_series + 1 entries. each fit is a closed-form 2x2 solve with no
+   allocation. a series with fewer than two points or constant x gets an
+   all-zero result. returns num_series results (caller frees) */
+RegressionResult *calculate_linear_regressions ( const double *x, const double *y,
+                                                 const size_t *offsets,
+                                                 const size_t num_series );
+
+/* ordinary least squares for a full design matrix (n x p) and response
+   (n x 1), returns the p x 1 beta tensor or NULL if X^T X is singular */
+Tensor2D *calculate_ols_beta ( Tensor2D *x, Tensor2D *y );
+
+/* the same for a sparse design matrix (either format): X^T X and X^T y are
+   built from the non-zeros only, X is never densified */
+Tensor2D *calculate_ols_beta_sparse ( const SparseTensor2D *x, Tensor2D *y );
+
+/* observations read from a text file, in the layout of the solver that
+   fits them */
+typedef enum {
+  REGRESSION_DATA_LINE,      /* 'x y' lines: calculate_linear_regression */
+  REGRESSION_DATA_SERIES,    /* 'series x y' lines: calculate_linear_regressions */
+  REGRESSION_DATA_SPARSE     /* 'y column:value ...' lines: calculate_ols_beta_sparse */
+} RegressionDataKind;
+
+typedef struct {
+  RegressionDataKind kind;
+  size_t len;                /* observations */
+  double *x, *y;             /* len each, x is NULL for sparse data */
+
+  /* series: num_series + 1 offsets into x and y, and each series' name */
+  size_t *offsets, num_series;
+  char **names;
+
+  /* sparse: the len x (largest column + 1) design matrix, CSR */
+  SparseTensor2D *design;
+} RegressionData;
+
+/* sparse columns a data file may use: the fit builds and inverts a dense
+   p x p gram (128 MB at this size) */
+#define REGRESSION_MAX_COLUMNS 4096
+
+/* one observation per line, fields separated by blanks. blank lines and
+   lines starting with '#' are skipped. the first observation decides the
+   kind. the lines of a series have to be together, a series that comes
+   back after another is an error. sparse columns count from 0 up to
+   REGRESSION_MAX_COLUMNS (give a column that is always 1 for an
+   intercept). NULL after saying what's wrong if the file can't be read,
+   a line doesn't parse or there isn't the memory */
+RegressionData *regression_data_read    ( const char *path );
+void            regression_data_destroy ( RegressionData **data );
+
 #endif
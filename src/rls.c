@@ -0,0 +1,252 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rls.h"
+
+RlsConfig
+rls_default_config ( void )
+{
+  return (RlsConfig) {
+    .forgetting = 1.0,
+    .window     = 0,
+    .delta      = 1e6
+  };
+}
+
+Rls *
+rls_new ( const size_t p, const RlsConfig *config )
+{
+  if ( p == 0 || !( config->forgetting > 0.0 && config->forgetting <= 1.0 ) ||
+       !( config->delta > 0.0 ) ) {
+    fprintf( stderr, "rls needs p > 0, forgetting in (0, 1] and delta > 0\n" );
+    return NULL;
+  }
+
+  Rls *new = calloc( 1, sizeof(Rls) );
+  new->config = *config;
+  new->p      = p;
+  new->beta   = Tensor2D_create( p, 1 );
+  new->P      = Tensor2D_create( p, p );
+  new->b      = Tensor2D_create( p, 1 );
+  new->Px     = Tensor2D_create( p, 1 );
+
+  if ( config->window ) {
+    new->history_x = malloc( config->window * p * sizeof(double) );
+    new->history_y = malloc( config->window * sizeof(double) );
+    new->window_weight = pow( config->forgetting, (double) config->window );
+  }
+
+  rls_reset( new );
+  return new;
+}
+
+void
+rls_destroy ( Rls **rlsptr )
+{
+  if ( rlsptr && *rlsptr ) {
+    Rls *rls = *rlsptr;
+    Tensor2D_destroy( &rls->beta );
+    Tensor2D_destroy( &rls->P );
+    Tensor2D_destroy( &rls->b );
+    Tensor2D_destroy( &rls->Px );
+    free( rls->history_x );
+    free( rls->history_y );
+    free( rls );
+    *rlsptr = NULL;
+  }
+}
+
+/* back to the prior, the history is left alone */
+static void
+rls_clear_estimate ( Rls *rls )
+{
+  const size_t p = rls->p;
+
+  memset( rls->beta->data, 0, p * sizeof(double) );
+  memset( rls->b->data, 0, p * sizeof(double) );
+  memset( rls->P->data, 0, p * p * sizeof(double) );
+  for ( size_t i = 0; i < p; ++i )
+    rls->P->data[i * p + i] = rls->config.delta;
+
+  rls->weight = rls->sum_y = rls->sum_yy = 0.0;
+}
+
+void
+rls_reset ( Rls *rls )
+{
+  rls_clear_estimate( rls );
+  rls->head = rls->count = rls->num_observations = rls->refits = 0;
+}
+
+/* adds w x x^T to the gram (w < 0 removes it):
+     P'    = P - w P x x^T P / (1 + w x^T P x)
+     beta' = beta + w P' x (y - x^T beta)
+   P stays symmetric, so only the upper triangle is computed. false (and
+   nothing changed) unless the denominator is safely positive: downdating
+   the last support of some direction would make the gram lose rank, and
+   rounding can push it below zero, which leaves P indefinite */
+static bool
+rls_rank_one ( Rls *rls, const double *x, const double y, const double w )
+{
+  const size_t p = rls->p;
+  double *P = rls->P->data, *Px = rls->Px->data, *beta = rls->beta->data;
+
+  double xPx = 0.0, prediction = 0.0;
+  for ( size_t i = 0; i < p; ++i ) {
+    double sum = 0.0;
+    for ( size_t j = 0; j < p; ++j )
+      sum += P[i * p + j] * x[j];
+    Px[i] = sum;
+    xPx += x[i] * sum;
+    prediction += x[i] * beta[i];
+  }
+
+  const double denominator = 1.0 + w * xPx;
+  if ( !( denominator > 1e-12 ) )
+    return false;
+
+  const double scale = w / denominator;
+  for ( size_t i = 0; i < p; ++i )
+    for ( size_t j = i; j < p; ++j ) {
+      P[i * p + j] -= scale * Px[i] * Px[j];
+      P[j * p + i] = P[i * p + j];
+    }
+
+  /* P' x = P x / (1 + w x^T P x) */
+  const double error = y - prediction;
+  for ( size_t i = 0; i < p; ++i ) {
+    beta[i] += scale * Px[i] * error;
+    rls->b->data[i] += w * x[i] * y;
+  }
+
+  rls->weight += w;
+  rls->sum_y  += w * y;
+  rls->sum_yy += w * y * y;
+  return true;
+}
+
+/* ages everything already in play by one step */
+static void
+rls_age ( Rls *rls )
+{
+  const size_t p = rls->p;
+  const double lambda = rls->config.forgetting;
+
+  if ( lambda < 1.0 ) {
+    const double inv_lambda = 1.0 / lambda;
+    for ( size_t i = 0; i < p * p; ++i )
+      rls->P->data[i] *= inv_lambda;
+    for ( size_t i = 0; i < p; ++i )
+      rls->b->data[i] *= lambda;
+    rls->weight *= lambda;
+    rls->sum_y  *= lambda;
+    rls->sum_yy *= lambda;
+  }
+}
+
+/* rebuilds the estimate from the window's history, oldest first. that is
+   the fit the downdates track, without the observation that couldn't be
+   taken out */
+static void
+rls_refit ( Rls *rls )
+{
+  const size_t p = rls->p, window = rls->config.window;
+  const size_t oldest = ( rls->head + window - rls->count ) % window;
+
+  rls_clear_estimate( rls );
+  for ( size_t i = 0; i < rls->count; ++i ) {
+    const size_t slot = ( oldest + i ) % window;
+    rls_age( rls );
+    rls_rank_one( rls, rls->history_x + slot * p, rls->history_y[slot], 1.0 );
+  }
+  ++rls->refits;
+}
+
+bool
+rls_update ( Rls *rls, const double *x, const double y )
+{
+  const size_t p = rls->p;
+
+  if ( !isfinite( y ) )
+    return false;
+  for ( size_t i = 0; i < p; ++i )
+    if ( !isfinite( x[i] ) )
+      return false;
+
+  rls_age( rls );
+  bool ok = rls_rank_one( rls, x, y, 1.0 );
+  ++rls->num_observations;
+
+  if ( !rls->config.window )
+    return ok;
+
+  const size_t window = rls->config.window;
+  double *slot_x = rls->history_x + rls->head * p;
+
+  if ( rls->count == window ) {
+    /* the oldest observation has aged window steps by now */
+    ok = rls_rank_one( rls, slot_x, rls->history_y[rls->head], -rls->window_weight ) && ok;
+  } else
+    ++rls->count;
+
+  memcpy( slot_x, x, p * sizeof(double) );
+  rls->history_y[rls->head] = y;
+  rls->head = ( rls->head + 1 ) % window;
+
+  if ( !ok )
+    rls_refit( rls );
+
+  return true;
+}
+
+bool
+rls_push ( Rls *rls, const double x, const double y )
+{
+  const double features[2] = { 1.0, x };
+  return rls_update( rls, features, y );
+}
+
+double
+rls_r_squared ( const Rls *rls )
+{
+  if ( rls->weight <= 0.0 )
+    return 0.0;
+
+  /* SS_res = y^T W y - beta^T X^T W y at the least squares solution (up to
+     the vanishing prior) */
+  double explained = 0.0;
+  for ( size_t i = 0; i < rls->p; ++i )
+    explained += rls->beta->data[i] * rls->b->data[i];
+
+  const double total    = rls->sum_yy - rls->sum_y * rls->sum_y / rls->weight;
+  const double residual = fmax( rls->sum_yy - explained, 0.0 );
+
+  /* constant targets: all or nothing, depending on whether the fit hits
+     them. the prior's ridge penalty beta^T beta / delta (less once it has
+     been forgotten) is in the residual even for an exact fit */
+  if ( !( total > 0.0 ) ) {
+    double penalty = 0.0;
+    for ( size_t i = 0; i < rls->p; ++i )
+      penalty += rls->beta->data[i] * rls->beta->data[i];
+    penalty /= rls->config.delta;
+    return residual <= penalty + 1e-9 * fmax( rls->sum_yy, 1.0 ) ? 1.0 : 0.0;
+  }
+
+  return 1 - residual / total;
+}
+
+RegressionResult
+rls_result ( const Rls *rls )
+{
+  if ( rls->p != 2 ) {
+    fprintf( stderr, "rls_result needs a p = 2 (intercept, slope) estimator\n" );
+    return (RegressionResult) { 0 };
+  }
+
+  return (RegressionResult) {
+    .coefficient = rls->beta->data[1],
+    .intercept   = rls->beta->data[0],
+    .r_squared   = rls_r_squared( rls )
+  };
+}
@@ -0,0 +1,58 @@
+#ifndef RLS_HEADER
+#define RLS_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "regression.h"
+#include "tensor.h"
+
+typedef struct {
+  double forgetting;  /* lambda in (0, 1], older observations weigh lambda^age */
+  size_t window;      /* only the last window observations count, 0 = all */
+  double delta;       /* initial P = delta * I, large means a weak prior */
+} RlsConfig;
+
+/* recursive least squares over p features. every observation updates the
+   coefficients in O(p^2) through the Sherman-Morrison identity, and with a
+   window the observation falling out of it is downdated the same way, so the
+   estimate always matches a batch fit over the (weighted) observations that
+   are still in play. */
+typedef struct {
+  RlsConfig config;
+  size_t p;
+
+  Tensor2D *beta;       /* p x 1 coefficients */
+  Tensor2D *P;          /* p x p inverse of the weighted gram X^T W X */
+  Tensor2D *b;          /* p x 1 weighted X^T W y, for the residual sum */
+  Tensor2D *Px;         /* p x 1 scratch */
+
+  /* weighted sums of 1, y and y^2, for R^2 */
+  double weight, sum_y, sum_yy;
+
+  /* the window's observations, a ring of window x p features and targets */
+  double *history_x, *history_y;
+  size_t head, count;
+  double window_weight;  /* forgetting^window, the weight of the observation leaving */
+  size_t num_observations;
+  size_t refits;         /* downdates that lost rank and rebuilt the window */
+} Rls;
+
+RlsConfig rls_default_config ( void );
+Rls      *rls_new            ( const size_t p, const RlsConfig *config );
+void      rls_destroy        ( Rls **rls );
+void      rls_reset          ( Rls *rls );
+
+/* adds one observation, x holds p features. a window downdate that would
+   make the gram lose rank rebuilds the estimate from the window's history
+   instead (counted in refits). false if the observation couldn't be taken
+   in: a non-finite x or y, or without a window an update that broke down */
+bool rls_update ( Rls *rls, const double *x, const double y );
+
+/* simple linear regression shorthand for a p = 2 estimator, features (1, x) */
+bool             rls_push   ( Rls *rls, const double x, const double y );
+RegressionResult rls_result ( const Rls *rls );
+
+/* R^2 of the current fit over the weighted observations in play */
+double rls_r_squared ( const Rls *rls );
+
+#endif
@@ -0,0 +1,200 @@
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "rng.h"
+
+/* Philox4x32-10 constants (Salmon et al., "Parallel random numbers: as easy
+   as 1, 2, 3", SC 2011) */
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+/* blocks per bulk call of the SIMD kernel */
+#define RNG_BULK_BLOCKS 256
+
+/* the 128-bit counter is (block, stream), the key is the seed */
+static void
+philox_block ( const uint64_t seed, const uint64_t stream, const uint64_t block,
+               uint32_t out[4] )
+{
+  uint32_t x0 = (uint32_t) block, x1 = (uint32_t) ( block >> 32 );
+  uint32_t x2 = (uint32_t) stream, x3 = (uint32_t) ( stream >> 32 );
+  uint32_t k0 = (uint32_t) seed, k1 = (uint32_t) ( seed >> 32 );
+
+  for ( int round = 0; round < PHILOX_ROUNDS; ++round ) {
+    const uint64_t p0 = (uint64_t) PHILOX_M0 * x0;
+    const uint64_t p1 = (uint64_t) PHILOX_M1 * x2;
+    const uint32_t y0 = (uint32_t) ( p1 >> 32 ) ^ x1 ^ k0;
+    const uint32_t y2 = (uint32_t) ( p0 >> 32 ) ^ x3 ^ k1;
+    x1 = (uint32_t) p1;
+    x3 = (uint32_t) p0;
+    x0 = y0;
+    x2 = y2;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+
+  out[0] = x0;
+  out[1] = x1;
+  out[2] = x2;
+  out[3] = x3;
+}
+
+static void
+rng_words ( const uint32_t block[4], uint64_t words[2] )
+{
+  words[0] = block[0] | (uint64_t) block[1] << 32;
+  words[1] = block[2] | (uint64_t) block[3] << 32;
+}
+
+Rng
+rng_stream ( const uint64_t seed, const uint64_t stream )
+{
+  return (Rng) { .seed = seed, .stream = stream };
+}
+
+uint64_t
+rng_next ( Rng *rng )
+{
+  if ( rng->available == 0 ) {
+    uint32_t block[4];
+    philox_block( rng->seed, rng->stream, rng->counter++, block );
+    rng_words( block, rng->buffer );
+    rng->available = 2;
+  }
+
+  return rng->buffer[ 2 - rng->available-- ];
+}
+
+static double
+rng_to_unit ( const uint64_t word )
+{
+  return ( word >> 11 ) * 0x1.0p-53;
+}
+
+double
+rng_uniform ( Rng *rng )
+{
+  return rng_to_unit( rng_next( rng ) );
+}
+
+/* Lemire's multiply and reject: the high word of x * n is uniform in
+   [0, n) once the few low words that would favour some values are redrawn */
+uint64_t
+rng_below ( Rng *rng, const uint64_t n )
+{
+  __uint128_t m = (__uint128_t) rng_next( rng ) * n;
+  uint64_t low = (uint64_t) m;
+
+  if ( low < n ) {
+    const uint64_t threshold = -n % n;
+    while ( low < threshold ) {
+      m = (__uint128_t) rng_next( rng ) * n;
+      low = (uint64_t) m;
+    }
+  }
+
+  return (uint64_t) ( m >> 64 );
+}
+
+uint64_t
+rng_at ( const uint64_t seed, const uint64_t stream, const uint64_t index )
+{
+  uint32_t block[4];
+  uint64_t words[2];
+  philox_block( seed, stream, index / 2, block );
+  rng_words( block, words );
+  return words[ index % 2 ];
+}
+
+#if defined(__SSE2__)
+/* hi and lo halves of the 32 x 32 bit products of four lanes by m */
+static inline void
+philox_mulhilo4 ( const __m128i x, const __m128i m, __m128i *hi, __m128i *lo )
+{
+  const __m128i low_mask = _mm_set1_epi64x( 0xffffffff );
+  const __m128i even = _mm_mul_epu32( x, m );                       /* lanes 0, 2 */
+  const __m128i odd  = _mm_mul_epu32( _mm_srli_epi64( x, 32 ), m ); /* lanes 1, 3 */
+
+  *lo = _mm_or_si128( _mm_and_si128( even, low_mask ), _mm_slli_epi64( odd, 32 ) );
+  *hi = _mm_or_si128( _mm_srli_epi64( even, 32 ), _mm_andnot_si128( low_mask, odd ) );
+}
+
+/* four consecutive blocks at once, one per lane, written out in order */
+static void
+philox_block4 ( const uint64_t seed, const uint64_t stream, const uint64_t block,
+                uint32_t out[16] )
+{
+  /* lanes only differ in the block counter, which can carry into x1 */
+  uint32_t lo[4], hi[4];
+  for ( int lane = 0; lane < 4; ++lane ) {
+    lo[lane] = (uint32_t) ( block + lane );
+    hi[lane] = (uint32_t) ( ( block + lane ) >> 32 );
+  }
+
+  __m128i x0 = _mm_loadu_si128( (const __m128i *) lo );
+  __m128i x1 = _mm_loadu_si128( (const __m128i *) hi );
+  __m128i x2 = _mm_set1_epi32( (int) (uint32_t) stream );
+  __m128i x3 = _mm_set1_epi32( (int) (uint32_t) ( stream >> 32 ) );
+  const __m128i m0 = _mm_set1_epi32( (int) PHILOX_M0 );
+  const __m128i m1 = _mm_set1_epi32( (int) PHILOX_M1 );
+  uint32_t k0 = (uint32_t) seed, k1 = (uint32_t) ( seed >> 32 );
+
+  for ( int round = 0; round < PHILOX_ROUNDS; ++round ) {
+    __m128i hi0, lo0, hi1, lo1;
+    philox_mulhilo4( x0, m0, &hi0, &lo0 );
+    philox_mulhilo4( x2, m1, &hi1, &lo1 );
+    x0 = _mm_xor_si128( _mm_xor_si128( hi1, x1 ), _mm_set1_epi32( (int) k0 ) );
+    x2 = _mm_xor_si128( _mm_xor_si128( hi0, x3 ), _mm_set1_epi32( (int) k1 ) );
+    x1 = lo1;
+    x3 = lo0;
+    k0 += PHILOX_W0;
+    k1 += PHILOX_W1;
+  }
+
+  /* 4 x 4 transpose from one word per register to one block per row */
+  const __m128i t0 = _mm_unpacklo_epi32( x0, x1 ), t1 = _mm_unpacklo_epi32( x2, x3 );
+  const __m128i t2 = _mm_unpackhi_epi32( x0, x1 ), t3 = _mm_unpackhi_epi32( x2, x3 );
+  _mm_storeu_si128( (__m128i *) out,        _mm_unpacklo_epi64( t0, t1 ) );
+  _mm_storeu_si128( (__m128i *) ( out + 4 ),  _mm_unpackhi_epi64( t0, t1 ) );
+  _mm_storeu_si128( (__m128i *) ( out + 8 ),  _mm_unpacklo_epi64( t2, t3 ) );
+  _mm_storeu_si128( (__m128i *) ( out + 12 ), _mm_unpackhi_epi64( t2, t3 ) );
+}
+#endif
+
+void
+rng_fill_uniform ( const uint64_t seed, const uint64_t stream, double *out,
+                   const size_t n, const double lo, const double hi )
+{
+  const double scale = hi - lo;
+  uint32_t blocks[ RNG_BULK_BLOCKS * 4 ];
+  uint64_t block = 0;
+
+  for ( size_t done = 0; done < n; ) {
+    /* two uniforms per block */
+    size_t count = ( n - done + 1 ) / 2;
+    if ( count > RNG_BULK_BLOCKS )
+      count = RNG_BULK_BLOCKS;
+
+    size_t b = 0;
+#if defined(__SSE2__)
+    for ( ; b + 4 <= count; b += 4 )
+      philox_block4( seed, stream, block + b, blocks + b * 4 );
+#endif
+    for ( ; b < count; ++b )
+      philox_block( seed, stream, block + b, blocks + b * 4 );
+
+    for ( b = 0; b < count && done < n; ++b ) {
+      uint64_t words[2];
+      rng_words( blocks + b * 4, words );
+      out[ done++ ] = lo + scale * rng_to_unit( words[0] );
+      if ( done < n )
+        out[ done++ ] = lo + scale * rng_to_unit( words[1] );
+    }
+
+    block += count;
+  }
+}
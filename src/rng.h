@@ -0,0 +1,45 @@
+#ifndef RNG_HEADER
+#define RNG_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* what a stream is drawn for. the purpose and an index (layer, epoch, ...)
+   make the stream id, so consumers of one seed never see the same numbers */
+typedef enum {
+  RNG_WEIGHTS = 1,       /* index: layer */
+  RNG_SHUFFLE,           /* index: epoch */
+  RNG_AUGMENT            /* index: epoch, drawn at the sample's position */
+} RngPurpose;
+
+#define RNG_STREAM( purpose, index ) ( ( (uint64_t) (purpose) << 48 ) | (uint64_t) (index) )
+
+/* counter-based generator (Philox4x32-10). block i of a stream is a pure
+   function of (seed, stream, i), so there is no shared state to lock:
+   every thread, sample or layer takes its own stream or jumps straight to
+   the block it needs, and the numbers don't depend on who draws them or in
+   which order. each block gives two 64-bit words */
+typedef struct {
+  uint64_t seed, stream;
+  uint64_t counter;      /* next block */
+  uint64_t buffer[2];
+  unsigned available;    /* words of buffer not handed out yet */
+} Rng;
+
+Rng      rng_stream  ( const uint64_t seed, const uint64_t stream );
+uint64_t rng_next    ( Rng *rng );
+/* uniform in [0, 1) with 53 random bits */
+double   rng_uniform ( Rng *rng );
+/* uniform in [0, n) without modulo bias, n > 0 */
+uint64_t rng_below   ( Rng *rng, const uint64_t n );
+
+/* word index of a stream, without drawing everything before it */
+uint64_t rng_at ( const uint64_t seed, const uint64_t stream, const uint64_t index );
+
+/* the first n uniforms of a stream scaled to [lo, hi), the same values
+   rng_uniform would give one at a time. blocks are generated several at a
+   time with SSE2 where it's available */
+void rng_fill_uniform ( const uint64_t seed, const uint64_t stream, double *out,
+                        const size_t n, const double lo, const double hi );
+
+#endif
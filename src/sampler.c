@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rng.h"
+#include "sampler.h"
+
+/* how many samples ahead the gather loop prefetches. the Sample struct is
+   fetched twice as far ahead so its image pointer is ready in time */
+#define SAMPLER_PREFETCH_DISTANCE 4
+
+/* fisher-yates over the global sample index, seeded per epoch */
+static void
+sampler_shuffle ( Sampler *sampler, const size_t epoch )
+{
+  Rng rng = rng_stream( sampler->seed, RNG_STREAM( RNG_SHUFFLE, epoch ) );
+
+  for ( size_t i = 0; i < sampler->num_samples; ++i )
+    sampler->permutation[i] = i;
+
+  for ( size_t i = sampler->num_samples; i > 1; --i ) {
+    size_t j = rng_below( &rng, i );
+    size_t tmp = sampler->permutation[i - 1];
+    sampler->permutation[i - 1] = sampler->permutation[j];
+    sampler->permutation[j] = tmp;
+  }
+}
+
+static void
+sampler_gather ( Sampler *sampler, const size_t index, MiniBatch *slot )
+{
+  const size_t begin = index * sampler->batch_size;
+  const size_t count = begin + sampler->batch_size < sampler->num_samples ?
+                       sampler->batch_size : sampler->num_samples - begin;
+  const size_t *order = sampler->permutation + begin;
+  const size_t row_bytes = sizeof(double) * sampler->image_size;
+
+  for ( size_t i = 0; i < count; ++i ) {
+    if ( i + 2 * SAMPLER_PREFETCH_DISTANCE < count )
+      __builtin_prefetch( sampler->samples[ order[i + 2 * SAMPLER_PREFETCH_DISTANCE] ] );
+    if ( i + SAMPLER_PREFETCH_DISTANCE < count ) {
+      const double *ahead = sampler->samples[ order[i + SAMPLER_PREFETCH_DISTANCE] ]->image;
+      __builtin_prefetch( ahead );
+      __builtin_prefetch( ahead + 8 );
+    }
+
+    const Sample *sample = sampler->samples[ order[i] ];
+    double *staged = slot->images + i * sampler->image_size;
+    if ( sampler->augment ) {
+      /* keyed on the position in the epoch so it doesn't matter which
+         loader thread stages the sample */
+      const uint64_t bits = rng_at( sampler->seed, RNG_STREAM( RNG_AUGMENT, sampler->epoch ),
+                                    begin + i );
+      augment_image( sampler->augment, sample->image, staged, bits );
+    } else
+      memcpy( staged, sample->image, row_bytes );
+    slot->labels[i] = sample->label;
+  }
+
+  slot->count = count;
+  slot->index = index;
+}
+
+static void *
+sampler_worker ( void *arg )
+{
+  Sampler *sampler = arg;
+
+  pthread_mutex_lock( &sampler->lock );
+  for (;;) {
+    /* wait for a batch to stage and a free slot to stage it in */
+    while ( !sampler->shutdown &&
+            ( sampler->next_fill >= sampler->num_batches ||
+              sampler->next_fill >= sampler->released + SAMPLER_DEPTH ) )
+      pthread_cond_wait( &sampler->freed, &sampler->lock );
+    if ( sampler->shutdown )
+      break;
+
+    size_t index = sampler->next_fill++;
+    MiniBatch *slot = &sampler->slots[ index % SAMPLER_DEPTH ];
+    ++sampler->in_flight;
+    pthread_mutex_unlock( &sampler->lock );
+
+    sampler_gather( sampler, index, slot );
+
+    pthread_mutex_lock( &sampler->lock );
+    slot->ready = true;
+    --sampler->in_flight;
+    pthread_cond_broadcast( &sampler->filled );
+  }
+  pthread_mutex_unlock( &sampler->lock );
+
+  return NULL;
+}
+
+Sampler *
+sampler_new ( Dataset *dataset, const size_t batch_size,
+              const size_t num_workers, const uint64_t seed,
+              const AugmentConfig *augment )
+{
+  Sampler *new = calloc( 1, sizeof(Sampler) );
+  new->image_size = dataset->image_size;
+  new->batch_size = batch_size ? batch_size : 1;
+  new->seed       = seed;
+  new->augment    = augment;
+
+  if ( augment && augment->width * augment->height * augment->channels != new->image_size ) {
+    fprintf( stderr, "augmentation expects %zu x %zu x %zu images, dataset has %zu values\n",
+             augment->channels, augment->height, augment->width, new->image_size );
+    new->augment = NULL;
+  }
+
+  /* global index over every training sample */
+  for ( size_t b = 0; b < dataset->train_batches_len; ++b )
+    if ( dataset->train_batches[b] )
+      new->num_samples += dataset->train_batches[b]->num_samples;
+
+  new->samples     = malloc( new->num_samples * sizeof(Sample *) );
+  new->permutation = malloc( new->num_samples * sizeof(size_t) );
+
+  size_t count = 0;
+  for ( size_t b = 0; b < dataset->train_batches_len; ++b ) {
+    Batch *batch = dataset->train_batches[b];
+    for ( size_t i = 0; batch && i < batch->num_samples; ++i )
+      new->samples[count++] = batch->samples[i];
+  }
+
+  new->num_batches = ( new->num_samples + new->batch_size - 1 ) / new->batch_size;
+
+  for ( size_t i = 0; i < SAMPLER_DEPTH; ++i ) {
+    new->slots[i].images = malloc( new->batch_size * new->image_size * sizeof(double) );
+    new->slots[i].labels = malloc( new->batch_size * sizeof(size_t) );
+  }
+
+  /* no epoch is staged until sampler_begin_epoch */
+  new->next_fill = new->num_batches;
+
+  pthread_mutex_init( &new->lock, NULL );
+  pthread_cond_init( &new->filled, NULL );
+  pthread_cond_init( &new->freed, NULL );
+
+  new->workers = calloc( num_workers ? num_workers : 1, sizeof(pthread_t) );
+  for ( size_t i = 0; i < ( num_workers ? num_workers : 1 ); ++i ) {
+    if ( pthread_create( &new->workers[i], NULL, sampler_worker, new ) != 0 ) {
+      perror( "Failed to start sampler thread" );
+      break;
+    }
+    ++new->num_workers;
+  }
+
+  if ( new->num_workers == 0 ) {
+    fprintf( stderr, "sampler has no loader threads\n" );
+    sampler_destroy( &new );
+  }
+
+  return new;
+}
+
+void
+sampler_destroy ( Sampler **samplerptr )
+{
+  if ( samplerptr && *samplerptr ) {
+    Sampler *sampler = *samplerptr;
+
+    pthread_mutex_lock( &sampler->lock );
+    sampler->shutdown = true;
+    pthread_cond_broadcast( &sampler->freed );
+    pthread_mutex_unlock( &sampler->lock );
+
+    for ( size_t i = 0; i < sampler->num_workers; ++i )
+      pthread_join( sampler->workers[i], NULL );
+
+    for ( size_t i = 0; i < SAMPLER_DEPTH; ++i ) {
+      free( sampler->slots[i].images );
+      free( sampler->slots[i].labels );
+    }
+
+    pthread_mutex_destroy( &sampler->lock );
+    pthread_cond_destroy( &sampler->filled );
+    pthread_cond_destroy( &sampler->freed );
+
+    free( sampler->workers );
+    free( sampler->samples );
+    free( sampler->permutation );
+    free( sampler );
+    *samplerptr = NULL;
+  }
+}
+
+void
+sampler_begin_epoch ( Sampler *sampler, const size_t epoch )
+{
+  pthread_mutex_lock( &sampler->lock );
+
+  /* stop handing out the old epoch and let in-flight gathers land */
+  sampler->next_fill = sampler->num_batches;
+  while ( sampler->in_flight > 0 )
+    pthread_cond_wait( &sampler->filled, &sampler->lock );
+
+  sampler_shuffle( sampler, epoch );
+  sampler->epoch = epoch;
+
+  for ( size_t i = 0; i < SAMPLER_DEPTH; ++i )
+    sampler->slots[i].ready = false;
+  sampler->next_fill    = 0;
+  sampler->next_consume = 0;
+  sampler->released     = 0;
+
+  pthread_cond_broadcast( &sampler->freed );
+  pthread_mutex_unlock( &sampler->lock );
+}
+
+MiniBatch *
+sampler_next ( Sampler *sampler )
+{
+  pthread_mutex_lock( &sampler->lock );
+
+  if ( sampler->next_consume >= sampler->num_batches ) {
+    pthread_mutex_unlock( &sampler->lock );
+    return NULL;
+  }
+
+  size_t index = sampler->next_consume++;
+  MiniBatch *slot = &sampler->slots[ index % SAMPLER_DEPTH ];
+  while ( !( slot->ready && slot->index == index ) )
+    pthread_cond_wait( &sampler->filled, &sampler->lock );
+
+  pthread_mutex_unlock( &sampler->lock );
+  return slot;
+}
+
+void
+sampler_release ( Sampler *sampler, MiniBatch *batch )
+{
+  pthread_mutex_lock( &sampler->lock );
+  batch->ready = false;
+  ++sampler->released;
+  pthread_cond_broadcast( &sampler->freed );
+  pthread_mutex_unlock( &sampler->lock );
+}
@@ -0,0 +1,58 @@
+#ifndef SAMPLER_HEADER
+#define SAMPLER_HEADER
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "augment.h"
+#include "dataset.h"
+
+/* number of mini-batches staged ahead of the training loop */
+#define SAMPLER_DEPTH 2
+
+/* one shuffled mini-batch, gathered into contiguous staging memory */
+typedef struct {
+  double *images;   /* count x image_size */
+  size_t *labels;
+  size_t count, index;
+  bool ready;
+} MiniBatch;
+
+/* shuffled mini-batch sampler. every epoch draws a fresh permutation over a
+   global index of the training samples (nothing is copied to shuffle), and
+   loader threads gather the upcoming mini-batches into a ring of staging
+   buffers while the current one is being trained on. with an AugmentConfig
+   the loader threads also augment each sample as they stage it. */
+typedef struct {
+  Sample **samples;       /* every training sample, in file order */
+  size_t *permutation;
+  size_t num_samples, image_size, batch_size, num_batches;
+  uint64_t seed;
+  size_t epoch;
+  const AugmentConfig *augment;  /* borrowed, NULL disables augmentation */
+
+  MiniBatch slots[ SAMPLER_DEPTH ];
+  size_t next_fill, next_consume, released, in_flight;
+
+  pthread_t *workers;
+  size_t num_workers;
+  bool shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t filled, freed;
+} Sampler;
+
+Sampler *sampler_new     ( Dataset *dataset, const size_t batch_size,
+                           const size_t num_workers, const uint64_t seed,
+                           const AugmentConfig *augment );
+void     sampler_destroy ( Sampler **sampler );
+
+/* reshuffles and starts staging the epoch's first mini-batches. anything
+   still staged from the previous epoch is dropped */
+void sampler_begin_epoch ( Sampler *sampler, const size_t epoch );
+
+/* next mini-batch in order (blocks until it is staged), NULL once the epoch
+   is exhausted. hand it back with sampler_release as soon as it's consumed */
+MiniBatch *sampler_next    ( Sampler *sampler );
+void       sampler_release ( Sampler *sampler, MiniBatch *batch );
+
+#endif
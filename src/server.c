@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <poll.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "util.h"
+
+#define SERVER_MAX_CLIENTS 64
+
+typedef struct {
+  int in_fd, out_fd;   /* -1 when the slot is free */
+  uint8_t *record;     /* partially received record */
+  size_t filled, requests;
+} Client;
+
+typedef struct {
+  size_t client, id;
+  double arrival;
+} Request;
+
+typedef struct {
+  Model *model;
+  char **label_map;
+  ServerConfig config;
+  size_t record_size;
+
+  int listen_fd;
+  Client clients[SERVER_MAX_CLIENTS];
+
+  /* pending micro-batch */
+  Request *queue;
+  size_t queued;
+  double *images;
+
+  /* scratch for scoring and responses: the batch's logits and the
+     probabilities of the top k */
+  ModelWorkspace *workspace;
+  float *logits, *scores;
+  size_t *top;
+  char *response;
+  size_t response_cap;
+
+  /* per-request latency in microseconds */
+  double *latencies;
+  size_t latencies_len, latencies_cap, batches;
+  double first_arrival, last_done;
+} Server;
+
+static volatile sig_atomic_t server_running = 1;
+
+static void
+server_stop ( int signum )
+{
+  (void) signum;
+  server_running = 0;
+}
+
+ServerConfig
+server_default_config ( void )
+{
+  return (ServerConfig) {
+    .socket_path     = NULL,
+    .top_k           = 3,
+    .max_batch       = 64,
+    .batch_window_us = 2000,
+    .temperature     = 1.0f
+  };
+}
+
+/* insertion into a k-long sorted list, classes that can't beat the current
+   k-th best exit after a single compare. run on the logits, softmax keeps
+   their order */
+static size_t
+top_k_select ( const float *scores, const size_t len, const size_t k, size_t *out )
+{
+  size_t n = 0;
+  for ( size_t i = 0; i < len; ++i ) {
+    if ( n == k && scores[i] <= scores[ out[n - 1] ] )
+      continue;
+
+    size_t pos = n < k ? n++ : k - 1;
+    while ( pos > 0 && scores[ out[pos - 1] ] < scores[i] ) {
+      out[pos] = out[pos - 1];
+      --pos;
+    }
+    out[pos] = i;
+  }
+  return n;
+}
+
+static bool
+write_all ( int fd, const char *buf, size_t len )
+{
+  while ( len > 0 ) {
+    ssize_t n = write( fd, buf, len );
+    if ( n < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      return false;
+    }
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+static void
+server_close_client ( Server *server, size_t index )
+{
+  Client *client = &server->clients[index];
+
+  if ( client->filled > 0 )
+    fprintf( stderr, "dropping partial record (%zu/%zu bytes)\n",
+             client->filled, server->record_size );
+
+  /* stdin mode shares fds with the process, don't close those */
+  if ( client->in_fd > STDERR_FILENO )
+    close( client->in_fd );
+
+  free( client->record );
+  *client = (Client) { .in_fd = -1, .out_fd = -1 };
+}
+
+static void
+server_record_latency ( Server *server, double latency_us )
+{
+  if ( server->latencies_len == server->latencies_cap ) {
+    server->latencies_cap = server->latencies_cap ? server->latencies_cap * 2 : 1024;
+    server->latencies = realloc( server->latencies,
+                                 server->latencies_cap * sizeof(double) );
+  }
+  server->latencies[ server->latencies_len++ ] = latency_us;
+}
+
+static void
+server_flush ( Server *server )
+{
+  if ( server->queued == 0 )
+    return;
+
+  Model *model = server->model;
+  const size_t num_classes = model->num_classes;
+  const float inv_temperature = 1.0f / server->config.temperature;
+
+  /* one product for the whole micro-batch */
+  model_logits_batch( model, server->workspace, server->images, server->queued,
+                      server->logits );
+
+  for ( size_t r = 0; r < server->queued; ++r ) {
+    Request *request = &server->queue[r];
+    Client *client = &server->clients[ request->client ];
+    const float *logits = server->logits + r * num_classes;
+
+    size_t k = top_k_select( logits, num_classes, server->config.top_k, server->top );
+
+    /* temperature-scaled softmax, only the k winners need dividing out */
+    const float max = logits[ server->top[0] ];
+    float sum = 0.0f;
+    for ( size_t c = 0; c < num_classes; ++c )
+      sum += expf( ( logits[c] - max ) * inv_temperature );
+    for ( size_t i = 0; i < k; ++i )
+      server->scores[i] = expf( ( logits[ server->top[i] ] - max ) * inv_temperature ) / sum;
+
+    size_t len = snprintf( server->response, server->response_cap, "%zu", request->id );
+    for ( size_t i = 0; i < k; ++i )
+      len += snprintf( server->response + len, server->response_cap - len, " %s:%.4f",
+                       server->label_map[ server->top[i] ],
+                       server->scores[i] );
+    len += snprintf( server->response + len, server->response_cap - len, "\n" );
+
+    if ( client->out_fd >= 0 && !write_all( client->out_fd, server->response, len ) )
+      server_close_client( server, request->client );
+
+    double done = now_seconds();
+    server_record_latency( server, ( done - request->arrival ) * 1e6 );
+    server->last_done = done;
+  }
+
+  server->queued = 0;
+  ++server->batches;
+}
+
+static void
+server_enqueue ( Server *server, size_t index )
+{
+  Client *client = &server->clients[index];
+  double *image = server->images + server->queued * server->model->image_size;
+
+  /* skip the label byte, scale the same way the CIFAR loader does */
+  for ( size_t i = 0; i < server->model->image_size; ++i )
+    image[i] = (double) client->record[i + 1] / 255.0;
+
+  double arrival = now_seconds();
+  if ( server->first_arrival == 0 )
+    server->first_arrival = arrival;
+
+  server->queue[ server->queued++ ] = (Request) {
+    .client  = index,
+    .id      = client->requests++,
+    .arrival = arrival
+  };
+  client->filled = 0;
+
+  if ( server->queued == server->config.max_batch )
+    server_flush( server );
+}
+
+static bool
+server_add_client ( Server *server, int in_fd, int out_fd )
+{
+  for ( size_t i = 0; i < SERVER_MAX_CLIENTS; ++i )
+    if ( server->clients[i].in_fd < 0 ) {
+      server->clients[i] = (Client) {
+        .in_fd  = in_fd,
+        .out_fd = out_fd,
+        .record = malloc( server->record_size )
+      };
+      return true;
+    }
+
+  return false;
+}
+
+static void
+server_read_client ( Server *server, size_t index )
+{
+  Client *client = &server->clients[index];
+  ssize_t n = read( client->in_fd, client->record + client->filled,
+                    server->record_size - client->filled );
+
+  if ( n < 0 && ( errno == EINTR || errno == EAGAIN ) )
+    return;
+
+  if ( n <= 0 ) {
+    /* answer everything still queued before the client goes away */
+    server_flush( server );
+    server_close_client( server, index );
+    return;
+  }
+
+  client->filled += n;
+  if ( client->filled == server->record_size )
+    server_enqueue( server, index );
+}
+
+static int
+server_listen ( const char *path )
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if ( strlen(path) >= sizeof(addr.sun_path) ) {
+    fprintf( stderr, "socket path '%s' is too long\n", path );
+    return -1;
+  }
+  strcpy( addr.sun_path, path );
+
+  int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if ( fd < 0 ) {
+    perror( "Failed to create socket" );
+    return -1;
+  }
+
+  unlink( path );
+  if ( bind( fd, (struct sockaddr *) &addr, sizeof(addr) ) < 0 ||
+       listen( fd, SERVER_MAX_CLIENTS ) < 0 ) {
+    perror( "Failed to listen on socket" );
+    close( fd );
+    return -1;
+  }
+
+  return fd;
+}
+
+static int
+compare_doubles ( const void *a, const void *b )
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return ( x > y ) - ( x < y );
+}
+
+static double
+percentile ( const double *sorted, const size_t len, const double p )
+{
+  /* nearest rank: the smallest value with at least p of them at or below it */
+  const double rank = ceil( p * len - 1e-9 );  /* 0.07 * 100 isn't quite 7 */
+  const size_t index = rank > 1.0 ? (size_t) rank - 1 : 0;
+  return sorted[ index < len ? index : len - 1 ];
+}
+
+static void
+server_report ( Server *server )
+{
+  size_t n = server->latencies_len;
+  if ( n == 0 ) {
+    fprintf( stderr, "served 0 requests\n" );
+    return;
+  }
+
+  qsort( server->latencies, n, sizeof(double), compare_doubles );
+
+  double elapsed = server->last_done - server->first_arrival;
+  fprintf( stderr, "served %zu requests in %zu batches (avg batch %.1f)\n",
+           n, server->batches, n / (double) server->batches );
+  fprintf( stderr, "latency p50: %.1f us, p99: %.1f us, max: %.1f us\n",
+           percentile( server->latencies, n, 0.50 ),
+           percentile( server->latencies, n, 0.99 ),
+           server->latencies[n - 1] );
+  fprintf( stderr, "throughput: %.1f req/s\n", elapsed > 0 ? n / elapsed : 0.0 );
+}
+
+int
+model_serve ( Model *model, char **label_map, const ServerConfig *config )
+{
+  if ( config->top_k == 0 || config->max_batch == 0 || config->temperature <= 0 ) {
+    fprintf( stderr, "invalid server config: top_k, max_batch and temperature must be positive\n" );
+    return 1;
+  }
+
+  Server *server = calloc( 1, sizeof(Server) );
+  server->model       = model;
+  server->label_map   = label_map;
+  server->config      = *config;
+  server->record_size = 1 + model->image_size;
+  server->listen_fd   = -1;
+
+  if ( server->config.top_k > model->num_classes )
+    server->config.top_k = model->num_classes;
+
+  for ( size_t i = 0; i < SERVER_MAX_CLIENTS; ++i )
+    server->clients[i] = (Client) { .in_fd = -1, .out_fd = -1 };
+
+  size_t longest_label = 0;
+  for ( size_t i = 0; i < model->num_classes; ++i )
+    if ( strlen( label_map[i] ) > longest_label )
+      longest_label = strlen( label_map[i] );
+
+  server->queue        = calloc( server->config.max_batch, sizeof(Request) );
+  server->images       = calloc( server->config.max_batch * model->image_size, sizeof(double) );
+  server->workspace    = model->packed_valid ? NULL :
+                         model_workspace_new( model, server->config.max_batch );
+  server->logits       = calloc( server->config.max_batch * model->num_classes, sizeof(float) );
+  server->scores       = calloc( server->config.top_k, sizeof(float) );
+  server->top          = calloc( server->config.top_k, sizeof(size_t) );
+  server->response_cap = 32 + server->config.top_k * ( longest_label + 16 );
+  server->response     = malloc( server->response_cap );
+
+  struct sigaction action = { .sa_handler = server_stop };
+  sigaction( SIGINT,  &action, NULL );
+  sigaction( SIGTERM, &action, NULL );
+  signal( SIGPIPE, SIG_IGN );
+
+  int status = 0;
+  if ( config->socket_path ) {
+    server->listen_fd = server_listen( config->socket_path );
+    if ( server->listen_fd < 0 )
+      status = 1;
+    else
+      fprintf( stderr, "serving on unix socket '%s'\n", config->socket_path );
+  } else
+    server_add_client( server, STDIN_FILENO, STDOUT_FILENO );
+
+  const double window = config->batch_window_us * 1e-6;
+  struct pollfd fds[ SERVER_MAX_CLIENTS + 1 ];
+  size_t fd_client[ SERVER_MAX_CLIENTS + 1 ];
+
+  while ( status == 0 && server_running ) {
+    nfds_t nfds = 0;
+    if ( server->listen_fd >= 0 )
+      fds[nfds++] = (struct pollfd) { .fd = server->listen_fd, .events = POLLIN };
+    for ( size_t i = 0; i < SERVER_MAX_CLIENTS; ++i )
+      if ( server->clients[i].in_fd >= 0 ) {
+        fd_client[nfds] = i;
+        fds[nfds++] = (struct pollfd) { .fd = server->clients[i].in_fd, .events = POLLIN };
+      }
+
+    if ( nfds == 0 )
+      break;
+
+    /* only wait as long as the oldest queued request allows */
+    struct timespec timeout, *timeout_ptr = NULL;
+    if ( server->queued > 0 ) {
+      double remaining = window - ( now_seconds() - server->queue[0].arrival );
+      if ( remaining <= 0 ) {
+        server_flush( server );
+        continue;
+      }
+      timeout.tv_sec  = (time_t) remaining;
+      timeout.tv_nsec = (long) ( ( remaining - timeout.tv_sec ) * 1e9 );
+      timeout_ptr = &timeout;
+    }
+
+    if ( ppoll( fds, nfds, timeout_ptr, NULL ) < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      perror( "poll failed" );
+      status = 1;
+      break;
+    }
+
+    for ( nfds_t i = 0; i < nfds; ++i ) {
+      if ( !fds[i].revents )
+        continue;
+
+      if ( fds[i].fd == server->listen_fd ) {
+        int fd = accept( server->listen_fd, NULL, NULL );
+        if ( fd >= 0 && !server_add_client( server, fd, fd ) ) {
+          fprintf( stderr, "too many clients, rejecting connection\n" );
+          close( fd );
+        }
+      } else
+        server_read_client( server, fd_client[i] );
+    }
+
+    if ( server->queued > 0 && now_seconds() - server->queue[0].arrival >= window )
+      server_flush( server );
+  }
+
+  server_flush( server );
+  for ( size_t i = 0; i < SERVER_MAX_CLIENTS; ++i )
+    if ( server->clients[i].in_fd >= 0 )
+      server_close_client( server, i );
+
+  if ( server->listen_fd >= 0 ) {
+    close( server->listen_fd );
+    unlink( config->socket_path );
+  }
+
+  server_report( server );
+
+  free( server->queue );
+  free( server->images );
+  model_workspace_destroy( &server->workspace );
+  free( server->logits );
+  free( server->scores );
+  free( server->top );
+  free( server->response );
+  free( server->latencies );
+  free( server );
+
+  return status;
+}
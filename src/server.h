@@ -0,0 +1,30 @@
+#ifndef SERVER_HEADER
+#define SERVER_HEADER
+
+#include <stddef.h>
+#include "model.h"
+
+/* long-running batch inference over stdin/stdout or a local unix socket.
+
+   requests are raw CIFAR records (1 label byte + image_size pixel bytes, the
+   label byte is ignored), responses are one text line per request:
+
+     <request #> <label>:<score> <label>:<score> ...
+
+   records that arrive within 'batch_window_us' of the first queued record are
+   scored together (up to 'max_batch' at a time) by model_logits_batch. */
+typedef struct {
+  const char *socket_path;      /* NULL serves stdin -> stdout */
+  size_t top_k, max_batch;
+  unsigned int batch_window_us;
+  float temperature;            /* softmax temperature, model_fit_temperature
+                                   fits one for calibrated scores */
+} ServerConfig;
+
+ServerConfig server_default_config ( void );
+
+/* blocks until stdin closes (or SIGINT/SIGTERM in socket mode), then prints
+   the latency/throughput summary to stderr. returns 0 on a clean shutdown. */
+int model_serve ( Model *model, char **label_map, const ServerConfig *config );
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sparse.h"
+#include "threadpool.h"
+
+/* rows in CSR, columns in CSC */
+static size_t
+sparse_major ( const SparseTensor2D *t )
+{
+  return t->format == SPARSE_CSR ? t->rows : t->cols;
+}
+
+static size_t
+sparse_minor ( const SparseTensor2D *t )
+{
+  return t->format == SPARSE_CSR ? t->cols : t->rows;
+}
+
+static SparseFormat
+sparse_other ( const SparseFormat format )
+{
+  return format == SPARSE_CSR ? SPARSE_CSC : SPARSE_CSR;
+}
+
+/* basic operations */
+SparseTensor2D *
+SparseTensor2D_create ( const size_t rows, const size_t cols, const size_t nnz,
+                        const SparseFormat format )
+{
+  SparseTensor2D *t = malloc( sizeof(SparseTensor2D) );
+  t->format   = format;
+  t->rows     = rows;
+  t->cols     = cols;
+  t->nnz      = nnz;
+  t->pointers = calloc( sparse_major( t ) + 1, sizeof(size_t) );
+  t->indices  = malloc( ( nnz ? nnz : 1 ) * sizeof(size_t) );
+  t->values   = malloc( ( nnz ? nnz : 1 ) * sizeof(double) );
+  return t;
+}
+
+void
+SparseTensor2D_destroy ( SparseTensor2D **t )
+{
+  if ( t && *t ) {
+    free( (*t)->pointers );
+    free( (*t)->indices );
+    free( (*t)->values );
+    free( *t );
+    *t = NULL;
+  }
+}
+
+/* the same matrix compressed the other way round, by a counting sort over
+   the minor indices. walking the majors in order leaves every new slice
+   sorted, and duplicates of an entry next to each other */
+static SparseTensor2D *
+sparse_recompress ( const SparseTensor2D *t )
+{
+  SparseTensor2D *out = SparseTensor2D_create( t->rows, t->cols, t->nnz,
+                                               sparse_other( t->format ) );
+  const size_t major = sparse_major( t ), minor = sparse_minor( t );
+
+  for ( size_t e = 0; e < t->nnz; ++e )
+    ++out->pointers[ t->indices[e] + 1 ];
+  for ( size_t m = 0; m < minor; ++m )
+    out->pointers[ m + 1 ] += out->pointers[m];
+
+  size_t *next = malloc( ( minor ? minor : 1 ) * sizeof(size_t) );
+  memcpy( next, out->pointers, minor * sizeof(size_t) );
+
+  for ( size_t m = 0; m < major; ++m )
+    for ( size_t e = t->pointers[m]; e < t->pointers[ m + 1 ]; ++e ) {
+      const size_t slot = next[ t->indices[e] ]++;
+      out->indices[slot] = m;
+      out->values[slot]  = t->values[e];
+    }
+
+  free( next );
+  return out;
+}
+
+/* sums adjacent duplicates and drops zeros, in place */
+static void
+sparse_compact ( SparseTensor2D *t )
+{
+  const size_t major = sparse_major( t );
+  size_t kept = 0, e = 0;
+
+  for ( size_t m = 0; m < major; ++m ) {
+    const size_t end = t->pointers[ m + 1 ];
+    t->pointers[m] = kept;
+
+    while ( e < end ) {
+      const size_t index = t->indices[e];
+      double sum = 0.0;
+      for ( ; e < end && t->indices[e] == index; ++e )
+        sum += t->values[e];
+
+      if ( sum != 0.0 ) {
+        t->indices[kept] = index;
+        t->values[kept]  = sum;
+        ++kept;
+      }
+    }
+  }
+
+  t->pointers[ major ] = kept;
+  t->nnz = kept;
+}
+
+SparseTensor2D *
+SparseTensor2D_convert ( const SparseTensor2D *t, const SparseFormat format )
+{
+  if ( format != t->format )
+    return sparse_recompress( t );
+
+  SparseTensor2D *copy = SparseTensor2D_create( t->rows, t->cols, t->nnz, format );
+  memcpy( copy->pointers, t->pointers, ( sparse_major( t ) + 1 ) * sizeof(size_t) );
+  memcpy( copy->indices, t->indices, t->nnz * sizeof(size_t) );
+  memcpy( copy->values, t->values, t->nnz * sizeof(double) );
+  return copy;
+}
+
+/* building */
+SparseTensor2D *
+SparseTensor2D_from_triplets ( const size_t rows, const size_t cols,
+                               const size_t *row_indices, const size_t *col_indices,
+                               const double *values, const size_t len,
+                               const SparseFormat format )
+{
+  for ( size_t i = 0; i < len; ++i )
+    if ( row_indices[i] >= rows || col_indices[i] >= cols ) {
+      fprintf( stderr, "triplet %zu at (%zu, %zu) is outside a %zu x %zu matrix\n",
+               i, row_indices[i], col_indices[i], rows, cols );
+      return NULL;
+    }
+
+  /* bucket the triplets by row as they come... */
+  SparseTensor2D *unsorted = SparseTensor2D_create( rows, cols, len, SPARSE_CSR );
+  for ( size_t i = 0; i < len; ++i )
+    ++unsorted->pointers[ row_indices[i] + 1 ];
+  for ( size_t r = 0; r < rows; ++r )
+    unsorted->pointers[ r + 1 ] += unsorted->pointers[r];
+
+  size_t *next = malloc( ( rows ? rows : 1 ) * sizeof(size_t) );
+  memcpy( next, unsorted->pointers, rows * sizeof(size_t) );
+  for ( size_t i = 0; i < len; ++i ) {
+    const size_t slot = next[ row_indices[i] ]++;
+    unsorted->indices[slot] = col_indices[i];
+    unsorted->values[slot]  = values[i];
+  }
+  free( next );
+
+  /* ...then one recompression sorts every column, where duplicates end up
+     side by side, and a second one (for CSR) sorts every row */
+  SparseTensor2D *csc = sparse_recompress( unsorted );
+  SparseTensor2D_destroy( &unsorted );
+  sparse_compact( csc );
+
+  if ( format == SPARSE_CSC )
+    return csc;
+
+  SparseTensor2D *csr = sparse_recompress( csc );
+  SparseTensor2D_destroy( &csc );
+  return csr;
+}
+
+SparseTensor2D *
+SparseTensor2D_from_dense ( Tensor2D *t, const SparseFormat format )
+{
+  size_t nnz = 0;
+  for ( size_t i = 0; i < t->rows * t->cols; ++i )
+    nnz += t->data[i] != 0.0;
+
+  SparseTensor2D *csr = SparseTensor2D_create( t->rows, t->cols, nnz, SPARSE_CSR );
+  size_t e = 0;
+  for ( size_t r = 0; r < t->rows; ++r ) {
+    const double *row = t->data + r * t->cols;
+    for ( size_t c = 0; c < t->cols; ++c )
+      if ( row[c] != 0.0 ) {
+        csr->indices[e] = c;
+        csr->values[e]  = row[c];
+        ++e;
+      }
+    csr->pointers[ r + 1 ] = e;
+  }
+
+  if ( format == SPARSE_CSR )
+    return csr;
+
+  SparseTensor2D *csc = sparse_recompress( csr );
+  SparseTensor2D_destroy( &csr );
+  return csc;
+}
+
+Tensor2D *
+SparseTensor2D_to_dense ( const SparseTensor2D *t )
+{
+  Tensor2D *dense = Tensor2D_create( t->rows, t->cols );
+  memset( dense->data, 0, sizeof(double) * t->rows * t->cols );
+
+  for ( size_t m = 0; m < sparse_major( t ); ++m )
+    for ( size_t e = t->pointers[m]; e < t->pointers[ m + 1 ]; ++e ) {
+      const size_t r = t->format == SPARSE_CSR ? m : t->indices[e];
+      const size_t c = t->format == SPARSE_CSR ? t->indices[e] : m;
+      dense->data[ r * t->cols + c ] = t->values[e];
+    }
+
+  return dense;
+}
+
+/* kernels */
+typedef struct {
+  const SparseTensor2D *a;
+  const double *x;
+  double *y;
+  Tensor2D *b, *out;
+} SparseKernelArgs;
+
+/* y[m] = slice m . x, for every major m (A x in CSR, A^T x in CSC) */
+static void
+sparse_gather ( size_t begin, size_t end, void *ctx )
+{
+  SparseKernelArgs *args = ctx;
+  const SparseTensor2D *a = args->a;
+
+  for ( size_t m = begin; m < end; ++m ) {
+    double sum = 0.0;
+    for ( size_t e = a->pointers[m]; e < a->pointers[ m + 1 ]; ++e )
+      sum += a->values[e] * args->x[ a->indices[e] ];
+    args->y[m] = sum;
+  }
+}
+
+/* y[minor] += slice m * x[m], serial since slices share minors */
+static void
+sparse_scatter ( const SparseTensor2D *a, const double *x, double *y )
+{
+  memset( y, 0, sparse_minor( a ) * sizeof(double) );
+  for ( size_t m = 0; m < sparse_major( a ); ++m ) {
+    const double xm = x[m];
+    if ( xm == 0.0 )
+      continue;
+    for ( size_t e = a->pointers[m]; e < a->pointers[ m + 1 ]; ++e )
+      y[ a->indices[e] ] += a->values[e] * xm;
+  }
+}
+
+static size_t
+sparse_slice_cost ( const SparseTensor2D *a )
+{
+  const size_t major = sparse_major( a );
+  return major ? a->nnz / major + 1 : 1;
+}
+
+void
+SparseTensor2D_spmv ( const SparseTensor2D *a, const double *x, double *y )
+{
+  if ( a->format == SPARSE_CSC ) {
+    sparse_scatter( a, x, y );
+    return;
+  }
+
+  SparseKernelArgs args = { .a = a, .x = x, .y = y };
+  parallel_for( 0, a->rows, parallel_grain( sparse_slice_cost( a ) ), sparse_gather, &args );
+}
+
+void
+SparseTensor2D_spmv_transpose ( const SparseTensor2D *a, const double *x, double *y )
+{
+  if ( a->format == SPARSE_CSR ) {
+    sparse_scatter( a, x, y );
+    return;
+  }
+
+  SparseKernelArgs args = { .a = a, .x = x, .y = y };
+  parallel_for( 0, a->cols, parallel_grain( sparse_slice_cost( a ) ), sparse_gather, &args );
+}
+
+/* out row r = sum over the non-zeros (r, k) of a_rk * B row k */
+static void
+sparse_spmm_rows ( size_t begin, size_t end, void *ctx )
+{
+  SparseKernelArgs *args = ctx;
+  const SparseTensor2D *a = args->a;
+  const size_t n = args->b->cols;
+
+  for ( size_t r = begin; r < end; ++r ) {
+    double *out_row = args->out->data + r * n;
+    memset( out_row, 0, n * sizeof(double) );
+    for ( size_t e = a->pointers[r]; e < a->pointers[ r + 1 ]; ++e ) {
+      const double v = a->values[e];
+      const double *b_row = args->b->data + a->indices[e] * n;
+      for ( size_t j = 0; j < n; ++j )
+        out_row[j] += v * b_row[j];
+    }
+  }
+}
+
+void
+SparseTensor2D_spmm ( const SparseTensor2D *a, Tensor2D *b, Tensor2D *out )
+{
+  if ( b->rows != a->cols || out->rows != a->rows || out->cols != b->cols ) {
+    fprintf( stderr, "cannot multiply a %zu x %zu sparse tensor by a %zu x %zu tensor into %zu x %zu\n",
+             a->rows, a->cols, b->rows, b->cols, out->rows, out->cols );
+    return;
+  }
+
+  /* row access is what A B needs */
+  SparseTensor2D *csr = a->format == SPARSE_CSR ? NULL : sparse_recompress( a );
+  SparseKernelArgs args = { .a = csr ? csr : a, .b = b, .out = out };
+  parallel_for( 0, a->rows, parallel_grain( sparse_slice_cost( args.a ) * b->cols ),
+                sparse_spmm_rows, &args );
+  SparseTensor2D_destroy( &csr );
+}
+
+typedef struct {
+  const SparseTensor2D *csr, *csc;
+  Tensor2D *gram;
+} SparseGramArgs;
+
+/* gram row i: every row r with a non-zero in column i contributes
+   a_ri * a_rc to (i, c). only c >= i is computed, rows being sorted lets
+   the scan start there */
+static void
+sparse_gram_rows ( size_t begin, size_t end, void *ctx )
+{
+  SparseGramArgs *args = ctx;
+  const SparseTensor2D *csr = args->csr, *csc = args->csc;
+  const size_t p = csc->cols;
+
+  for ( size_t i = begin; i < end; ++i ) {
+    double *gram_row = args->gram->data + i * p;
+    memset( gram_row, 0, p * sizeof(double) );
+
+    for ( size_t e = csc->pointers[i]; e < csc->pointers[ i + 1 ]; ++e ) {
+      const size_t r = csc->indices[e];
+      const double v = csc->values[e];
+
+      /* lower bound of column i within row r */
+      size_t lo = csr->pointers[r], hi = csr->pointers[ r + 1 ];
+      while ( lo < hi ) {
+        const size_t mid = lo + ( hi - lo ) / 2;
+        if ( csr->indices[mid] < i )
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+
+      for ( size_t f = lo; f < csr->pointers[ r + 1 ]; ++f )
+        gram_row[ csr->indices[f] ] += v * csr->values[f];
+    }
+  }
+}
+
+Tensor2D *
+SparseTensor2D_gram ( const SparseTensor2D *a )
+{
+  /* columns to walk, rows to pair them up with */
+  SparseTensor2D *other = sparse_recompress( a );
+  SparseGramArgs args = {
+    .csr  = a->format == SPARSE_CSR ? a : other,
+    .csc  = a->format == SPARSE_CSC ? a : other,
+    .gram = Tensor2D_create( a->cols, a->cols )
+  };
+
+  const size_t p = a->cols;
+  parallel_for( 0, p, parallel_grain( p + sparse_slice_cost( args.csc ) *
+                                          sparse_slice_cost( args.csr ) ),
+                sparse_gram_rows, &args );
+  SparseTensor2D_destroy( &other );
+
+  /* mirror the upper triangle */
+  for ( size_t i = 0; i < p; ++i )
+    for ( size_t j = 0; j < i; ++j )
+      args.gram->data[ i * p + j ] = args.gram->data[ j * p + i ];
+
+  return args.gram;
+}
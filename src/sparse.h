@@ -0,0 +1,53 @@
+#ifndef SPARSE_HEADER
+#define SPARSE_HEADER
+
+#include <stddef.h>
+#include "tensor.h"
+
+typedef enum {
+  SPARSE_CSR,            /* compressed rows: fast row access, A x, A B */
+  SPARSE_CSC             /* compressed columns: fast column access, A^T x */
+} SparseFormat;
+
+/* compressed sparse matrix. in CSR the non-zeros of row r are
+   values[pointers[r] .. pointers[r + 1]) and indices holds their columns,
+   CSC is the same with rows and columns swapped. indices are sorted within
+   every row (column) and there are no duplicates, so memory and every
+   kernel scale with the number of non-zeros instead of rows x cols */
+typedef struct {
+  SparseFormat format;
+  size_t rows, cols, nnz;
+  size_t *pointers;      /* rows + 1 (CSR) or cols + 1 (CSC) */
+  size_t *indices;
+  double *values;
+} SparseTensor2D;
+
+/* basic operations */
+SparseTensor2D *SparseTensor2D_create  ( const size_t rows, const size_t cols, const size_t nnz,
+                                         const SparseFormat format );
+void            SparseTensor2D_destroy ( SparseTensor2D **t );
+
+/* building. triplets may come in any order, duplicates are summed and
+   explicit zeros are dropped */
+SparseTensor2D *SparseTensor2D_from_triplets ( const size_t rows, const size_t cols,
+                                               const size_t *row_indices,
+                                               const size_t *col_indices,
+                                               const double *values, const size_t len,
+                                               const SparseFormat format );
+SparseTensor2D *SparseTensor2D_from_dense    ( Tensor2D *t, const SparseFormat format );
+Tensor2D       *SparseTensor2D_to_dense      ( const SparseTensor2D *t );
+/* a copy in the given format (CSR <-> CSC is one counting sort) */
+SparseTensor2D *SparseTensor2D_convert       ( const SparseTensor2D *t, const SparseFormat format );
+
+/* sparse x dense kernels, multithreaded where the format allows it without
+   scattering. y = A x with x of cols entries, y = A^T x with x of rows
+   entries, out = A B for a dense B of cols rows (out is rows x B->cols) */
+void SparseTensor2D_spmv           ( const SparseTensor2D *a, const double *x, double *y );
+void SparseTensor2D_spmv_transpose ( const SparseTensor2D *a, const double *x, double *y );
+void SparseTensor2D_spmm           ( const SparseTensor2D *a, Tensor2D *b, Tensor2D *out );
+
+/* the dense cols x cols gram matrix A^T A, summing only products of
+   non-zeros that share a row */
+Tensor2D *SparseTensor2D_gram ( const SparseTensor2D *a );
+
+#endif
@@ -3,7 +3,13 @@
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "tensor.h"
+#include "threadpool.h"
 
 /* basic operations */
 void
@@ -61,22 +67,204 @@ Tensor2D_destroy ( Tensor2D **t )
 }
 
 /* actual math operations */
+#define TENSOR_TRANSPOSE_LEAF 32
+
+typedef struct {
+  Tensor2D *a, *b, *result;
+} Tensor2DKernelArgs;
+
+/* 4x4 micro-transpose, the whole block is held in registers */
+static inline void
+Tensor2D_transpose_4x4 ( const double *src, const size_t src_stride,
+                         double *dst, const size_t dst_stride )
+{
+#if defined(__AVX__)
+  __m256d r0 = _mm256_loadu_pd( src );
+  __m256d r1 = _mm256_loadu_pd( src + src_stride );
+  __m256d r2 = _mm256_loadu_pd( src + 2 * src_stride );
+  __m256d r3 = _mm256_loadu_pd( src + 3 * src_stride );
+
+  __m256d t0 = _mm256_unpacklo_pd( r0, r1 );
+  __m256d t1 = _mm256_unpackhi_pd( r0, r1 );
+  __m256d t2 = _mm256_unpacklo_pd( r2, r3 );
+  __m256d t3 = _mm256_unpackhi_pd( r2, r3 );
+
+  _mm256_storeu_pd( dst,                  _mm256_permute2f128_pd( t0, t2, 0x20 ) );
+  _mm256_storeu_pd( dst + dst_stride,     _mm256_permute2f128_pd( t1, t3, 0x20 ) );
+  _mm256_storeu_pd( dst + 2 * dst_stride, _mm256_permute2f128_pd( t0, t2, 0x31 ) );
+  _mm256_storeu_pd( dst + 3 * dst_stride, _mm256_permute2f128_pd( t1, t3, 0x31 ) );
+#elif defined(__SSE2__)
+  /* four 2x2 transposes */
+  for (size_t r = 0; r < 4; r += 2)
+    for (size_t c = 0; c < 4; c += 2) {
+      __m128d r0 = _mm_loadu_pd( src + r * src_stride + c );
+      __m128d r1 = _mm_loadu_pd( src + ( r + 1 ) * src_stride + c );
+      _mm_storeu_pd( dst + c * dst_stride + r,       _mm_unpacklo_pd( r0, r1 ) );
+      _mm_storeu_pd( dst + ( c + 1 ) * dst_stride + r, _mm_unpackhi_pd( r0, r1 ) );
+    }
+#else
+  for (size_t r = 0; r < 4; ++r)
+    for (size_t c = 0; c < 4; ++c)
+      dst[ c * dst_stride + r ] = src[ r * src_stride + c ];
+#endif
+}
+
+/* cache-oblivious transpose of a rows x cols block: halve the longer side
+   until the block fits in L1, then sweep it with 4x4 micro-transposes */
+static void
+Tensor2D_transpose_block ( const double *src, const size_t src_stride,
+                           double *dst, const size_t dst_stride,
+                           const size_t rows, const size_t cols )
+{
+  if (rows <= TENSOR_TRANSPOSE_LEAF && cols <= TENSOR_TRANSPOSE_LEAF) {
+    size_t r = 0;
+    for (; r + 4 <= rows; r += 4) {
+      size_t c = 0;
+      for (; c + 4 <= cols; c += 4)
+        Tensor2D_transpose_4x4( src + r * src_stride + c, src_stride,
+                                dst + c * dst_stride + r, dst_stride );
+      for (; c < cols; ++c)
+        for (size_t rr = r; rr < r + 4; ++rr)
+          dst[ c * dst_stride + rr ] = src[ rr * src_stride + c ];
+    }
+    for (; r < rows; ++r)
+      for (size_t c = 0; c < cols; ++c)
+        dst[ c * dst_stride + r ] = src[ r * src_stride + c ];
+    return;
+  }
+
+  /* split on a multiple of 4 so the micro-kernel stays aligned to the block */
+  if (rows >= cols) {
+    size_t half = ( rows / 2 + 3 ) & ~(size_t) 3;
+    Tensor2D_transpose_block( src, src_stride, dst, dst_stride, half, cols );
+    Tensor2D_transpose_block( src + half * src_stride, src_stride,
+                              dst + half, dst_stride, rows - half, cols );
+  } else {
+    size_t half = ( cols / 2 + 3 ) & ~(size_t) 3;
+    Tensor2D_transpose_block( src, src_stride, dst, dst_stride, rows, half );
+    Tensor2D_transpose_block( src + half, src_stride,
+                              dst + half * dst_stride, dst_stride, rows, cols - half );
+  }
+}
+
+/* transposes a band of source rows */
+static void
+Tensor2D_transpose_rows ( size_t row_begin, size_t row_end, void *ctx )
+{
+  Tensor2DKernelArgs *args = ctx;
+  const Tensor2D *t = args->a;
+  Tensor2D *new = args->result;
+
+  Tensor2D_transpose_block( t->data + row_begin * t->cols, t->cols,
+                            new->data + row_begin, new->cols,
+                            row_end - row_begin, t->cols );
+}
+
+void
+Tensor2D_transpose_into ( Tensor2D *t, Tensor2D *out )
+{
+  if (out->rows != t->cols || out->cols != t->rows) {
+    fprintf(stderr,
+	    "invalid TRANSPOSE call due to mismatched size: "
+	    "%zu x %zu into %zu x %zu\n",
+	    t->rows, t->cols, out->rows, out->cols);
+    return;
+  }
+
+  Tensor2DKernelArgs args = { .a = t, .result = out };
+
+  /* bands are whole leaf blocks so two threads never write the same cache line */
+  size_t grain = parallel_grain( t->cols );
+  grain = ( grain + TENSOR_TRANSPOSE_LEAF - 1 ) / TENSOR_TRANSPOSE_LEAF * TENSOR_TRANSPOSE_LEAF;
+  parallel_for( 0, t->rows, grain, Tensor2D_transpose_rows, &args );
+}
+
 Tensor2D *
 Tensor2D_transpose ( Tensor2D *t )
 {
   Tensor2D *new = Tensor2D_create(t->cols, t->rows);
-  for (size_t r = 0; r < t->rows; ++r)
-    for (size_t c = 0; c < t->cols; ++c)
-      Tensor2D_set_index(new, c, r, Tensor2D_get_index(t, r, c));
+  Tensor2D_transpose_into( t, new );
   return new;
 }
 
+/* swaps tile (i, j) with tile (j, i) for every j >= i in a band of tile
+   rows. off-diagonal pairs are transposed through two L1-sized buffers so
+   both tiles are read and written row by row. */
+static void
+Tensor2D_transpose_inplace_tiles ( size_t tile_begin, size_t tile_end, void *ctx )
+{
+  Tensor2DKernelArgs *args = ctx;
+  Tensor2D *t = args->a;
+  const size_t n = t->rows, leaf = TENSOR_TRANSPOSE_LEAF;
+  double upper[ TENSOR_TRANSPOSE_LEAF * TENSOR_TRANSPOSE_LEAF ];
+  double lower[ TENSOR_TRANSPOSE_LEAF * TENSOR_TRANSPOSE_LEAF ];
+
+  for (size_t ti = tile_begin; ti < tile_end; ++ti) {
+    size_t r0 = ti * leaf;
+    size_t rows = r0 + leaf < n ? leaf : n - r0;
+
+    /* diagonal tile */
+    for (size_t r = r0; r < r0 + rows; ++r)
+      for (size_t c = r + 1; c < r0 + rows; ++c) {
+        double tmp = t->data[ r * n + c ];
+        t->data[ r * n + c ] = t->data[ c * n + r ];
+        t->data[ c * n + r ] = tmp;
+      }
+
+    for (size_t c0 = r0 + leaf; c0 < n; c0 += leaf) {
+      size_t cols = c0 + leaf < n ? leaf : n - c0;
+      double *tile_upper = t->data + r0 * n + c0;  /* rows x cols */
+      double *tile_lower = t->data + c0 * n + r0;  /* cols x rows */
+
+      Tensor2D_transpose_block( tile_upper, n, upper, rows, rows, cols );
+      Tensor2D_transpose_block( tile_lower, n, lower, cols, cols, rows );
+
+      for (size_t r = 0; r < cols; ++r)
+        memcpy( tile_lower + r * n, upper + r * rows, sizeof(double) * rows );
+      for (size_t r = 0; r < rows; ++r)
+        memcpy( tile_upper + r * n, lower + r * cols, sizeof(double) * cols );
+    }
+  }
+}
+
+void
+Tensor2D_transpose_inplace ( Tensor2D *t )
+{
+  if (t->rows != t->cols) {
+    fprintf(stderr, "in-place transpose needs a square tensor, got %zu x %zu\n",
+	    t->rows, t->cols);
+    return;
+  }
+
+  size_t tiles = ( t->rows + TENSOR_TRANSPOSE_LEAF - 1 ) / TENSOR_TRANSPOSE_LEAF;
+  Tensor2DKernelArgs args = { .a = t };
+  parallel_for( 0, tiles, parallel_grain( t->cols * TENSOR_TRANSPOSE_LEAF ),
+                Tensor2D_transpose_inplace_tiles, &args );
+}
+
+/* computes a panel of result rows, i-k-j so rows of b stream contiguously */
+static void
+Tensor2D_mult_rows ( size_t row_begin, size_t row_end, void *ctx )
+{
+  Tensor2DKernelArgs *args = ctx;
+  const Tensor2D *a = args->a, *b = args->b;
+  Tensor2D *result = args->result;
+
+  for (size_t i = row_begin; i < row_end; ++i) {
+    double *out_row = result->data + i * result->cols;
+    memset(out_row, 0, sizeof(double) * result->cols);
+    for (size_t k = 0; k < a->cols; ++k) {
+      const double aik = a->data[ i * a->cols + k ];
+      const double *b_row = b->data + k * b->cols;
+      for (size_t j = 0; j < b->cols; ++j)
+        out_row[j] += aik * b_row[j];
+    }
+  }
+}
+
 Tensor2D *
 Tensor2D_mult ( Tensor2D *a, Tensor2D *b )
 {
-  Tensor2D_print(a);
-  Tensor2D_print(b);
-  
   if (a->cols != b->rows) {
     fprintf(stderr,
 	    "invalid MULT call due to mismatched size: "
@@ -86,18 +274,8 @@ Tensor2D_mult ( Tensor2D *a, Tensor2D *b )
   }
   
   Tensor2D *result = Tensor2D_create ( a->rows, b->cols );
-  
-  fprintf(stderr, "beginning mult..\n");
-  
-  for (size_t i = 0; i < a->rows; ++i)
-    for (size_t j = 0; j < b->cols; ++j) {
-      double sum = 0.0;
-      for (size_t k = 0; k < a->cols; ++k)
-        sum += Tensor2D_get_index(a, i, k) * Tensor2D_get_index(b, k, j);
-      Tensor2D_set_index(result, i, j, sum);
-    }
-  
-  fprintf(stderr, "mult complete\n");
+  Tensor2DKernelArgs args = { .a = a, .b = b, .result = result };
+  parallel_for( 0, a->rows, parallel_grain( a->cols * b->cols ), Tensor2D_mult_rows, &args );
 
   return result;
 }
@@ -140,6 +318,32 @@ Tensor2D_inplace_swap_rows ( Tensor2D *t, size_t row_a, size_t row_b )
   free(row_a_buf);
 }
 
+typedef struct {
+  Tensor2D *ia;
+  size_t pivot;
+} Tensor2DEliminationArgs;
+
+/* subtracts the (already normalized) pivot row from a band of rows */
+static void
+Tensor2D_eliminate_rows ( size_t row_begin, size_t row_end, void *ctx )
+{
+  Tensor2DEliminationArgs *args = ctx;
+  Tensor2D *ia = args->ia;
+  const double *pivot_row = ia->data + args->pivot * ia->cols;
+
+  for (size_t r = row_begin; r < row_end; ++r) {
+    if (r == args->pivot)
+      continue;
+
+    double *row = ia->data + r * ia->cols;
+    const double factor = row[ args->pivot ];
+    if (factor == 0.0)
+      continue;
+    for (size_t c = 0; c < ia->cols; ++c)
+      row[c] -= factor * pivot_row[c];
+  }
+}
+
 /* TODO: fix the fact that the intermediate augment isnt modified, but the OG matrix is
          by producing a copy of the OG at the beginning OR writing its values to the ia
          then performing all operations DIRECTLY onto the ia inplace. */
@@ -157,6 +361,7 @@ Tensor2D_sq_inverse ( Tensor2D *t )
      https://en.wikipedia.org/wiki/Gaussian_elimination */
   Tensor2D *intermediate_augment = Tensor2D_create( t->rows, t->cols + t->rows );
   Tensor2D *ia = intermediate_augment;
+  memset( ia->data, 0, sizeof(double) * ia->rows * ia->cols );
 
   /* copy the data to intermediate augment */
   for ( size_t r = 0; r < t->rows; ++r ) {
@@ -167,9 +372,6 @@ Tensor2D_sq_inverse ( Tensor2D *t )
     Tensor2D_set_index( ia, r, r + t->rows, 1 );
   }
 
-  fprintf(stderr, "INTERMEDIATE AUGMENT TENSOR BEFORE\n");
-  Tensor2D_print( intermediate_augment );
-    
   /* forward elimination */
   for ( size_t pivot = 0; pivot < t->rows; ++pivot ) {
     /* find the pivot row (with the largest abs value in the column) */
@@ -198,21 +400,10 @@ Tensor2D_sq_inverse ( Tensor2D *t )
     Tensor2D_inplace_divide_row( ia, pivot, Tensor2D_get_index( ia, pivot, pivot ) );
 
     /* eliminate other rows */
-    for (size_t r = 0; r < t->rows; ++r) {
-      if (r == pivot)
-        continue;
-
-      double factor = Tensor2D_get_index( ia, r, pivot );
-      for (size_t c = 0; c < ia->cols; ++c)
-        Tensor2D_set_index( ia, r, c,
-                            Tensor2D_get_index( ia, r, c ) -
-                            factor * Tensor2D_get_index( ia, pivot, c ) );
-    }
+    Tensor2DEliminationArgs args = { .ia = ia, .pivot = pivot };
+    parallel_for( 0, t->rows, parallel_grain( ia->cols ), Tensor2D_eliminate_rows, &args );
   }
 
-  fprintf(stderr, "INTERMEDIATE AUGMENT TENSOR AFTER\n");
-  Tensor2D_print( intermediate_augment );
-  
   /* copy data */
   Tensor2D *sq_inv_result = Tensor2D_create ( t->rows, t->cols );
   for ( size_t r = 0; r < t->rows; ++r )
@@ -227,18 +418,54 @@ Tensor2D_sq_inverse ( Tensor2D *t )
 }
 
  /* data manipulation */
+typedef struct {
+  Tensor2D *t;
+  size_t index;
+  double val;
+} Tensor2DFillArgs;
+
+static void
+Tensor2D_fill_column_rows ( size_t row_begin, size_t row_end, void *ctx )
+{
+  Tensor2DFillArgs *args = ctx;
+  for (size_t r = row_begin; r < row_end; ++r)
+    args->t->data[ r * args->t->cols + args->index ] = args->val;
+}
+
+static void
+Tensor2D_fill_row_cols ( size_t col_begin, size_t col_end, void *ctx )
+{
+  Tensor2DFillArgs *args = ctx;
+  double *row = args->t->data + args->index * args->t->cols;
+  for (size_t c = col_begin; c < col_end; ++c)
+    row[c] = args->val;
+}
+
 void
 Tensor2D_fill_column ( Tensor2D *t, const size_t col, const double val )
 {
-  for (size_t r = 0; r < t->rows; ++r)
-    Tensor2D_set_index(t, r, col, val);
+  if ( col >= t->cols ) {
+    fprintf(stderr, "fill error on tensor of size %zu x %zu at column %zu\n",
+	    t->rows, t->cols, col);
+    return;
+  }
+
+  /* strided writes, each one touches its own cache line */
+  Tensor2DFillArgs args = { .t = t, .index = col, .val = val };
+  parallel_for( 0, t->rows, parallel_grain( 8 ), Tensor2D_fill_column_rows, &args );
 }
 
 void
 Tensor2D_fill_row ( Tensor2D *t, const size_t row, const double val )
 {
-  for (size_t c = 0; c < t->cols; ++c)
-    Tensor2D_set_index(t, row, c, val);
+  if ( row >= t->rows ) {
+    fprintf(stderr, "fill error on tensor of size %zu x %zu at row %zu\n",
+	    t->rows, t->cols, row);
+    return;
+  }
+
+  Tensor2DFillArgs args = { .t = t, .index = row, .val = val };
+  parallel_for( 0, t->cols, parallel_grain( 1 ), Tensor2D_fill_row_cols, &args );
 }
 
 /* get and set */
@@ -17,6 +17,8 @@ void      Tensor2D_destroy ( Tensor2D **t );
 
 /* actual math operations */
 Tensor2D *Tensor2D_transpose  ( Tensor2D *t );
+void      Tensor2D_transpose_into    ( Tensor2D *t, Tensor2D *out );
+void      Tensor2D_transpose_inplace ( Tensor2D *t ); /* square tensors only */
 Tensor2D *Tensor2D_mult       ( Tensor2D *a, Tensor2D *b );
 Tensor2D *Tensor2D_sq_inverse ( Tensor2D *t );
 
@@ -0,0 +1,476 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include "tensor_expr.h"
+
+/* a read-only strided window onto tensor memory, so transposes and scales of
+   a leaf can be consumed directly by the kernels below */
+typedef struct {
+  const double *data;
+  size_t rows, cols;
+  size_t row_stride, col_stride;
+  double scale;
+} TensorView;
+
+static TensorExpr *
+TensorExpr_node ( TensorExprOp op, TensorExpr *a, TensorExpr *b,
+                  const size_t rows, const size_t cols )
+{
+  TensorExpr *e = calloc( 1, sizeof(TensorExpr) );
+  e->op     = op;
+  e->a      = a;
+  e->b      = b;
+  e->scalar = 1.0;
+  e->rows   = rows;
+  e->cols   = cols;
+  return e;
+}
+
+TensorExpr *
+TensorExpr_leaf ( Tensor2D *t )
+{
+  if ( t == NULL )
+    return NULL;
+
+  TensorExpr *e = TensorExpr_node( TENSOR_EXPR_LEAF, NULL, NULL, t->rows, t->cols );
+  e->leaf = t;
+  return e;
+}
+
+TensorExpr *
+TensorExpr_transpose ( TensorExpr *a )
+{
+  if ( a == NULL )
+    return NULL;
+
+  return TensorExpr_node( TENSOR_EXPR_TRANSPOSE, a, NULL, a->cols, a->rows );
+}
+
+TensorExpr *
+TensorExpr_mult ( TensorExpr *a, TensorExpr *b )
+{
+  if ( a == NULL || b == NULL || a->cols != b->rows ) {
+    if ( a && b )
+      fprintf(stderr,
+              "invalid MULT expression due to mismatched size: "
+              "a (%zu cols) != b (%zu rows)\n",
+              a->cols, b->rows);
+    TensorExpr_destroy( &a );
+    TensorExpr_destroy( &b );
+    return NULL;
+  }
+
+  return TensorExpr_node( TENSOR_EXPR_MULT, a, b, a->rows, b->cols );
+}
+
+TensorExpr *
+TensorExpr_add ( TensorExpr *a, TensorExpr *b )
+{
+  if ( a == NULL || b == NULL || a->rows != b->rows || a->cols != b->cols ) {
+    if ( a && b )
+      fprintf(stderr,
+              "invalid ADD expression due to mismatched size: "
+              "%zu x %zu != %zu x %zu\n",
+              a->rows, a->cols, b->rows, b->cols);
+    TensorExpr_destroy( &a );
+    TensorExpr_destroy( &b );
+    return NULL;
+  }
+
+  return TensorExpr_node( TENSOR_EXPR_ADD, a, b, a->rows, a->cols );
+}
+
+TensorExpr *
+TensorExpr_scale ( TensorExpr *a, const double scalar )
+{
+  if ( a == NULL )
+    return NULL;
+
+  TensorExpr *e = TensorExpr_node( TENSOR_EXPR_SCALE, a, NULL, a->rows, a->cols );
+  e->scalar = scalar;
+  return e;
+}
+
+TensorExpr *
+TensorExpr_hcat ( TensorExpr *a, TensorExpr *b )
+{
+  if ( a == NULL || b == NULL || a->rows != b->rows ) {
+    if ( a && b )
+      fprintf(stderr,
+              "invalid HCAT expression due to mismatched size: "
+              "a (%zu rows) != b (%zu rows)\n",
+              a->rows, b->rows);
+    TensorExpr_destroy( &a );
+    TensorExpr_destroy( &b );
+    return NULL;
+  }
+
+  return TensorExpr_node( TENSOR_EXPR_HCAT, a, b, a->rows, a->cols + b->cols );
+}
+
+void
+TensorExpr_destroy ( TensorExpr **e )
+{
+  if ( e && *e ) {
+    TensorExpr_destroy( &(*e)->a );
+    TensorExpr_destroy( &(*e)->b );
+    free( *e );
+    *e = NULL;
+  }
+}
+
+/* views */
+static TensorView
+TensorView_of ( const Tensor2D *t )
+{
+  return (TensorView) {
+    .data       = t->data,
+    .rows       = t->rows,
+    .cols       = t->cols,
+    .row_stride = t->cols,
+    .col_stride = 1,
+    .scale      = 1.0
+  };
+}
+
+static TensorView
+TensorView_transposed ( TensorView v )
+{
+  return (TensorView) {
+    .data       = v.data,
+    .rows       = v.cols,
+    .cols       = v.rows,
+    .row_stride = v.col_stride,
+    .col_stride = v.row_stride,
+    .scale      = v.scale
+  };
+}
+
+/* returns false if the expression can't be read without evaluating it */
+static bool
+TensorExpr_view ( TensorExpr *e, TensorView *v )
+{
+  switch ( e->op ) {
+  case TENSOR_EXPR_LEAF:
+    *v = TensorView_of( e->leaf );
+    return true;
+
+  case TENSOR_EXPR_TRANSPOSE:
+    if ( !TensorExpr_view( e->a, v ) )
+      return false;
+    *v = TensorView_transposed( *v );
+    return true;
+
+  case TENSOR_EXPR_SCALE:
+    if ( !TensorExpr_view( e->a, v ) )
+      return false;
+    v->scale *= e->scalar;
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+/* kernels, all computing out (+)= alpha * op(...) */
+static void
+TensorView_axpy ( const TensorView *v, Tensor2D *out, const size_t col_offset,
+                  double alpha, bool accumulate )
+{
+  alpha *= v->scale;
+  for ( size_t r = 0; r < v->rows; ++r ) {
+    const double *src = v->data + r * v->row_stride;
+    double *dst = out->data + r * out->cols + col_offset;
+    for ( size_t c = 0; c < v->cols; ++c ) {
+      double val = alpha * src[ c * v->col_stride ];
+      dst[c] = accumulate ? dst[c] + val : val;
+    }
+  }
+}
+
+static double
+TensorView_dot ( const double *a, const double *b, const size_t n )
+{
+  double sum = 0.0;
+  for ( size_t k = 0; k < n; ++k )
+    sum += a[k] * b[k];
+  return sum;
+}
+
+/* a 4 x 4 block of A B^T dot products at (i, j). the 16 sums share every
+   load and are independent, so they don't wait on each other the way a
+   single running sum does. each one still adds up over k in order */
+static void
+TensorView_dot_block ( const TensorView *a, const TensorView *b, Tensor2D *out,
+                       const size_t i, const size_t j, const double alpha )
+{
+  const double *a0 = a->data + i * a->row_stride, *a1 = a0 + a->row_stride,
+               *a2 = a1 + a->row_stride, *a3 = a2 + a->row_stride;
+  const double *b0 = b->data + j * b->col_stride, *b1 = b0 + b->col_stride,
+               *b2 = b1 + b->col_stride, *b3 = b2 + b->col_stride;
+  double sum[4][4] = { { 0.0 } };
+
+  for ( size_t k = 0; k < a->cols; ++k ) {
+    const double x[4] = { a0[k], a1[k], a2[k], a3[k] };
+    const double y[4] = { b0[k], b1[k], b2[k], b3[k] };
+    for ( size_t r = 0; r < 4; ++r )
+      for ( size_t c = 0; c < 4; ++c )
+        sum[r][c] += x[r] * y[c];
+  }
+
+  for ( size_t r = 0; r < 4; ++r )
+    for ( size_t c = 0; c < 4; ++c )
+      out->data[ ( i + r ) * out->cols + j + c ] += alpha * sum[r][c];
+}
+
+/* A^T [B_0 B_1 ...] with A and every part stored row-major (X^T X, X^T y,
+   X^T [X y]): stream the shared dimension once, accumulating the outer
+   product of each stored row of A with the same stored row of every part.
+   for a gram block (a part that is A itself) only the upper triangle is
+   computed. */
+static void
+TensorView_gemm_tn ( const TensorView *a, const TensorView *parts, const size_t num_parts,
+                     Tensor2D *out, const double alpha, bool accumulate )
+{
+  if ( !accumulate )
+    memset( out->data, 0, sizeof(double) * out->rows * out->cols );
+
+  bool gram[ num_parts ];
+  double scaled[ num_parts ];
+  for ( size_t p = 0; p < num_parts; ++p ) {
+    const TensorView *b = &parts[p];
+    gram[p] = !accumulate && a->data == b->data &&
+              a->col_stride == b->row_stride && a->rows == b->cols;
+    scaled[p] = alpha * ( a->scale * b->scale );
+  }
+
+  /* four stored rows at a time, so each output is loaded and stored once
+     per four products (still added in order of k) */
+  size_t k = 0;
+  for ( ; k + 4 <= a->cols; k += 4 ) {
+    const double *a0 = a->data + k * a->col_stride, *a1 = a0 + a->col_stride,
+                 *a2 = a1 + a->col_stride, *a3 = a2 + a->col_stride;
+    for ( size_t p = 0, offset = 0; p < num_parts; offset += parts[p++].cols ) {
+      const TensorView *b = &parts[p];
+      const double *b0 = b->data + k * b->row_stride, *b1 = b0 + b->row_stride,
+                   *b2 = b1 + b->row_stride, *b3 = b2 + b->row_stride;
+      for ( size_t i = 0; i < a->rows; ++i ) {
+        const double x0 = scaled[p] * a0[i], x1 = scaled[p] * a1[i],
+                     x2 = scaled[p] * a2[i], x3 = scaled[p] * a3[i];
+        double *out_row = out->data + i * out->cols + offset;
+        for ( size_t j = gram[p] ? i : 0; j < b->cols; ++j )
+          out_row[j] = out_row[j] + x0 * b0[j] + x1 * b1[j] + x2 * b2[j] + x3 * b3[j];
+      }
+    }
+  }
+
+  for ( ; k < a->cols; ++k ) {
+    const double *a_row = a->data + k * a->col_stride;
+    for ( size_t p = 0, offset = 0; p < num_parts; offset += parts[p++].cols ) {
+      const TensorView *b = &parts[p];
+      const double *b_row = b->data + k * b->row_stride;
+      for ( size_t i = 0; i < a->rows; ++i ) {
+        const double aik = scaled[p] * a_row[i];
+        double *out_row = out->data + i * out->cols + offset;
+        for ( size_t j = gram[p] ? i : 0; j < b->cols; ++j )
+          out_row[j] += aik * b_row[j];
+      }
+    }
+  }
+
+  for ( size_t p = 0, offset = 0; p < num_parts; offset += parts[p++].cols )
+    if ( gram[p] )
+      for ( size_t i = 0; i < out->rows; ++i )
+        for ( size_t j = 0; j < i; ++j )
+          out->data[ i * out->cols + offset + j ] = out->data[ j * out->cols + offset + i ];
+}
+
+static void
+TensorView_gemm ( const TensorView *a, const TensorView *b, Tensor2D *out,
+                  double alpha, bool accumulate )
+{
+  if ( a->row_stride == 1 && b->col_stride == 1 ) {
+    TensorView_gemm_tn( a, b, 1, out, alpha, accumulate );
+    return;
+  }
+
+  alpha *= a->scale * b->scale;
+
+  if ( !accumulate )
+    memset( out->data, 0, sizeof(double) * out->rows * out->cols );
+
+  if ( a->col_stride == 1 && b->row_stride == 1 ) {
+    /* A B^T with both operands stored row-major (X W^T): every output is a
+       dot product of two contiguous rows */
+    size_t i = 0;
+    for ( ; i + 4 <= a->rows; i += 4 ) {
+      size_t j = 0;
+      for ( ; j + 4 <= b->cols; j += 4 )
+        TensorView_dot_block( a, b, out, i, j, alpha );
+      for ( ; j < b->cols; ++j )
+        for ( size_t r = i; r < i + 4; ++r )
+          out->data[ r * out->cols + j ] +=
+            alpha * TensorView_dot( a->data + r * a->row_stride, b->data + j * b->col_stride,
+                                    a->cols );
+    }
+    for ( ; i < a->rows; ++i )
+      for ( size_t j = 0; j < b->cols; ++j )
+        out->data[ i * out->cols + j ] +=
+          alpha * TensorView_dot( a->data + i * a->row_stride, b->data + j * b->col_stride,
+                                  a->cols );
+    return;
+  }
+
+  if ( b->col_stride == 1 ) {
+    /* i-k-j order so rows of B are streamed contiguously */
+    for ( size_t i = 0; i < a->rows; ++i ) {
+      double *out_row = out->data + i * out->cols;
+      for ( size_t k = 0; k < a->cols; ++k ) {
+        const double aik = alpha * a->data[ i * a->row_stride + k * a->col_stride ];
+        if ( aik == 0.0 )
+          continue;
+        const double *b_row = b->data + k * b->row_stride;
+        for ( size_t j = 0; j < b->cols; ++j )
+          out_row[j] += aik * b_row[j];
+      }
+    }
+    return;
+  }
+
+  /* generic strided fallback */
+  for ( size_t i = 0; i < a->rows; ++i )
+    for ( size_t j = 0; j < b->cols; ++j ) {
+      double sum = 0.0;
+      for ( size_t k = 0; k < a->cols; ++k )
+        sum += a->data[ i * a->row_stride + k * a->col_stride ] *
+               b->data[ k * b->row_stride + j * b->col_stride ];
+      out->data[ i * out->cols + j ] += alpha * sum;
+    }
+}
+
+static void TensorExpr_eval_scaled ( TensorExpr *e, Tensor2D *out,
+                                     double alpha, bool accumulate );
+
+/* view of an operand, evaluating it into a temporary only if it has to be */
+static TensorView
+TensorExpr_operand ( TensorExpr *e, Tensor2D **temporary )
+{
+  TensorView v;
+  *temporary = NULL;
+  if ( TensorExpr_view( e, &v ) )
+    return v;
+
+  *temporary = TensorExpr_eval( e );
+  return TensorView_of( *temporary );
+}
+
+static void
+TensorExpr_eval_scaled ( TensorExpr *e, Tensor2D *out, double alpha, bool accumulate )
+{
+  TensorView v;
+  if ( TensorExpr_view( e, &v ) ) {
+    TensorView_axpy( &v, out, 0, alpha, accumulate );
+    return;
+  }
+
+  Tensor2D *ta = NULL, *tb = NULL;
+
+  switch ( e->op ) {
+  case TENSOR_EXPR_SCALE:
+    TensorExpr_eval_scaled( e->a, out, alpha * e->scalar, accumulate );
+    break;
+
+  case TENSOR_EXPR_ADD:
+    /* the second operand accumulates straight into the first one's output */
+    TensorExpr_eval_scaled( e->a, out, alpha, accumulate );
+    TensorExpr_eval_scaled( e->b, out, alpha, true );
+    break;
+
+  case TENSOR_EXPR_MULT: {
+    /* A^T [B C] in one pass when all three can be read in place */
+    TensorView parts[2];
+    if ( e->b->op == TENSOR_EXPR_HCAT ) {
+      TensorView va;
+      if ( TensorExpr_view( e->a, &va ) && va.row_stride == 1 &&
+           TensorExpr_view( e->b->a, &parts[0] ) && parts[0].col_stride == 1 &&
+           TensorExpr_view( e->b->b, &parts[1] ) && parts[1].col_stride == 1 ) {
+        TensorView_gemm_tn( &va, parts, 2, out, alpha, accumulate );
+        break;
+      }
+    }
+
+    TensorView va = TensorExpr_operand( e->a, &ta );
+    TensorView vb = TensorExpr_operand( e->b, &tb );
+    TensorView_gemm( &va, &vb, out, alpha, accumulate );
+    break;
+  }
+
+  case TENSOR_EXPR_HCAT: {
+    TensorView va = TensorExpr_operand( e->a, &ta );
+    TensorView vb = TensorExpr_operand( e->b, &tb );
+    TensorView_axpy( &va, out, 0, alpha, accumulate );
+    TensorView_axpy( &vb, out, va.cols, alpha, accumulate );
+    break;
+  }
+
+  case TENSOR_EXPR_TRANSPOSE: {
+    /* transpose of a computed result, read the temporary back transposed */
+    TensorView vt = TensorView_transposed( TensorExpr_operand( e->a, &ta ) );
+    TensorView_axpy( &vt, out, 0, alpha, accumulate );
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  Tensor2D_destroy( &ta );
+  Tensor2D_destroy( &tb );
+}
+
+/* does any leaf share memory with t */
+static bool
+TensorExpr_overlaps ( const TensorExpr *e, const Tensor2D *t )
+{
+  if ( e == NULL )
+    return false;
+
+  if ( e->op == TENSOR_EXPR_LEAF ) {
+    const double *begin = e->leaf->data, *end = begin + e->leaf->rows * e->leaf->cols;
+    return begin < t->data + t->rows * t->cols && t->data < end;
+  }
+
+  return TensorExpr_overlaps( e->a, t ) || TensorExpr_overlaps( e->b, t );
+}
+
+void
+TensorExpr_eval_into ( TensorExpr *e, Tensor2D *out )
+{
+  if ( e == NULL || out->rows != e->rows || out->cols != e->cols ) {
+    fprintf(stderr, "cannot evaluate expression into a %zu x %zu tensor\n",
+            out->rows, out->cols);
+    return;
+  }
+
+  /* the kernels clear and accumulate into out while still reading */
+  if ( TensorExpr_overlaps( e, out ) ) {
+    fprintf(stderr, "cannot evaluate expression into one of its own operands\n");
+    return;
+  }
+
+  TensorExpr_eval_scaled( e, out, 1.0, false );
+}
+
+Tensor2D *
+TensorExpr_eval ( TensorExpr *e )
+{
+  if ( e == NULL ) {
+    fprintf(stderr, "cannot evaluate NULL expression\n");
+    return NULL;
+  }
+
+  Tensor2D *result = Tensor2D_create( e->rows, e->cols );
+  TensorExpr_eval_scaled( e, result, 1.0, false );
+  return result;
+}
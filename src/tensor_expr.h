@@ -0,0 +1,43 @@
+#ifndef TENSOR_EXPR_HEADER
+#define TENSOR_EXPR_HEADER
+
+#include "tensor.h"
+
+/* lazy tensor expressions: build a tree of transpose/mult/add/scale nodes over
+   existing tensors and only touch memory when it is evaluated. transposes and
+   scales of a leaf are never materialized (they're folded into strided views),
+   and products like X^T X or X^T y are computed in one pass over X. a product
+   with a concatenation, X^T [X y], gets both from the same single pass. */
+typedef enum {
+  TENSOR_EXPR_LEAF,
+  TENSOR_EXPR_TRANSPOSE,
+  TENSOR_EXPR_MULT,
+  TENSOR_EXPR_ADD,
+  TENSOR_EXPR_SCALE,
+  TENSOR_EXPR_HCAT             /* [A B], side by side */
+} TensorExprOp;
+
+typedef struct TensorExpr {
+  TensorExprOp op;
+  struct TensorExpr *a, *b;  /* operands, owned by this node */
+  Tensor2D *leaf;            /* borrowed, must outlive the expression */
+  double scalar;
+  size_t rows, cols;
+} TensorExpr;
+
+/* node constructors take ownership of their operand expressions. they return
+   NULL (and free the operands) if the shapes don't line up */
+TensorExpr *TensorExpr_leaf      ( Tensor2D *t );
+TensorExpr *TensorExpr_transpose ( TensorExpr *a );
+TensorExpr *TensorExpr_mult      ( TensorExpr *a, TensorExpr *b );
+TensorExpr *TensorExpr_add       ( TensorExpr *a, TensorExpr *b );
+TensorExpr *TensorExpr_scale     ( TensorExpr *a, const double scalar );
+TensorExpr *TensorExpr_hcat      ( TensorExpr *a, TensorExpr *b );
+
+/* evaluation */
+Tensor2D *TensorExpr_eval      ( TensorExpr *e );
+/* reuses out's storage, which mustn't overlap any of the expression's leaves */
+void      TensorExpr_eval_into ( TensorExpr *e, Tensor2D *out );
+void      TensorExpr_destroy   ( TensorExpr **e );
+
+#endif
@@ -0,0 +1,293 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+/* one participant's share of the chunks. front (low 32 bits) is popped by the
+   owner, back (high 32 bits) by thieves, both in a single CAS so they can
+   never hand out the same chunk. padded to keep owners off each other's
+   cache lines. */
+typedef struct {
+  uint64_t range;
+  char padding[ 64 - sizeof(uint64_t) ];
+} StealRange;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t  wake, done;
+
+  pthread_t *workers;
+  size_t num_threads;   /* participants, including the calling thread */
+  bool started, shutdown;
+  uint64_t generation;
+
+  /* current job */
+  ParallelForFn fn;
+  void *ctx;
+  size_t begin, end, grain;
+  StealRange *ranges;
+  size_t chunks_left, active;
+} pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER
+};
+
+/* serializes jobs from independent calling threads */
+static pthread_mutex_t submit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread size_t thread_index  = 0;
+static __thread bool   in_parallel   = false;
+
+static size_t
+default_num_threads ( void )
+{
+  const char *env = getenv( "CML_NUM_THREADS" );
+  if ( env && atol( env ) > 0 )
+    return (size_t) atol( env );
+
+  long cores = sysconf( _SC_NPROCESSORS_ONLN );
+  return cores > 0 ? (size_t) cores : 1;
+}
+
+static bool
+range_pop_front ( StealRange *r, uint32_t *chunk )
+{
+  uint64_t old = __atomic_load_n( &r->range, __ATOMIC_ACQUIRE );
+  for (;;) {
+    uint32_t front = (uint32_t) old, back = (uint32_t) ( old >> 32 );
+    if ( front >= back )
+      return false;
+
+    uint64_t new = ( (uint64_t) back << 32 ) | ( front + 1 );
+    if ( __atomic_compare_exchange_n( &r->range, &old, new, true,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+      *chunk = front;
+      return true;
+    }
+  }
+}
+
+static bool
+range_pop_back ( StealRange *r, uint32_t *chunk )
+{
+  uint64_t old = __atomic_load_n( &r->range, __ATOMIC_ACQUIRE );
+  for (;;) {
+    uint32_t front = (uint32_t) old, back = (uint32_t) ( old >> 32 );
+    if ( front >= back )
+      return false;
+
+    uint64_t new = ( (uint64_t) ( back - 1 ) << 32 ) | front;
+    if ( __atomic_compare_exchange_n( &r->range, &old, new, true,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+      *chunk = back - 1;
+      return true;
+    }
+  }
+}
+
+static void
+pool_run_chunk ( uint32_t chunk )
+{
+  size_t begin = pool.begin + (size_t) chunk * pool.grain;
+  size_t end   = begin + pool.grain < pool.end ? begin + pool.grain : pool.end;
+  pool.fn( begin, end, pool.ctx );
+
+  if ( __atomic_sub_fetch( &pool.chunks_left, 1, __ATOMIC_ACQ_REL ) == 0 ) {
+    pthread_mutex_lock( &pool.lock );
+    pthread_cond_broadcast( &pool.done );
+    pthread_mutex_unlock( &pool.lock );
+  }
+}
+
+static void
+pool_participate ( size_t self )
+{
+  uint32_t chunk;
+  for (;;) {
+    if ( range_pop_front( &pool.ranges[self], &chunk ) ) {
+      pool_run_chunk( chunk );
+      continue;
+    }
+
+    /* own share is exhausted, go steal */
+    bool stole = false;
+    for ( size_t v = 1; v < pool.num_threads && !stole; ++v ) {
+      size_t victim = ( self + v ) % pool.num_threads;
+      if ( range_pop_back( &pool.ranges[victim], &chunk ) ) {
+        pool_run_chunk( chunk );
+        stole = true;
+      }
+    }
+
+    if ( !stole )
+      return;
+  }
+}
+
+static void *
+pool_worker ( void *arg )
+{
+  thread_index = (size_t) arg;
+  in_parallel  = true;
+
+  uint64_t seen = 0;
+  pthread_mutex_lock( &pool.lock );
+  for (;;) {
+    while ( !pool.shutdown && pool.generation == seen )
+      pthread_cond_wait( &pool.wake, &pool.lock );
+    if ( pool.shutdown )
+      break;
+
+    seen = pool.generation;
+    ++pool.active;
+    pthread_mutex_unlock( &pool.lock );
+
+    pool_participate( thread_index );
+
+    pthread_mutex_lock( &pool.lock );
+    if ( --pool.active == 0 )
+      pthread_cond_broadcast( &pool.done );
+  }
+  pthread_mutex_unlock( &pool.lock );
+
+  return NULL;
+}
+
+static void
+pool_start ( void )
+{
+  if ( pool.num_threads == 0 )
+    pool.num_threads = default_num_threads();
+
+  pool.ranges   = calloc( pool.num_threads, sizeof(StealRange) );
+  pool.workers  = calloc( pool.num_threads, sizeof(pthread_t) );
+  pool.shutdown = false;
+
+  size_t started = 1;
+  for ( ; started < pool.num_threads; ++started )
+    if ( pthread_create( &pool.workers[started], NULL, pool_worker, (void *) started ) != 0 ) {
+      perror( "Failed to start thread pool worker" );
+      break;
+    }
+
+  /* run with however many workers we actually got */
+  pool.num_threads = started;
+  pool.started = true;
+}
+
+static void
+pool_stop ( void )
+{
+  if ( !pool.started )
+    return;
+
+  pthread_mutex_lock( &pool.lock );
+  pool.shutdown = true;
+  pthread_cond_broadcast( &pool.wake );
+  pthread_mutex_unlock( &pool.lock );
+
+  for ( size_t i = 1; i < pool.num_threads; ++i )
+    pthread_join( pool.workers[i], NULL );
+
+  free( pool.workers );
+  free( pool.ranges );
+  pool.workers = NULL;
+  pool.ranges  = NULL;
+  pool.started = false;
+}
+
+void
+threadpool_set_threads ( size_t num_threads )
+{
+  pthread_mutex_lock( &submit_lock );
+  pool_stop();
+  pool.num_threads = num_threads ? num_threads : default_num_threads();
+  pthread_mutex_unlock( &submit_lock );
+}
+
+size_t
+threadpool_num_threads ( void )
+{
+  return pool.num_threads ? pool.num_threads : default_num_threads();
+}
+
+void
+threadpool_shutdown ( void )
+{
+  pthread_mutex_lock( &submit_lock );
+  pool_stop();
+  pthread_mutex_unlock( &submit_lock );
+}
+
+size_t
+threadpool_worker_index ( void )
+{
+  return thread_index;
+}
+
+size_t
+parallel_grain ( size_t cost_per_item )
+{
+  if ( cost_per_item == 0 )
+    cost_per_item = 1;
+  size_t grain = PARALLEL_MIN_CHUNK_COST / cost_per_item;
+  return grain ? grain : 1;
+}
+
+void
+parallel_for ( size_t begin, size_t end, size_t grain, ParallelForFn fn, void *ctx )
+{
+  if ( end <= begin )
+    return;
+  if ( grain == 0 )
+    grain = 1;
+
+  /* small ranges, nested calls and single-threaded pools stay serial */
+  if ( end - begin <= grain || in_parallel || threadpool_num_threads() == 1 ) {
+    fn( begin, end, ctx );
+    return;
+  }
+
+  pthread_mutex_lock( &submit_lock );
+  if ( !pool.started )
+    pool_start();
+
+  size_t n = pool.num_threads;
+  size_t chunks = ( end - begin + grain - 1 ) / grain;
+  if ( n == 1 || chunks > UINT32_MAX ) {
+    pthread_mutex_unlock( &submit_lock );
+    fn( begin, end, ctx );
+    return;
+  }
+
+  pthread_mutex_lock( &pool.lock );
+  pool.fn          = fn;
+  pool.ctx         = ctx;
+  pool.begin       = begin;
+  pool.end         = end;
+  pool.grain       = grain;
+  pool.chunks_left = chunks;
+  for ( size_t p = 0; p < n; ++p ) {
+    uint64_t front = chunks * p / n, back = chunks * ( p + 1 ) / n;
+    __atomic_store_n( &pool.ranges[p].range, ( back << 32 ) | front, __ATOMIC_RELEASE );
+  }
+  ++pool.generation;
+  pthread_cond_broadcast( &pool.wake );
+  pthread_mutex_unlock( &pool.lock );
+
+  in_parallel = true;
+  pool_participate( 0 );
+  in_parallel = false;
+
+  /* wait for stolen chunks to finish and every worker to leave the job */
+  pthread_mutex_lock( &pool.lock );
+  while ( __atomic_load_n( &pool.chunks_left, __ATOMIC_ACQUIRE ) > 0 || pool.active > 0 )
+    pthread_cond_wait( &pool.done, &pool.lock );
+  pthread_mutex_unlock( &pool.lock );
+
+  pthread_mutex_unlock( &submit_lock );
+}
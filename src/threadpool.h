@@ -0,0 +1,31 @@
+#ifndef THREADPOOL_HEADER
+#define THREADPOOL_HEADER
+
+#include <stddef.h>
+
+/* small work-stealing pool shared by the whole library (no OpenMP, so an
+   embedding application stays in charge of its own threading).
+
+   parallel_for splits [begin, end) into grain-sized chunks and deals an even
+   share to the calling thread and every worker, idle participants steal
+   chunks from the back of the others' shares. the calling thread always
+   takes part, and nested calls just run serially. */
+typedef void (*ParallelForFn) ( size_t begin, size_t end, void *ctx );
+
+/* 0 picks $CML_NUM_THREADS or the number of online cores. changing the count
+   joins the current workers, new ones are started on the next parallel_for */
+void   threadpool_set_threads ( size_t num_threads );
+size_t threadpool_num_threads ( void );
+void   threadpool_shutdown    ( void );
+
+/* 0 on the calling thread, 1..n-1 on workers (for per-thread scratch) */
+size_t threadpool_worker_index ( void );
+
+void parallel_for ( size_t begin, size_t end, size_t grain, ParallelForFn fn, void *ctx );
+
+/* grain (in items) so a chunk does at least ~PARALLEL_MIN_CHUNK_COST units of
+   work; ranges no larger than one grain run serially on the caller */
+#define PARALLEL_MIN_CHUNK_COST ( (size_t) 1 << 15 )
+size_t parallel_grain ( size_t cost_per_item );
+
+#endif
@@ -1,6 +1,12 @@
 #ifndef UTILITY_HEADER
 #define UTILITY_HEADER
 
+#include <stddef.h>
+#include <stdio.h>
+
+/* monotonic wall clock in seconds, for timing phases and latencies */
+double now_seconds ( void );
+
 inline double clamp(double d, double min, double max) {
   const double t = d < min ? min : d;
   return t > max ? max : t;